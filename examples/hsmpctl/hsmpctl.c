@@ -14,9 +14,14 @@
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 #include "hsmpctl.h"
+#include "hsmpctl_shm.h"
 #include "libhsmp.h"
 
 #define pr_error(...)	fprintf(stderr, "ERROR: " __VA_ARGS__)
@@ -72,47 +77,50 @@ static int parse_value(const char *type, const char *str, int *value)
 	return 0;
 }
 
-/* verify hsmpctld is running */
-static int daemon_is_active(void)
+/* Connection to hsmpctld, opened on first use and kept for all requests */
+static int daemon_fd = -1;
+
+static int daemon_connect(void)
 {
-	char buf[1024];
-	int found;
-	char *cmd;
-	FILE *fp;
+	struct sockaddr_un addr;
 
-	fp = popen("ps -U root", "r");
-	if (!fp)
+	if (daemon_fd != -1)
+		return 0;
+
+	daemon_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (daemon_fd < 0)
 		return -1;
 
-	found = 0;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, HSMPCTL_SOCKET, sizeof(addr.sun_path) - 1);
 
-	while (fgets(buf, sizeof(buf), fp)) {
-		cmd = strstr(buf, "hsmpctld");
-		if (cmd) {
-			found = 1;
-			break;
-		}
+	if (connect(daemon_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		close(daemon_fd);
+		daemon_fd = -1;
+		return -1;
 	}
 
-	pclose(fp);
-	return found;
+	return 0;
+}
+
+/* verify hsmpctld is running */
+static int daemon_is_active(void)
+{
+	return !daemon_connect();
 }
 
 static int write_msg(struct hsmp_msg *msg)
 {
 	ssize_t cnt;
-	int fd;
 
-	fd = open(HSMPCTL_FIFO, O_WRONLY);
-	if (!fd) {
-		pr_error("Could not open pipe to daemon\n%s",
+	if (daemon_connect()) {
+		pr_error("Could not connect to daemon\n%s",
 			 strerror(errno));
 		return -1;
 	}
 
-	cnt = write(fd, msg, sizeof(*msg));
-	close(fd);
-
+	cnt = send(daemon_fd, msg, sizeof(*msg), MSG_NOSIGNAL);
 	if (cnt != sizeof(*msg)) {
 		pr_error("Failed to write to daemon\n%s",
 			 strerror(errno));
@@ -122,22 +130,69 @@ static int write_msg(struct hsmp_msg *msg)
 	return 0;
 }
 
-static int read_msg(struct hsmp_msg *msg)
+/* Write the payload_sz bytes of request payload following a message */
+static int write_payload(const void *payload, int payload_sz)
+{
+	ssize_t cnt;
+	int total;
+
+	for (total = 0; total < payload_sz; total += cnt) {
+		cnt = send(daemon_fd, (const char *)payload + total,
+			   payload_sz - total, MSG_NOSIGNAL);
+		if (cnt < 0 && errno == EINTR) {
+			cnt = 0;
+			continue;
+		}
+
+		if (cnt < 0) {
+			pr_error("Failed to write to daemon\n%s",
+				 strerror(errno));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int read_full(void *buf, int len)
 {
 	ssize_t cnt;
-	int fd;
+	int total;
+
+	for (total = 0; total < len; total += cnt) {
+		cnt = read(daemon_fd, (char *)buf + total, len - total);
+		if (cnt < 0 && errno == EINTR) {
+			cnt = 0;
+			continue;
+		}
+
+		if (cnt <= 0) {
+			/* Treat a closed connection as an I/O error */
+			if (!cnt)
+				errno = EPIPE;
+			return -1;
+		}
+	}
+
+	return 0;
+}
 
-	fd = open(HSMPCTL_FIFO, O_RDONLY);
-	if (!fd) {
-		pr_error("Could not open pipe to daemon\n%s",
+/* Read a reply, any payload is read into the payload buffer */
+static int read_msg(struct hsmp_msg *msg, void *payload, int payload_sz)
+{
+	if (read_full(msg, sizeof(*msg))) {
+		pr_error("Failed to read from daemon\n%s",
 			 strerror(errno));
 		return -1;
 	}
 
-	cnt = read(fd, msg, sizeof(*msg));
-	close(fd);
+	if (msg->payload_sz > payload_sz) {
+		pr_error("Unexpected reply size %d from daemon\n",
+			 msg->payload_sz);
+		return -1;
+	}
 
-	if (cnt != sizeof(*msg)) {
+	if (msg->payload_sz && read_full(payload, msg->payload_sz)) {
 		pr_error("Failed to read from daemon\n%s",
 			 strerror(errno));
 		return -1;
@@ -146,14 +201,9 @@ static int read_msg(struct hsmp_msg *msg)
 	return 0;
 }
 
-static int send_msg(struct hsmp_msg *msg, int expected_responses)
+/* Report the error of a failed reply or an unexpected number of responses */
+static int check_reply(struct hsmp_msg *msg, int expected_responses)
 {
-	if (write_msg(msg))
-		return -1;
-
-	if (read_msg(msg))
-		return -1;
-
 	if (msg->err) {
 		switch (msg->errnum) {
 		case ENOMSG:
@@ -175,6 +225,9 @@ static int send_msg(struct hsmp_msg *msg, int expected_responses)
 		case EINVAL:
 			pr_error("An invalid parameter was specified\n");
 			break;
+		case ENODATA:
+			pr_error("hsmpctld telemetry sampling is disabled\n");
+			break;
 		default:
 			pr_error("An unexpected error occurred;\n%s\n",
 				 strerror(msg->errnum));
@@ -193,6 +246,23 @@ static int send_msg(struct hsmp_msg *msg, int expected_responses)
 	return 0;
 }
 
+static int send_msg_payload(struct hsmp_msg *msg, int expected_responses,
+			    void *payload, int payload_sz)
+{
+	if (write_msg(msg))
+		return -1;
+
+	if (read_msg(msg, payload, payload_sz))
+		return -1;
+
+	return check_reply(msg, expected_responses);
+}
+
+static int send_msg(struct hsmp_msg *msg, int expected_responses)
+{
+	return send_msg_payload(msg, expected_responses, NULL, 0);
+}
+
 static int get_socket(void)
 {
 	if (chosen_socket == -1) {
@@ -549,17 +619,48 @@ static int get_cpu_boost_limit(int cpu)
 	return 0;
 }
 
-static int show_cpu_boost_limit(void)
+/* Read the boost limits of every CPU in a single daemon request */
+static int show_all_cpu_boost_limits(void)
 {
+	struct hsmp_msg msg;
+	int *boost_limits;
 	int i, err;
+
+	if (system_cpus <= 0 || system_cpus > HSMPCTL_MAX_CPUS) {
+		pr_error("Invalid number of CPUs %d\n", system_cpus);
+		return -1;
+	}
+
+	boost_limits = calloc(system_cpus, sizeof(*boost_limits));
+	if (!boost_limits) {
+		pr_error("Could not allocate boost limit table\n");
+		return -1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+
+	msg.msg_id = HSMPCTL_CPU_BOOST_LIMITS;
+	msg.num_args = 1;
+	msg.args[0] = system_cpus;
+
+	err = send_msg_payload(&msg, 1, boost_limits,
+			       system_cpus * sizeof(*boost_limits));
+	if (!err) {
+		for (i = 0; i < msg.payload_sz / sizeof(*boost_limits); i++)
+			printf("CPU %d boost limit: %d mW\n", i, boost_limits[i]);
+	}
+
+	free(boost_limits);
+	return err;
+}
+
+static int show_cpu_boost_limit(void)
+{
+	int err;
 	int cpu;
 
 	if (all_system) {
-		for (i = 0; i < system_cpus; i++) {
-			err = get_cpu_boost_limit(i);
-			if (err)
-				return err;
-		}
+		err = show_all_cpu_boost_limits();
 	} else {
 		cpu = get_cpu();
 		if (cpu == -1) {
@@ -699,16 +800,17 @@ static void help_xgmi_width(void)
 	       "    x16             - 16 lanes\n");
 }
 
+/* Indexed by enum hsmp_xgmi_width */
+static const char *xgmi_width_names[] = {"x2", "x8", "x16"};
+
 static enum hsmp_xgmi_width parse_xgmi_width(const char *arg)
 {
-	if (!strcmp(arg, "x2"))
-		return HSMP_XGMI_WIDTH_X2;
-
-	if (!strcmp(arg, "x8"))
-		return HSMP_XGMI_WIDTH_X8;
+	int i;
 
-	if (!strcmp(arg, "x16"))
-		return HSMP_XGMI_WIDTH_X16;
+	for (i = 0; i < ARRAY_SIZE(xgmi_width_names); i++) {
+		if (!strcmp(arg, xgmi_width_names[i]))
+			return i;
+	}
 
 	pr_error("Invalid xGMI width \"%s\" specified\n", arg);
 	help_xgmi_width();
@@ -1096,6 +1198,743 @@ static int cmd_ddr_bw(int argc, const char **argv)
 	return err;
 }
 
+static void help_power_budget(void)
+{
+	printf("Usage: hsmpctl power_budget [<budget> | off]\n\n"
+	       "Displays the node power budget (in mW) enforced by hsmpctld if no\n"
+	       "<budget> is specified, otherwise hand the node power budget to the\n"
+	       "hsmpctld power governor. The governor splits the budget between\n"
+	       "the sockets after each telemetry sample, shifting power towards\n"
+	       "sockets running at their limit. \"off\" stops the governor and\n"
+	       "leaves the socket power limits as they are. Must be root to set\n"
+	       "the budget, hsmpctld telemetry sampling must be enabled.\n");
+}
+
+static int cmd_power_budget(int argc, const char **argv)
+{
+	struct hsmp_msg msg;
+	int budget;
+	int err;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_id = HSMPCTL_POWER_BUDGET;
+
+	if (argc > 1) {
+		if (!strcmp(argv[1], "off")) {
+			budget = 0;
+		} else {
+			err = parse_value("power budget", argv[1], &budget);
+			if (err || budget <= 0) {
+				help_power_budget();
+				return -1;
+			}
+		}
+
+		/* Setting the power budget requires root access */
+		if (geteuid() != 0) {
+			pr_error("%s\n", strerror(EPERM));
+			return -1;
+		}
+
+		msg.num_args = 1;
+		msg.args[0] = budget;
+	}
+
+	err = send_msg(&msg, 3);
+	if (err)
+		return err;
+
+	if (argc > 1)
+		return 0;
+
+	if (msg.response[0])
+		printf("Power budget: %d mW\n", msg.response[0]);
+	else
+		printf("Power budget: off\n");
+	printf("Governor limit writes: %u, held back: %u\n",
+	       (unsigned int)msg.response[1], (unsigned int)msg.response[2]);
+	return 0;
+}
+
+static void help_df_tuner(void)
+{
+	printf("Usage: hsmpctl df_tuner [on | off]\n\n"
+	       "Displays the state of the hsmpctld data fabric P-state tuner if\n"
+	       "no argument is specified, otherwise start or stop the tuner. The\n"
+	       "tuner sets each socket's DF P-state from its DDR bandwidth\n"
+	       "utilization and C0 residency after each telemetry sample, using\n"
+	       "P0 for memory bound phases and a lower P-state or automatic\n"
+	       "selection otherwise. \"off\" restores automatic DF P-state\n"
+	       "selection. Must be root to start or stop the tuner, hsmpctld\n"
+	       "telemetry sampling must be enabled.\n");
+}
+
+static int cmd_df_tuner(int argc, const char **argv)
+{
+	struct hsmp_msg msg;
+	int err;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_id = HSMPCTL_DF_TUNER;
+
+	if (argc > 1) {
+		if (!strcmp(argv[1], "on")) {
+			msg.args[0] = 1;
+		} else if (strcmp(argv[1], "off")) {
+			help_df_tuner();
+			return -1;
+		}
+
+		/* Starting or stopping the tuner requires root access */
+		if (geteuid() != 0) {
+			pr_error("%s\n", strerror(EPERM));
+			return -1;
+		}
+
+		msg.num_args = 1;
+	}
+
+	err = send_msg(&msg, 3);
+	if (err)
+		return err;
+
+	if (argc > 1)
+		return 0;
+
+	printf("DF P-state tuner: %s\n", msg.response[0] ? "on" : "off");
+	printf("DF P-state changes: %u, deferred: %u\n",
+	       (unsigned int)msg.response[1], (unsigned int)msg.response[2]);
+	return 0;
+}
+
+#define HSMPCTL_PROFILE_DIR	"/etc/hsmpctl/profiles"
+
+static const char *df_pstate_names[] = {"0", "1", "2", "3", "auto"};
+static const char *nbio_pstate_names[] = {"auto", "0"};
+
+static const struct {
+	const char		*name;
+	enum hsmp_setting_t	type;
+} profile_keys[] = {
+	{"socket_power_limit",	HSMP_SETTING_SOCKET_POWER_LIMIT},
+	{"socket_boost_limit",	HSMP_SETTING_SOCKET_BOOST_LIMIT},
+	{"cpu_boost_limit",	HSMP_SETTING_CPU_BOOST_LIMIT},
+	{"df_pstate",		HSMP_SETTING_DF_PSTATE},
+	{"xgmi_width",		HSMP_SETTING_XGMI_WIDTH},
+	{"nbio_pstate",		HSMP_SETTING_NBIO_PSTATE},
+};
+
+static void help_profile(void)
+{
+	printf("Usage: hsmpctl profile apply <profile>\n"
+	       "       hsmpctl profile snapshot [<profile>]\n\n"
+	       "Apply all settings of a profile in a single transaction, if any\n"
+	       "setting fails the settings changed by the profile are restored.\n"
+	       "snapshot writes the current settings as a profile, to stdout if\n"
+	       "no <profile> is specified, which can be applied later to restore\n"
+	       "them. A <profile> without a '/' names the file of that name in\n"
+	       "%s. Must be root to apply a profile.\n\n", HSMPCTL_PROFILE_DIR);
+	printf("Profiles have one setting per line, '#' starts a comment:\n"
+	       "    socket_power_limit <socket> <mW>\n"
+	       "    socket_boost_limit <socket> <MHz>\n"
+	       "    cpu_boost_limit <cpu> <MHz>\n"
+	       "    df_pstate <socket> 0 | 1 | 2 | 3 | auto\n"
+	       "    xgmi_width <min> <max>  (x2, x8 or x16)\n"
+	       "    nbio_pstate <bus> 0 | auto\n");
+}
+
+static int lookup_name(const char **names, int num_names, const char *str)
+{
+	int i;
+
+	for (i = 0; i < num_names; i++) {
+		if (!strcmp(names[i], str))
+			return i;
+	}
+
+	return -1;
+}
+
+static void profile_path(const char *profile, char *buf, size_t len)
+{
+	if (strchr(profile, '/'))
+		snprintf(buf, len, "%s", profile);
+	else
+		snprintf(buf, len, "%s/%s", HSMPCTL_PROFILE_DIR, profile);
+}
+
+/* Parse one profile line, returns 1 for a setting, 0 for none, or -1 */
+static int parse_profile_line(char *line, struct hsmp_setting *setting)
+{
+	char *key, *arg1, *arg2, *extra;
+	int i, target, value, max;
+
+	line[strcspn(line, "#\n")] = '\0';
+
+	key = strtok(line, " \t");
+	if (!key)
+		return 0;
+
+	arg1 = strtok(NULL, " \t");
+	arg2 = strtok(NULL, " \t");
+	extra = strtok(NULL, " \t");
+	if (!arg1 || !arg2 || extra)
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(profile_keys); i++) {
+		if (!strcmp(profile_keys[i].name, key))
+			break;
+	}
+
+	if (i == ARRAY_SIZE(profile_keys))
+		return -1;
+
+	setting->type = profile_keys[i].type;
+
+	switch (setting->type) {
+	case HSMP_SETTING_XGMI_WIDTH:
+		value = lookup_name(xgmi_width_names, ARRAY_SIZE(xgmi_width_names), arg1);
+		max = lookup_name(xgmi_width_names, ARRAY_SIZE(xgmi_width_names), arg2);
+		if (value == -1 || max == -1)
+			return -1;
+
+		setting->target = 0;
+		setting->value = HSMP_XGMI_WIDTHS(value, max);
+		return 1;
+	case HSMP_SETTING_DF_PSTATE:
+		value = lookup_name(df_pstate_names, ARRAY_SIZE(df_pstate_names), arg2);
+		break;
+	case HSMP_SETTING_NBIO_PSTATE:
+		value = lookup_name(nbio_pstate_names, ARRAY_SIZE(nbio_pstate_names), arg2);
+		break;
+	default:
+		if (parse_value("value", arg2, &value))
+			return -1;
+		break;
+	}
+
+	if (value < 0 || parse_value("target", arg1, &target))
+		return -1;
+
+	setting->target = target;
+	setting->value = value;
+	return 1;
+}
+
+static int apply_profile(const char *profile)
+{
+	struct hsmp_setting *settings;
+	char path[PATH_MAX];
+	struct hsmp_msg msg;
+	char line[256];
+	int n, lineno, rc;
+	FILE *fp;
+
+	profile_path(profile, path, sizeof(path));
+	fp = fopen(path, "r");
+	if (!fp) {
+		pr_error("Could not open profile %s\n%s\n", path, strerror(errno));
+		return -1;
+	}
+
+	settings = malloc(HSMPCTL_MAX_PAYLOAD);
+	if (!settings) {
+		fclose(fp);
+		return -1;
+	}
+
+	n = 0;
+	lineno = 0;
+	rc = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (n == HSMPCTL_MAX_SETTINGS) {
+			pr_error("Profile %s has more than %d settings\n", path,
+				 HSMPCTL_MAX_SETTINGS);
+			rc = -1;
+			break;
+		}
+
+		rc = parse_profile_line(line, &settings[n]);
+		if (rc < 0) {
+			pr_error("Invalid setting on line %d of profile %s\n",
+				 lineno, path);
+			break;
+		}
+
+		n += rc;
+		rc = 0;
+	}
+	fclose(fp);
+
+	if (!rc && !n) {
+		pr_error("Profile %s has no settings\n", path);
+		rc = -1;
+	}
+
+	if (!rc) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_id = HSMPCTL_PROFILE_APPLY;
+		msg.payload_sz = n * sizeof(*settings);
+
+		rc = write_msg(&msg) || write_payload(settings, msg.payload_sz) ||
+		     read_msg(&msg, NULL, 0) ? -1 : check_reply(&msg, 0);
+	}
+
+	free(settings);
+	return rc;
+}
+
+static void write_setting(FILE *fp, const struct hsmp_setting *s)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(profile_keys); i++) {
+		if (profile_keys[i].type == s->type)
+			break;
+	}
+
+	if (i == ARRAY_SIZE(profile_keys))
+		return;
+
+	fprintf(fp, "%s ", profile_keys[i].name);
+
+	switch (s->type) {
+	case HSMP_SETTING_XGMI_WIDTH:
+		fprintf(fp, "%s %s\n", xgmi_width_names[(s->value >> 8) % 3],
+			xgmi_width_names[(s->value & 0xFF) % 3]);
+		break;
+	case HSMP_SETTING_DF_PSTATE:
+		fprintf(fp, "%d %s\n", s->target, df_pstate_names[s->value % 5]);
+		break;
+	case HSMP_SETTING_NBIO_PSTATE:
+		fprintf(fp, "0x%02x %s\n", s->target, nbio_pstate_names[s->value % 2]);
+		break;
+	default:
+		fprintf(fp, "%d %u\n", s->target, s->value);
+		break;
+	}
+}
+
+static int snapshot_profile(const char *profile)
+{
+	struct hsmp_setting *settings;
+	char path[PATH_MAX];
+	struct hsmp_msg msg;
+	FILE *fp;
+	int err, i;
+
+	settings = malloc(HSMPCTL_MAX_PAYLOAD);
+	if (!settings)
+		return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_id = HSMPCTL_PROFILE_SNAPSHOT;
+
+	err = send_msg_payload(&msg, 1, settings, HSMPCTL_MAX_PAYLOAD);
+	if (err) {
+		free(settings);
+		return err;
+	}
+
+	fp = stdout;
+	if (profile) {
+		profile_path(profile, path, sizeof(path));
+		fp = fopen(path, "w");
+		if (!fp) {
+			pr_error("Could not create profile %s\n%s\n", path,
+				 strerror(errno));
+			free(settings);
+			return -1;
+		}
+	}
+
+	fprintf(fp, "# hsmpctl profile snapshot\n");
+	for (i = 0; i < msg.payload_sz / sizeof(*settings); i++)
+		write_setting(fp, &settings[i]);
+
+	err = 0;
+	if (profile && fclose(fp)) {
+		pr_error("Could not write profile %s\n%s\n", path, strerror(errno));
+		err = -1;
+	}
+
+	free(settings);
+	return err;
+}
+
+static int cmd_profile(int argc, const char **argv)
+{
+	if (argc == 3 && !strcmp(argv[1], "apply")) {
+		/* Applying a profile requires root access */
+		if (geteuid() != 0) {
+			pr_error("%s\n", strerror(EPERM));
+			return -1;
+		}
+
+		return apply_profile(argv[2]);
+	}
+
+	if ((argc == 2 || argc == 3) && !strcmp(argv[1], "snapshot"))
+		return snapshot_profile(argc == 3 ? argv[2] : NULL);
+
+	help_profile();
+	return -1;
+}
+
+static const struct {
+	const char	*name;
+	unsigned int	mask;
+	const char	*columns;
+} monitor_fields[] = {
+	{"power",	HSMP_TELEMETRY_POWER,		"power_mw"},
+	{"limit",	HSMP_TELEMETRY_POWER_LIMIT,	"power_limit_mw"},
+	{"max",		HSMP_TELEMETRY_MAX_POWER_LIMIT,	"max_power_limit_mw"},
+	{"fclk",	HSMP_TELEMETRY_FABRIC_CLOCKS,	"fclk_mhz,mclk_mhz"},
+	{"cclk",	HSMP_TELEMETRY_CCLK_LIMIT,	"cclk_limit_mhz"},
+	{"c0",		HSMP_TELEMETRY_C0_RESIDENCY,	"c0_residency_pct"},
+	{"prochot",	HSMP_TELEMETRY_PROC_HOT,	"proc_hot"},
+	{"ddr",		HSMP_TELEMETRY_DDR_BANDWIDTH,	"ddr_max_bw_gbps,ddr_bw_gbps,ddr_bw_pct"},
+};
+
+static void help_monitor(void)
+{
+	int i;
+
+	printf("Usage: hsmpctl [-s <socket>] monitor [--interval <ms>] "
+	       "[--fields <field,...>] [--format csv|binary]\n\n"
+	       "Stream timestamped telemetry samples for all sockets, or the\n"
+	       "specified socket, until stopped.\n\n"
+	       "Samples are read from the hsmpctld shared memory ring when the\n"
+	       "interval is no shorter than the daemon sampling interval, which\n"
+	       "is also the default interval. Otherwise each sample is requested\n"
+	       "from hsmpctld.\n\n"
+	       "The csv format prints a header followed by one line per socket\n"
+	       "and sample, fields that could not be read are left empty. The\n"
+	       "binary format writes a struct hsmpctl_sample, see hsmpctl_shm.h,\n"
+	       "per socket and sample.\n\n"
+	       "Fields (default all):");
+
+	for (i = 0; i < ARRAY_SIZE(monitor_fields); i++)
+		printf(" %s", monitor_fields[i].name);
+	printf("\n");
+}
+
+static int parse_monitor_fields(const char *str, unsigned int *mask)
+{
+	char *fields, *field, *save;
+	int i, err = 0;
+
+	fields = strdup(str);
+	if (!fields)
+		return -1;
+
+	*mask = 0;
+	for (field = strtok_r(fields, ",", &save); field;
+	     field = strtok_r(NULL, ",", &save)) {
+		for (i = 0; i < ARRAY_SIZE(monitor_fields); i++) {
+			if (!strcmp(field, monitor_fields[i].name))
+				break;
+		}
+
+		if (i == ARRAY_SIZE(monitor_fields)) {
+			pr_error("Unknown field \"%s\"\n", field);
+			err = -1;
+			break;
+		}
+
+		*mask |= monitor_fields[i].mask;
+	}
+
+	free(fields);
+	return err || !*mask ? -1 : 0;
+}
+
+static void print_csv_header(unsigned int mask)
+{
+	int i;
+
+	printf("timestamp_ns,socket");
+	for (i = 0; i < ARRAY_SIZE(monitor_fields); i++) {
+		if (mask & monitor_fields[i].mask)
+			printf(",%s", monitor_fields[i].columns);
+	}
+	printf("\n");
+}
+
+static void print_csv_sample(int socket, struct hsmpctl_sample *sample,
+			     unsigned int mask)
+{
+	struct hsmp_telemetry *t = &sample->telemetry;
+	int i;
+
+	printf("%llu,%d", (unsigned long long)sample->timestamp_ns, socket);
+
+	for (i = 0; i < ARRAY_SIZE(monitor_fields); i++) {
+		unsigned int field = monitor_fields[i].mask;
+
+		if (!(mask & field))
+			continue;
+
+		if (!(t->valid & field)) {
+			/* Keep the columns of multi-value fields aligned */
+			printf(field == HSMP_TELEMETRY_FABRIC_CLOCKS ? ",," :
+			       field == HSMP_TELEMETRY_DDR_BANDWIDTH ? ",,," : ",");
+			continue;
+		}
+
+		switch (field) {
+		case HSMP_TELEMETRY_POWER:
+			printf(",%u", t->power);
+			break;
+		case HSMP_TELEMETRY_POWER_LIMIT:
+			printf(",%u", t->power_limit);
+			break;
+		case HSMP_TELEMETRY_MAX_POWER_LIMIT:
+			printf(",%u", t->max_power_limit);
+			break;
+		case HSMP_TELEMETRY_FABRIC_CLOCKS:
+			printf(",%d,%d", t->data_fabric_clock, t->mem_clock);
+			break;
+		case HSMP_TELEMETRY_CCLK_LIMIT:
+			printf(",%u", t->cclk_limit);
+			break;
+		case HSMP_TELEMETRY_C0_RESIDENCY:
+			printf(",%u", t->c0_residency);
+			break;
+		case HSMP_TELEMETRY_PROC_HOT:
+			printf(",%d", t->proc_hot);
+			break;
+		case HSMP_TELEMETRY_DDR_BANDWIDTH:
+			printf(",%u,%u,%u", t->ddr_max_bw, t->ddr_utilized_bw,
+			       t->ddr_utilized_pct);
+			break;
+		}
+	}
+
+	printf("\n");
+}
+
+/* Request a sample from hsmpctld when the shared memory ring is not used */
+static int request_sample(int socket, unsigned int mask,
+			  struct hsmpctl_sample *sample)
+{
+	struct hsmp_msg msg;
+	struct timespec ts;
+	int err;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(sample, 0, sizeof(*sample));
+
+	msg.msg_id = HSMPCTL_SOCKET_TELEMETRY;
+	msg.num_args = 2;
+	msg.args[0] = socket;
+	msg.args[1] = mask;
+
+	err = send_msg_payload(&msg, 0, &sample->telemetry,
+			       sizeof(sample->telemetry));
+	if (err)
+		return err;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	sample->timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	return 0;
+}
+
+static int cmd_monitor(int argc, const char **argv)
+{
+	const struct hsmpctl_shm *shm;
+	struct hsmpctl_sample sample;
+	uint64_t last[HSMPCTL_SHM_MAX_SOCKETS];
+	unsigned int mask = HSMP_TELEMETRY_ALL;
+	int first_socket, num_sockets;
+	int interval_ms = 0;
+	struct timespec next;
+	int binary = 0;
+	int use_ring;
+	int i, s;
+
+	for (i = 1; i < argc; i++) {
+		const char *opt = argv[i];
+
+		if (i + 1 == argc) {
+			help_monitor();
+			return -1;
+		}
+
+		if (!strcmp(opt, "--interval")) {
+			if (parse_value("interval", argv[++i], &interval_ms) ||
+			    interval_ms <= 0) {
+				help_monitor();
+				return -1;
+			}
+		} else if (!strcmp(opt, "--fields")) {
+			if (parse_monitor_fields(argv[++i], &mask)) {
+				help_monitor();
+				return -1;
+			}
+		} else if (!strcmp(opt, "--format")) {
+			opt = argv[++i];
+			if (!strcmp(opt, "binary")) {
+				binary = 1;
+			} else if (strcmp(opt, "csv")) {
+				help_monitor();
+				return -1;
+			}
+		} else {
+			help_monitor();
+			return -1;
+		}
+	}
+
+	shm = hsmpctl_shm_open();
+	if (!interval_ms)
+		interval_ms = shm ? shm->interval_ms : 1000;
+
+	/* The ring cannot provide samples faster than hsmpctld takes them */
+	use_ring = shm && interval_ms >= shm->interval_ms;
+
+	num_sockets = shm ? shm->num_sockets : system_sockets;
+	if (num_sockets > HSMPCTL_SHM_MAX_SOCKETS)
+		num_sockets = HSMPCTL_SHM_MAX_SOCKETS;
+
+	first_socket = 0;
+	if (chosen_socket != -1) {
+		first_socket = get_socket();
+		if (first_socket == -1 || first_socket >= num_sockets) {
+			help_monitor();
+			return -1;
+		}
+
+		num_sockets = first_socket + 1;
+	}
+
+	for (s = 0; s < HSMPCTL_SHM_MAX_SOCKETS; s++)
+		last[s] = UINT64_MAX;
+
+	if (!binary)
+		print_csv_header(mask);
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (1) {
+		for (s = first_socket; s < num_sockets; s++) {
+			if (use_ring) {
+				if (hsmpctl_shm_read(shm, s, 0, &sample))
+					continue;
+
+				/* Only report each ring sample once */
+				if (sample.index == last[s])
+					continue;
+
+				last[s] = sample.index;
+				sample.telemetry.valid &= mask;
+			} else if (request_sample(s, mask, &sample)) {
+				continue;
+			} else {
+				sample.index = ++last[s];
+			}
+
+			if (binary)
+				fwrite(&sample, sizeof(sample), 1, stdout);
+			else
+				print_csv_sample(s, &sample, mask);
+		}
+
+		if (fflush(stdout) || ferror(stdout))
+			break;
+
+		/* Fall back to daemon requests if hsmpctld restarts */
+		if (use_ring &&
+		    __atomic_load_n(&shm->magic, __ATOMIC_RELAXED) != HSMPCTL_SHM_MAGIC) {
+			hsmpctl_shm_close(shm);
+			shm = NULL;
+			use_ring = 0;
+		}
+
+		next.tv_nsec += (interval_ms % 1000) * 1000000;
+		next.tv_sec += interval_ms / 1000 + next.tv_nsec / 1000000000;
+		next.tv_nsec %= 1000000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	if (shm)
+		hsmpctl_shm_close(shm);
+
+	return -1;
+}
+
+static void help_energy(void)
+{
+	printf("Usage: hsmpctl energy [<command> [<args>]]\n\n"
+	       "Display the energy (in J) used by each socket since hsmpctld\n"
+	       "started, or run <command> and display the energy used by each\n"
+	       "socket while it ran, returning the exit status of <command>.\n"
+	       "The energy is integrated by hsmpctld from its telemetry samples,\n"
+	       "which must be enabled, reading it causes no HSMP mailbox traffic.\n");
+}
+
+static int cmd_energy(int argc, const char **argv)
+{
+	uint64_t used[HSMPCTL_SHM_MAX_SOCKETS];
+	const struct hsmpctl_shm *shm;
+	struct hsmpctl_energy start;
+	uint64_t elapsed_ns;
+	int status, s;
+	pid_t pid;
+
+	shm = hsmpctl_shm_open();
+	if (!shm) {
+		pr_error("No telemetry samples published by hsmpctld\n%s\n",
+			 strerror(errno));
+		return -1;
+	}
+
+	status = hsmpctl_energy_begin(shm, &start);
+	if (status) {
+		pr_error("%s\n", strerror(errno));
+		hsmpctl_shm_close(shm);
+		return -1;
+	}
+
+	if (argc == 1) {
+		for (s = 0; s < start.num_sockets; s++)
+			printf("Socket %d energy: %.3f J\n", s, start.energy_mj[s] / 1e3);
+
+		hsmpctl_shm_close(shm);
+		return 0;
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		pr_error("%s\n", strerror(errno));
+		hsmpctl_shm_close(shm);
+		return -1;
+	}
+
+	if (!pid) {
+		execvp(argv[1], (char * const *)&argv[1]);
+		pr_error("%s: %s\n", argv[1], strerror(errno));
+		_exit(127);
+	}
+
+	while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+		;
+
+	if (hsmpctl_energy_end(&start, used, &elapsed_ns)) {
+		pr_error("%s\n", strerror(errno));
+		hsmpctl_shm_close(shm);
+		return -1;
+	}
+
+	for (s = 0; s < start.num_sockets; s++)
+		printf("Socket %d energy: %.3f J\n", s, used[s] / 1e3);
+	printf("Elapsed: %.3f s\n", elapsed_ns / 1e9);
+
+	hsmpctl_shm_close(shm);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
 static void help_stop_daemon(void)
 {
 	printf("Usage: hsmpctl stop\n\n"
@@ -1119,18 +1958,48 @@ static int stop_daemon(int argc, const char **argv)
 
 static void help_start_daemon(void)
 {
-	printf("Usage: hsmpctl start\n\n"
-	       "Start the hsmpctld daemon, must be run as root.\n");
+	printf("Usage: hsmpctl start [interval [port]]\n\n"
+	       "Start the hsmpctld daemon, must be run as root.\n\n"
+	       "hsmpctld publishes socket telemetry every interval milliseconds\n"
+	       "(default 1000, 0 to disable) in the shared memory ring\n"
+	       "/dev/shm%s, see hsmpctl_shm.h.\n\n"
+	       "If a port is specified the telemetry and HSMP mailbox counters are\n"
+	       "also served as OpenMetrics at http://127.0.0.1:<port>/metrics.\n",
+	       HSMPCTL_SHM_NAME);
 }
 
 int start_daemon(int argc, const char **argv)
 {
+	const char *interval, *port;
 	const char *cmd;
+	int interval_ms, port_num;
 	pid_t pid;
 	int err;
 
 	cmd = HSMPCTLD_CMD;
 
+	interval = NULL;
+	if (argc > 1) {
+		if (parse_value("interval", argv[1], &interval_ms) ||
+		    interval_ms < 0) {
+			help_start_daemon();
+			return -1;
+		}
+
+		interval = argv[1];
+	}
+
+	port = NULL;
+	if (argc > 2) {
+		if (parse_value("port", argv[2], &port_num) ||
+		    port_num <= 0 || port_num > 0xFFFF) {
+			help_start_daemon();
+			return -1;
+		}
+
+		port = argv[2];
+	}
+
 	if (daemon_is_active()) {
 		printf("hsmpctld is already active\n");
 		return 0;
@@ -1145,7 +2014,12 @@ int start_daemon(int argc, const char **argv)
 		return 0;
 	}
 
-	err = execlp(cmd, cmd,  NULL);
+	if (port)
+		err = execlp(cmd, cmd, "-i", interval, "-p", port, NULL);
+	else if (interval)
+		err = execlp(cmd, cmd, "-i", interval, NULL);
+	else
+		err = execlp(cmd, cmd, NULL);
 	if (err)
 		pr_error("%s\n", strerror(errno));
 
@@ -1198,6 +2072,11 @@ static struct hsmp_cmd hsmp_commands[] = {
 	{"c0_residency",	cmd_c0_residency,	help_c0_residency,		USER},
 	{"nbio_pstate",		cmd_nbio_pstate,	help_nbio_pstate,		ROOT},
 	{"ddr_bw",		cmd_ddr_bw,		help_ddr_bw,			USER},
+	{"monitor",		cmd_monitor,		help_monitor,			USER},
+	{"energy",		cmd_energy,		help_energy,			USER},
+	{"power_budget",	cmd_power_budget,	help_power_budget,		FUNC},
+	{"df_tuner",		cmd_df_tuner,		help_df_tuner,			FUNC},
+	{"profile",		cmd_profile,		help_profile,			FUNC},
 	{"start",		start_daemon,		help_start_daemon,		ROOT},
 	{"stop",		stop_daemon,		help_stop_daemon,		ROOT},
 };
@@ -7,7 +7,7 @@
  * AMD Host System Management Port command
  */
 
-enum hsmp_msg_t {
+enum hsmpctl_msg_t {
 	HSMPCTL_GET_VERSION = 1,
 	HSMPCTL_SOCKET_POWER,
 	HSMPCTL_SOCKET_POWER_LIMIT,
@@ -28,19 +28,70 @@ enum hsmp_msg_t {
 	HSMPCTL_NBIO_PSTATE_ALL,
 	HSMPCTL_NBIO_NEXT_BUS,
 	HSMPCTL_DDR_BW,
+	HSMPCTL_CPU_BOOST_LIMITS,
+	HSMPCTL_SOCKET_TELEMETRY,
+	HSMPCTL_POWER_BUDGET,
+	HSMPCTL_DF_TUNER,
+	HSMPCTL_PROFILE_APPLY,
+	HSMPCTL_PROFILE_SNAPSHOT,
 	HSMPCTLD_START,
 	HSMPCTLD_EXIT,
 };
 
 struct hsmp_msg {
-	enum hsmp_msg_t	msg_id;
-	int		err;
-	int		errnum;
-	int		num_args;
-	int		num_responses;
-	int		args[8];
-	int		response[8];
+	enum hsmpctl_msg_t	msg_id;
+	int			err;
+	int			errnum;
+	int			num_args;
+	int			num_responses;
+	int			args[8];
+	int			response[8];
+	int			payload_sz;	/* Bytes following the message */
 };
 
+/* Largest request or reply payload */
+#define HSMPCTL_MAX_SETTINGS	16384
+#define HSMPCTL_MAX_PAYLOAD	(HSMPCTL_MAX_SETTINGS * sizeof(struct hsmp_setting))
+
+/*
+ * HSMPCTL_CPU_BOOST_LIMITS takes the number of CPUs in args[0] and replies
+ * with a payload of one u32 boost limit per CPU, starting at CPU 0.
+ */
+#define HSMPCTL_MAX_CPUS	8192
+
+/*
+ * HSMPCTL_SOCKET_TELEMETRY takes a socket in args[0] and a HSMP_TELEMETRY_*
+ * mask in args[1], the reply payload is a struct hsmp_telemetry.
+ */
+
+/*
+ * HSMPCTL_POWER_BUDGET sets the node power budget in mW to args[0] if
+ * given, 0 turns the power governor off. It fails with ENODATA while
+ * sampling is disabled. The reply is the budget, the number of limits
+ * written by the governor and the number of changes it held back.
+ */
+
+/*
+ * HSMPCTL_DF_TUNER enables the DF P-state tuner if args[0] is non-zero,
+ * 0 stops it and restores automatic DF P-state selection. It fails with
+ * ENODATA while sampling is disabled. The reply is 1 if the tuner is
+ * enabled, the number of DF P-state changes made and the number of
+ * samples a change to a slower DF P-state was deferred.
+ */
+
+/*
+ * HSMPCTL_PROFILE_APPLY applies the array of struct hsmp_setting in the
+ * request payload with hsmp_apply_profile(). HSMPCTL_PROFILE_SNAPSHOT
+ * replies with the settings from hsmp_snapshot_profile() as payload, and
+ * the number of settings in response[0].
+ */
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
-#define HSMPCTL_FIFO "/tmp/hsmpctl"
+
+/*
+ * hsmpctld listens on a Unix stream socket. A connection may be kept open
+ * for any number of requests, each a struct hsmp_msg followed by
+ * payload_sz bytes of payload, answered in order by the updated struct
+ * hsmp_msg followed by payload_sz bytes of payload.
+ */
+#define HSMPCTL_SOCKET "/run/hsmpctl.sock"
@@ -0,0 +1,250 @@
+/* SPDX-License-Identifier: MIT License */
+/*
+ * Copyright (C) 2021 Advanced Micro Devices, Inc. - All Rights Reserved
+ *
+ * Author: Nathan Fontenot <nathan.fontenot@amd.com>
+ *
+ * hsmpctld shared memory telemetry ring
+ */
+
+#ifndef HSMPCTL_SHM_H
+#define HSMPCTL_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "libhsmp.h"
+
+/*
+ * When sampling is enabled hsmpctld reads the telemetry of every socket
+ * at a fixed interval and publishes it in the POSIX shared memory object
+ * HSMPCTL_SHM_NAME (/dev/shm/hsmpctl-telemetry). Any user may map it
+ * read-only, reading a sample needs no syscalls, root privileges or HSMP
+ * locking, so any number of readers costs a single sampling stream.
+ *
+ * Each socket has a ring of HSMPCTL_SHM_SLOTS samples. head counts the
+ * samples published for the socket, the newest one is found at
+ * slots[(head - 1) % HSMPCTL_SHM_SLOTS]. Each sample is protected by a
+ * seqlock, seq is odd while hsmpctld is updating the sample.
+ *
+ * energy_mj is the energy used by the socket since hsmpctld started,
+ * integrated from the socket power of consecutive samples over their
+ * timestamps. Samples that fail to read the power do not add energy, the
+ * next good sample accounts for the whole gap.
+ */
+#define HSMPCTL_SHM_NAME	"/hsmpctl-telemetry"
+#define HSMPCTL_SHM_MAGIC	0x504d5348	/* "HSMP" */
+#define HSMPCTL_SHM_VERSION	2
+#define HSMPCTL_SHM_SLOTS	64
+#define HSMPCTL_SHM_MAX_SOCKETS	8
+#define HSMPCTL_SHM_RETRIES	1000
+
+struct hsmpctl_sample {
+	uint32_t		seq;
+	int			err;		/* errno of a failed sample, or 0 */
+	uint64_t		index;		/* Sample number, see head */
+	uint64_t		timestamp_ns;	/* CLOCK_MONOTONIC */
+	uint64_t		energy_mj;
+	struct hsmp_telemetry	telemetry;
+};
+
+struct hsmpctl_ring {
+	uint64_t		head;
+	struct hsmpctl_sample	slots[HSMPCTL_SHM_SLOTS];
+};
+
+/* magic is cleared when hsmpctld exits, readers should then re-open */
+struct hsmpctl_shm {
+	uint32_t		magic;
+	uint32_t		version;
+	uint32_t		num_sockets;
+	uint32_t		interval_ms;
+	struct hsmpctl_ring	rings[];
+};
+
+#define HSMPCTL_SHM_SIZE(sockets) \
+	(sizeof(struct hsmpctl_shm) + (sockets) * sizeof(struct hsmpctl_ring))
+
+/*
+ * Map the telemetry ring read-only, returns NULL with errno set if
+ * hsmpctld is not publishing samples. Release with hsmpctl_shm_close().
+ */
+static inline const struct hsmpctl_shm *hsmpctl_shm_open(void)
+{
+	const struct hsmpctl_shm *shm;
+	struct stat st;
+	int fd;
+
+	fd = shm_open(HSMPCTL_SHM_NAME, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) || st.st_size < (off_t)HSMPCTL_SHM_SIZE(0)) {
+		close(fd);
+		errno = ENODATA;
+		return NULL;
+	}
+
+	shm = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if (shm->magic != HSMPCTL_SHM_MAGIC ||
+	    shm->version != HSMPCTL_SHM_VERSION ||
+	    st.st_size < (off_t)HSMPCTL_SHM_SIZE(shm->num_sockets)) {
+		munmap((void *)shm, st.st_size);
+		errno = ENODATA;
+		return NULL;
+	}
+
+	return shm;
+}
+
+static inline void hsmpctl_shm_close(const struct hsmpctl_shm *shm)
+{
+	munmap((void *)shm, HSMPCTL_SHM_SIZE(shm->num_sockets));
+}
+
+/*
+ * Copy the sample taken age intervals before the newest one (age 0 is
+ * the newest) for the specified socket. Returns 0 on success or -1 with
+ * errno set to
+ *	EINVAL	invalid socket_id
+ *	ENOENT	no such sample has been published
+ *	ESTALE	hsmpctld has exited, re-open the ring
+ *	EAGAIN	the sample was overwritten while reading
+ */
+static inline int hsmpctl_shm_read(const struct hsmpctl_shm *shm, int socket_id,
+				   unsigned int age, struct hsmpctl_sample *sample)
+{
+	const struct hsmpctl_sample *slot;
+	const struct hsmpctl_ring *ring;
+	uint64_t head;
+	uint32_t seq;
+	int i;
+
+	if (socket_id < 0 || socket_id >= (int)shm->num_sockets) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	ring = &shm->rings[socket_id];
+
+	for (i = 0; i < HSMPCTL_SHM_RETRIES; i++) {
+		if (__atomic_load_n(&shm->magic, __ATOMIC_RELAXED) != HSMPCTL_SHM_MAGIC) {
+			errno = ESTALE;
+			return -1;
+		}
+
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (age >= head || age >= HSMPCTL_SHM_SLOTS - 1) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		slot = &ring->slots[(head - 1 - age) % HSMPCTL_SHM_SLOTS];
+
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(sample, slot, sizeof(*sample));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		/* A slot reused for a newer sample also fails the index check */
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq &&
+		    sample->index == head - 1 - age)
+			return 0;
+	}
+
+	errno = EAGAIN;
+	return -1;
+}
+
+/*
+ * Energy accounting. hsmpctl_energy_begin() records the energy used so
+ * far by every socket, hsmpctl_energy_end() stores the energy in mJ each
+ * socket used since then in energy_mj[0 .. num_sockets - 1] and the
+ * elapsed time in elapsed_ns. Both extrapolate the newest sample to the
+ * time of the call using its socket power, for at most two sampling
+ * intervals, so short measurements are not quantized to the sampling
+ * interval. Neither causes HSMP mailbox traffic. Both return 0 on success
+ * or -1 with errno set as for hsmpctl_shm_read().
+ */
+struct hsmpctl_energy {
+	const struct hsmpctl_shm	*shm;
+	uint32_t			num_sockets;
+	uint64_t			timestamp_ns;
+	uint64_t			energy_mj[HSMPCTL_SHM_MAX_SOCKETS];
+};
+
+static inline int hsmpctl_energy_read(struct hsmpctl_energy *e)
+{
+	struct hsmpctl_sample sample;
+	uint64_t age_ns, max_ns;
+	struct timespec ts;
+	uint32_t s;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	e->timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	max_ns = 2 * e->shm->interval_ms * 1000000ULL;
+
+	for (s = 0; s < e->num_sockets; s++) {
+		if (hsmpctl_shm_read(e->shm, s, 0, &sample))
+			return -1;
+
+		e->energy_mj[s] = sample.energy_mj;
+		if (!(sample.telemetry.valid & HSMP_TELEMETRY_POWER))
+			continue;
+
+		age_ns = e->timestamp_ns - sample.timestamp_ns;
+		if (age_ns > max_ns)
+			age_ns = max_ns;
+
+		/* mW * ns = 1e-9 mJ */
+		e->energy_mj[s] += sample.telemetry.power * age_ns / 1000000000ULL;
+	}
+
+	return 0;
+}
+
+static inline int hsmpctl_energy_begin(const struct hsmpctl_shm *shm,
+				       struct hsmpctl_energy *e)
+{
+	e->shm = shm;
+	e->num_sockets = shm->num_sockets;
+	if (e->num_sockets > HSMPCTL_SHM_MAX_SOCKETS)
+		e->num_sockets = HSMPCTL_SHM_MAX_SOCKETS;
+
+	return hsmpctl_energy_read(e);
+}
+
+static inline int hsmpctl_energy_end(const struct hsmpctl_energy *start,
+				     uint64_t *energy_mj, uint64_t *elapsed_ns)
+{
+	struct hsmpctl_energy end = *start;
+	uint32_t s;
+
+	if (hsmpctl_energy_read(&end))
+		return -1;
+
+	/* Extrapolation may overshoot the next sample by a little */
+	for (s = 0; s < end.num_sockets; s++)
+		energy_mj[s] = end.energy_mj[s] > start->energy_mj[s] ?
+			       end.energy_mj[s] - start->energy_mj[s] : 0;
+
+	if (elapsed_ns)
+		*elapsed_ns = end.timestamp_ns - start->timestamp_ns;
+
+	return 0;
+}
+
+#endif
@@ -7,16 +7,36 @@
  * AMD Host System Management Port command daemon
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "../../libhsmp.h"
 #include "hsmpctl.h"
+#include "hsmpctl_shm.h"
+
+/*
+ * Payloads received with the request and sent after the reply, per thread
+ * as the socket workers handle requests as well
+ */
+static __thread void *request_payload;
+static __thread int request_payload_sz;
+static __thread void *reply_payload;
 
 static int valid_num_args(struct hsmp_msg *msg, int expected_args)
 {
@@ -216,6 +236,81 @@ static void hsmpctld_cpu_boost_limit(struct hsmp_msg *msg)
 	msg->response[0] = boost_limit;
 }
 
+static void hsmpctld_cpu_boost_limits(struct hsmp_msg *msg)
+{
+	u32 *boost_limits;
+	int i, num_cpus;
+	int *cpus;
+	int err;
+
+	if (!valid_num_args(msg, 1))
+		return;
+
+	num_cpus = msg->args[0];
+	if (num_cpus <= 0 || num_cpus > HSMPCTL_MAX_CPUS) {
+		msg->err = -1;
+		msg->errnum = EINVAL;
+		return;
+	}
+
+	cpus = malloc(num_cpus * sizeof(*cpus));
+	boost_limits = malloc(num_cpus * sizeof(*boost_limits));
+	if (!cpus || !boost_limits) {
+		free(cpus);
+		free(boost_limits);
+		msg->err = -1;
+		msg->errnum = ENOMEM;
+		return;
+	}
+
+	for (i = 0; i < num_cpus; i++)
+		cpus[i] = i;
+
+	err = hsmp_cpu_boost_limits(cpus, num_cpus, boost_limits);
+	free(cpus);
+
+	if (err) {
+		free(boost_limits);
+		msg->err = err;
+		msg->errnum = errno;
+		return;
+	}
+
+	msg->num_responses = 1;
+	msg->response[0] = num_cpus;
+	msg->payload_sz = num_cpus * sizeof(*boost_limits);
+	reply_payload = boost_limits;
+}
+
+static void hsmpctld_socket_telemetry(struct hsmp_msg *msg)
+{
+	struct hsmp_telemetry *telemetry;
+	int err;
+
+	if (!valid_num_args(msg, 2))
+		return;
+
+	telemetry = calloc(1, sizeof(*telemetry));
+	if (!telemetry) {
+		msg->err = -1;
+		msg->errnum = ENOMEM;
+		return;
+	}
+
+	err = hsmp_socket_telemetry(msg->args[0], telemetry, msg->args[1]);
+
+	/* Fields that could not be read are left out of telemetry->valid */
+	if (err && !telemetry->valid) {
+		free(telemetry);
+		msg->err = err;
+		msg->errnum = errno;
+		return;
+	}
+
+	msg->payload_sz = sizeof(*telemetry);
+	reply_payload = telemetry;
+}
+
 static void hsmpctld_proc_hot(struct hsmp_msg *msg)
 {
 	int proc_hot;
@@ -436,32 +531,574 @@ static void hsmpctld_ddr_bw(struct hsmp_msg *msg)
 	msg->response[2] = percent;
 }
 
+/*
+ * Socket power governor
+ *
+ * Once a node power budget is set with HSMPCTL_POWER_BUDGET the budget is
+ * split between the sockets after each telemetry sample. Socket power is
+ * smoothed with a moving average weighing each sample 1/GOV_SMOOTHING. A
+ * socket drawing within GOV_HEADROOM of its limit is taken to be held back
+ * by it and asks for GOV_STEP more, any other socket asks for its power
+ * plus GOV_HEADROOM.
+ * The budget is filled evenly up to each demand, every socket getting at
+ * least GOV_MIN_SHARE percent of an even split, and what is left over is
+ * spread evenly up to the maximum limits.
+ *
+ * A limit is only rewritten when the new limit differs by more than
+ * GOV_HYSTERESIS, raises are limited to GOV_STEP per sample, and a write
+ * repeating the last limit written to a socket is suppressed while the
+ * socket is still at the limit the SMU applied for it, which may have been
+ * clipped. A failed write, or a limit changed by anyone else, is written
+ * again with the next sample. Limits are written by the socket workers,
+ * raised limits only once every lowered limit has been written, so the
+ * sum of the limits never exceeds the budget. The budget is not split
+ * again while limits are still being written.
+ */
+#define GOV_HEADROOM		5000	/* mW */
+#define GOV_STEP		10000	/* mW */
+#define GOV_HYSTERESIS		2000	/* mW */
+#define GOV_MIN_SHARE		50	/* Percent of an even split */
+#define GOV_SMOOTHING		4
+
+static struct {
+	int		num_sockets;	/* 0 while sampling is disabled */
+	u32		budget;		/* mW, 0 if the governor is off */
+	u32		power[HSMPCTL_SHM_MAX_SOCKETS];	/* Smoothed, mW */
+	u32		written[HSMPCTL_SHM_MAX_SOCKETS];	/* 0 if unknown */
+	u32		applied[HSMPCTL_SHM_MAX_SOCKETS];	/* Read back */
+	u32		raise[HSMPCTL_SHM_MAX_SOCKETS];		/* 0 if none */
+	int		in_flight;	/* Limits queued and not written yet */
+	unsigned int	writes;
+	unsigned int	suppressed;	/* Changes held back by hysteresis */
+} gov;
+
+static void queue_work(const struct hsmp_msg *msg,
+		       void (*work)(struct hsmp_msg *msg),
+		       void (*done)(const struct hsmp_msg *msg));
+
+static u32 min_u32(u32 a, u32 b)
+{
+	return a < b ? a : b;
+}
+
+/* Raise each target evenly towards its cap, returns the budget left over */
+static u32 gov_fill(u32 *target, const u32 *cap, int n, u32 budget)
+{
+	int open, i;
+	u32 share, add;
+
+	for (;;) {
+		open = 0;
+		for (i = 0; i < n; i++) {
+			if (target[i] < cap[i])
+				open++;
+		}
+
+		if (!open || budget < open)
+			return budget;
+
+		share = budget / open;
+		for (i = 0; i < n; i++) {
+			if (target[i] >= cap[i])
+				continue;
+
+			add = min_u32(share, cap[i] - target[i]);
+			target[i] += add;
+			budget -= add;
+		}
+	}
+}
+
+/* Runs on the socket worker, replies with the limit the SMU applied */
+static void gov_set_limit(struct hsmp_msg *msg)
+{
+	u32 applied;
+
+	if (hsmp_set_socket_power_limit(msg->args[0], msg->args[1])) {
+		msg->err = -1;
+		msg->errnum = errno;
+		return;
+	}
+
+	/* The SMU clips the limit */
+	if (hsmp_socket_power_limit(msg->args[0], &applied))
+		applied = 0;
+
+	msg->num_responses = 1;
+	msg->response[0] = applied;
+}
+
+static void gov_queue(int socket_id, u32 limit);
+
+/* Write the raised limits once the lowered limits have been written */
+static void gov_raise(void)
+{
+	u32 limit;
+	int i;
+
+	for (i = 0; i < gov.num_sockets; i++) {
+		limit = gov.raise[i];
+		gov.raise[i] = 0;
+		if (limit)
+			gov_queue(i, limit);
+	}
+}
+
+static void gov_written(const struct hsmp_msg *msg)
+{
+	int socket_id = msg->args[0];
+
+	gov.in_flight--;
+	gov.written[socket_id] = 0;
+	if (!msg->err) {
+		gov.writes++;
+		if (msg->response[0]) {
+			gov.written[socket_id] = msg->args[1];
+			gov.applied[socket_id] = msg->response[0];
+		}
+	}
+
+	if (!gov.in_flight)
+		gov_raise();
+}
+
+static void gov_queue(int socket_id, u32 limit)
+{
+	struct hsmp_msg msg = { 0 };
+
+	msg.msg_id = HSMPCTL_SET_SOCKET_POWER_LIMIT;
+	msg.num_args = 2;
+	msg.args[0] = socket_id;
+	msg.args[1] = limit;
+
+	gov.in_flight++;
+	queue_work(&msg, gov_set_limit, gov_written);
+}
+
+static void gov_write(int socket_id, u32 limit, u32 cur)
+{
+	if (limit == gov.written[socket_id] && cur == gov.applied[socket_id]) {
+		gov.suppressed++;
+		return;
+	}
+
+	if (limit < cur)
+		gov_queue(socket_id, limit);
+	else
+		gov.raise[socket_id] = limit;
+}
+
+static void govern_power(const struct hsmp_telemetry *t, const int *err, int n)
+{
+	u32 demand[HSMPCTL_SHM_MAX_SOCKETS], target[HSMPCTL_SHM_MAX_SOCKETS];
+	u32 limit[HSMPCTL_SHM_MAX_SOCKETS];
+	u32 floor, spare, cur, max;
+	uint64_t total;
+	int i, lower;
+
+	if (!gov.budget || gov.in_flight || n <= 0)
+		return;
+
+	/* Only split the budget with a complete picture of the node */
+	for (i = 0; i < n; i++) {
+		if (err[i])
+			return;
+	}
+
+	floor = gov.budget / n * GOV_MIN_SHARE / 100;
+	for (i = 0; i < n; i++) {
+		cur = t[i].power_limit;
+		max = t[i].max_power_limit;
+
+		if (gov.power[i])
+			gov.power[i] += ((int)t[i].power - (int)gov.power[i]) / GOV_SMOOTHING;
+		else
+			gov.power[i] = t[i].power;
+
+		if (gov.power[i] + GOV_HEADROOM >= cur)
+			demand[i] = cur + GOV_STEP;
+		else
+			demand[i] = gov.power[i] + GOV_HEADROOM;
+
+		if (demand[i] < floor)
+			demand[i] = floor;
+		demand[i] = min_u32(demand[i], max);
+		target[i] = 0;
+	}
+
+	spare = gov_fill(target, demand, n, gov.budget);
+	if (spare) {
+		for (i = 0; i < n; i++)
+			demand[i] = t[i].max_power_limit;
+		gov_fill(target, demand, n, spare);
+	}
+
+	total = 0;
+	for (i = 0; i < n; i++) {
+		cur = t[i].power_limit;
+		if (target[i] > cur + GOV_HYSTERESIS)
+			limit[i] = min_u32(target[i], cur + GOV_STEP);
+		else if (target[i] + GOV_HYSTERESIS < cur)
+			limit[i] = target[i];
+		else
+			limit[i] = cur;
+
+		total += limit[i];
+	}
+
+	/* Limits held within the hysteresis band must still fit the budget */
+	if (total > gov.budget) {
+		for (i = 0; i < n; i++) {
+			if (target[i] < limit[i])
+				limit[i] = target[i];
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		if (limit[i] == t[i].power_limit && target[i] != limit[i])
+			gov.suppressed++;
+	}
+
+	for (lower = 1; lower >= 0; lower--) {
+		for (i = 0; i < n; i++) {
+			cur = t[i].power_limit;
+			if (limit[i] != cur && (limit[i] < cur) == lower)
+				gov_write(i, limit[i], cur);
+		}
+	}
+
+	if (!gov.in_flight)
+		gov_raise();
+}
+
+/*
+ * Set the node power budget if args[0] is given, 0 turns the governor
+ * off. Replies with the budget and the governor write counters.
+ */
+static void hsmpctld_power_budget(struct hsmp_msg *msg)
+{
+	if (msg->num_args > 1 || (msg->num_args && msg->args[0] < 0)) {
+		msg->err = -1;
+		msg->errnum = EINVAL;
+		return;
+	}
+
+	if (msg->num_args) {
+		if (!gov.num_sockets) {
+			msg->err = -1;
+			msg->errnum = ENODATA;
+			return;
+		}
+
+		gov.budget = msg->args[0];
+		memset(gov.power, 0, sizeof(gov.power));
+		memset(gov.written, 0, sizeof(gov.written));
+		memset(gov.raise, 0, sizeof(gov.raise));
+	}
+
+	msg->num_responses = 3;
+	msg->response[0] = gov.budget;
+	msg->response[1] = gov.writes;
+	msg->response[2] = gov.suppressed;
+}
+
+/*
+ * Data fabric P-state tuner
+ *
+ * Firmware's automatic DF P-state selection is slow to follow bursty
+ * memory traffic. Once enabled with HSMPCTL_DF_TUNER the tuner picks a DF
+ * P-state for each socket from every telemetry sample: P0 while DDR
+ * bandwidth utilization is at least DF_P0_PCT, P1 from DF_P1_PCT, and
+ * otherwise DF_COMPUTE_PSTATE while C0 residency is at least DF_BUSY_PCT,
+ * leaving fabric power to core boost, or automatic selection when the
+ * socket is mostly idle.
+ *
+ * A socket stays in its current state until the signal falls
+ * DF_HYSTERESIS percentage points below the threshold that selected it.
+ * Moving to a faster state is done right away, moving to a slower one only
+ * once the current state has not been wanted for DF_SETTLE_MS, so a short
+ * lull in a memory bound phase does not drop the fabric clock. The socket
+ * then moves to the fastest state wanted while settling.
+ */
+#define DF_P0_PCT		60
+#define DF_P1_PCT		30
+#define DF_BUSY_PCT		50
+#define DF_HYSTERESIS		10
+#define DF_SETTLE_MS		3000
+#define DF_COMPUTE_PSTATE	HSMP_DF_PSTATE_2
+#define DF_UNKNOWN		-1
+
+static struct {
+	int		num_sockets;	/* 0 while sampling is disabled */
+	int		interval_ms;
+	int		enabled;
+	int		pstate[HSMPCTL_SHM_MAX_SOCKETS];	/* Last set */
+	int		pending[HSMPCTL_SHM_MAX_SOCKETS];
+	int		pending_ms[HSMPCTL_SHM_MAX_SOCKETS];
+	unsigned int	changes;
+	unsigned int	deferred;	/* Samples a slower state was held off */
+} df;
+
+/* The threshold to stay in pstate or a faster one is DF_HYSTERESIS lower */
+static int df_threshold(int cur, int pstate, int pct)
+{
+	return cur != DF_UNKNOWN && cur <= pstate ? pct - DF_HYSTERESIS : pct;
+}
+
+/* Higher values mean a slower fabric, HSMP_DF_PSTATE_AUTO is the slowest */
+static int df_pick(const struct hsmp_telemetry *t, int cur)
+{
+	int bw = t->ddr_utilized_pct;
+	int c0 = t->c0_residency;
+
+	if (bw >= df_threshold(cur, HSMP_DF_PSTATE_0, DF_P0_PCT))
+		return HSMP_DF_PSTATE_0;
+
+	if (bw >= df_threshold(cur, HSMP_DF_PSTATE_1, DF_P1_PCT))
+		return HSMP_DF_PSTATE_1;
+
+	if (c0 >= df_threshold(cur, DF_COMPUTE_PSTATE, DF_BUSY_PCT))
+		return DF_COMPUTE_PSTATE;
+
+	return HSMP_DF_PSTATE_AUTO;
+}
+
+static void df_queue(int socket_id, int pstate,
+		     void (*done)(const struct hsmp_msg *msg))
+{
+	struct hsmp_msg msg = { 0 };
+
+	msg.msg_id = HSMPCTL_DF_PSTATE;
+	msg.num_args = 1;
+	msg.args[0] = socket_id;
+	msg.args[1] = pstate;
+
+	queue_work(&msg, NULL, done);
+}
+
+static void df_written(const struct hsmp_msg *msg)
+{
+	int socket_id = msg->args[0];
+
+	if (msg->err) {
+		/* Try again with the next sample */
+		df.pstate[socket_id] = DF_UNKNOWN;
+		return;
+	}
+
+	df.pstate[socket_id] = msg->args[1];
+	df.changes++;
+}
+
+/* The P-state is taken to be set unless the write fails */
+static void df_set(int socket_id, int pstate)
+{
+	df.pstate[socket_id] = pstate;
+	df_queue(socket_id, pstate, df_written);
+}
+
+static void tune_df_pstates(const struct hsmp_telemetry *t, const int *err, int n)
+{
+	unsigned int needed = HSMP_TELEMETRY_C0_RESIDENCY | HSMP_TELEMETRY_DDR_BANDWIDTH;
+	int cur, want, i;
+
+	if (!df.enabled)
+		return;
+
+	for (i = 0; i < n; i++) {
+		if (err[i] || (t[i].valid & needed) != needed)
+			continue;
+
+		cur = df.pstate[i];
+		want = df_pick(&t[i], cur);
+
+		if (want == cur) {
+			df.pending[i] = DF_UNKNOWN;
+			continue;
+		}
+
+		if (cur == DF_UNKNOWN || want < cur) {
+			df.pending[i] = DF_UNKNOWN;
+			df_set(i, want);
+			continue;
+		}
+
+		/* Slow down to the fastest state wanted while settling */
+		if (df.pending[i] == DF_UNKNOWN) {
+			df.pending[i] = want;
+			df.pending_ms[i] = 0;
+		} else if (want < df.pending[i]) {
+			df.pending[i] = want;
+		}
+
+		df.pending_ms[i] += df.interval_ms;
+		if (df.pending_ms[i] < DF_SETTLE_MS) {
+			df.deferred++;
+			continue;
+		}
+
+		want = df.pending[i];
+		df.pending[i] = DF_UNKNOWN;
+		df_set(i, want);
+	}
+}
+
+/* Hand the DF P-states the tuner fixed back to firmware */
+static void df_tuner_stop(void)
+{
+	int i;
+
+	if (!df.enabled)
+		return;
+
+	for (i = 0; i < df.num_sockets; i++) {
+		if (df.pstate[i] != HSMP_DF_PSTATE_AUTO)
+			df_queue(i, HSMP_DF_PSTATE_AUTO, NULL);
+	}
+
+	df.enabled = 0;
+}
+
+/*
+ * Enable the DF P-state tuner if args[0] is non-zero, or stop it and
+ * restore automatic DF P-state selection. Replies with the tuner state,
+ * the number of DF P-state changes and the number of deferred changes.
+ */
+static void hsmpctld_df_tuner(struct hsmp_msg *msg)
+{
+	int i;
+
+	if (msg->num_args > 1) {
+		msg->err = -1;
+		msg->errnum = EINVAL;
+		return;
+	}
+
+	if (msg->num_args) {
+		if (!df.num_sockets) {
+			msg->err = -1;
+			msg->errnum = ENODATA;
+			return;
+		}
+
+		if (!msg->args[0]) {
+			df_tuner_stop();
+		} else if (!df.enabled) {
+			for (i = 0; i < df.num_sockets; i++) {
+				df.pstate[i] = DF_UNKNOWN;
+				df.pending[i] = DF_UNKNOWN;
+			}
+			df.enabled = 1;
+		}
+	}
+
+	msg->num_responses = 3;
+	msg->response[0] = df.enabled;
+	msg->response[1] = df.changes;
+	msg->response[2] = df.deferred;
+}
+
+static void hsmpctld_profile_apply(struct hsmp_msg *msg)
+{
+	int err;
+
+	if (!request_payload_sz || request_payload_sz % sizeof(struct hsmp_setting)) {
+		msg->err = -1;
+		msg->errnum = EINVAL;
+		return;
+	}
+
+	err = hsmp_apply_profile(request_payload,
+				 request_payload_sz / sizeof(struct hsmp_setting));
+	if (err) {
+		msg->err = err;
+		msg->errnum = errno;
+	}
+}
+
+static void hsmpctld_profile_snapshot(struct hsmp_msg *msg)
+{
+	struct hsmp_setting *settings;
+	int n;
+
+	n = hsmp_snapshot_profile(NULL, 0);
+	if (n < 0) {
+		msg->err = -1;
+		msg->errnum = errno;
+		return;
+	}
+
+	if (n > HSMPCTL_MAX_SETTINGS) {
+		msg->err = -1;
+		msg->errnum = E2BIG;
+		return;
+	}
+
+	settings = calloc(n, sizeof(*settings));
+	if (!settings) {
+		msg->err = -1;
+		msg->errnum = ENOMEM;
+		return;
+	}
+
+	n = hsmp_snapshot_profile(settings, n);
+	if (n < 0) {
+		free(settings);
+		msg->err = -1;
+		msg->errnum = errno;
+		return;
+	}
+
+	msg->num_responses = 1;
+	msg->response[0] = n;
+	msg->payload_sz = n * sizeof(*settings);
+	reply_payload = settings;
+}
+
+/*
+ * Requests other than reads are only accepted from root, matching the
+ * hsmpctl command permissions. SET requests only need root when given
+ * arguments, without any they read the current setting.
+ */
+enum {
+	ANY	= 0,
+	ROOT,
+	SET,
+};
+
 struct hsmpctld_cmd {
-	enum hsmp_msg_t	msg_id;
+	enum hsmpctl_msg_t	msg_id;
 	void (*cmd)(struct hsmp_msg *msg);
+	int			perms;
 };
 
 struct hsmpctld_cmd hsmpctld_handlers[] = {
 	{HSMPCTL_GET_VERSION,			hsmpctld_get_version},
 	{HSMPCTL_SOCKET_POWER,			hsmpctld_socket_power},
 	{HSMPCTL_SOCKET_POWER_LIMIT,		hsmpctld_socket_power_limit},
-	{HSMPCTL_SET_SOCKET_POWER_LIMIT,	hsmpctld_set_socket_power_limit},
+	{HSMPCTL_SET_SOCKET_POWER_LIMIT,	hsmpctld_set_socket_power_limit,	ROOT},
 	{HSMPCTL_SOCKET_POWER_MAX,		hsmpctld_socket_power_max},
-	{HSMPCTL_SET_CPU_BOOST_LIMIT,		hsmpctld_set_cpu_boost_limit},
-	{HSMPCTL_SET_SOCKET_BOOST_LIMIT,	hsmpctld_set_socket_boost_limit},
-	{HSMPCTL_SET_SYSTEM_BOOST_LIMIT,	hsmpctld_set_system_boost_limit},
+	{HSMPCTL_SET_CPU_BOOST_LIMIT,		hsmpctld_set_cpu_boost_limit,	ROOT},
+	{HSMPCTL_SET_SOCKET_BOOST_LIMIT,	hsmpctld_set_socket_boost_limit,	ROOT},
+	{HSMPCTL_SET_SYSTEM_BOOST_LIMIT,	hsmpctld_set_system_boost_limit,	ROOT},
 	{HSMPCTL_CPU_BOOST_LIMIT,		hsmpctld_cpu_boost_limit},
 	{HSMPCTL_PROC_HOT,			hsmpctld_proc_hot},
-	{HSMPCTL_XGMI_WIDTH,			hsmpctld_xgmi_width},
-	{HSMPCTL_XGMI_AUTO,			hsmpctld_xgmi_auto},
-	{HSMPCTL_DF_PSTATE,			hsmpctld_df_pstate},
+	{HSMPCTL_XGMI_WIDTH,			hsmpctld_xgmi_width,		ROOT},
+	{HSMPCTL_XGMI_AUTO,			hsmpctld_xgmi_auto,		ROOT},
+	{HSMPCTL_DF_PSTATE,			hsmpctld_df_pstate,		ROOT},
 	{HSMPCTL_FABRIC_CLOCKS,			hsmpctld_fabric_clocks},
 	{HSMPCTL_CORE_CLOCK_MAX,		hsmpctld_core_clock_max},
 	{HSMPCTL_C0_RESIDENCY,			hsmpctld_c0_residency},
-	{HSMPCTL_NBIO_PSTATE,			hsmpctld_nbio_pstate},
-	{HSMPCTL_NBIO_PSTATE_ALL,		hsmpctld_nbio_pstate_all},
+	{HSMPCTL_NBIO_PSTATE,			hsmpctld_nbio_pstate,		ROOT},
+	{HSMPCTL_NBIO_PSTATE_ALL,		hsmpctld_nbio_pstate_all,	ROOT},
 	{HSMPCTL_NBIO_NEXT_BUS,			hsmpctld_nbio_next_bus},
 	{HSMPCTL_DDR_BW,			hsmpctld_ddr_bw},
+	{HSMPCTL_CPU_BOOST_LIMITS,		hsmpctld_cpu_boost_limits},
+	{HSMPCTL_SOCKET_TELEMETRY,		hsmpctld_socket_telemetry},
+	{HSMPCTL_POWER_BUDGET,			hsmpctld_power_budget,		SET},
+	{HSMPCTL_DF_TUNER,			hsmpctld_df_tuner,		SET},
+	{HSMPCTL_PROFILE_APPLY,			hsmpctld_profile_apply,		ROOT},
+	{HSMPCTL_PROFILE_SNAPSHOT,		hsmpctld_profile_snapshot},
 };
 
 static void handle_request(struct hsmp_msg *msg)
@@ -478,40 +1115,1436 @@ static void handle_request(struct hsmp_msg *msg)
 	msg->errnum = EINVAL;
 }
 
-int main(int argc, const char **argv)
+static int request_needs_root(struct hsmp_msg *msg)
 {
-	struct hsmp_msg msg;
-	int fd;
-
-	/* Child process/daemon */
-	close(STDIN_FILENO);
-	close(STDOUT_FILENO);
-	close(STDERR_FILENO);
+	int i;
 
-	umask(0);
-	mkfifo(HSMPCTL_FIFO, 0666);
+	if (msg->msg_id == HSMPCTLD_EXIT)
+		return 1;
 
-	while (1) {
-		fd = open(HSMPCTL_FIFO, O_RDONLY);
-		if (fd < 0)
+	for (i = 0; i < ARRAY_SIZE(hsmpctld_handlers); i++) {
+		if (hsmpctld_handlers[i].msg_id != msg->msg_id)
 			continue;
 
-		read(fd, &msg, sizeof(msg));
-		close(fd);
+		switch (hsmpctld_handlers[i].perms) {
+		case ROOT:
+			return 1;
+		case SET:
+			return msg->num_args > 0;
+		default:
+			return 0;
+		}
+	}
 
-		if (msg.msg_id == HSMPCTLD_EXIT)
-			break;
+	return 0;
+}
 
-		handle_request(&msg);
+#define MAX_EVENTS	16
 
-		fd = open(HSMPCTL_FIFO, O_WRONLY);
-		write(fd, &msg, sizeof(msg));
-		close(fd);
+/*
+ * Requests still handled on the event loop give up on a socket lock held
+ * by a worker waiting on a slow SMU, rather than stall every client.
+ */
+#define LOOP_TIMEOUT_US	20000
 
-		sleep(1);
-	}
+#define HTTP_REQ_MAX	256
 
-	unlink(HSMPCTL_FIFO);
-	return 0;
-}
+/* Stop reading requests from a client with this much unsent output */
+#define CLIENT_OUT_HIGH	(64 * 1024)
 
+/*
+ * Per-connection state. Requests may arrive in pieces and several may be
+ * queued on one connection, replies that could not be written immediately
+ * are held in out until the client can take them. Metrics clients send an
+ * HTTP request instead, the start of which is kept in http.
+ */
+struct client {
+	int		fd;
+	int		metrics;
+	int		root;		/* Peer is root */
+	int		closing;	/* Close once out has been sent */
+	int		pending;	/* Waiting for a queued write */
+	int		dead;		/* Closed, freed when the write completes */
+	union {
+		struct hsmp_msg	req;
+		char		http[HTTP_REQ_MAX];
+	};
+	size_t		req_len;
+	char		*in;		/* Request payload */
+	size_t		in_len;
+	int		http_eoh;	/* Bytes of "\r\n\r\n" matched */
+	char		*out;
+	size_t		out_len;
+	size_t		out_off;
+};
+
+static int epoll_fd = -1;
+
+static void client_free(struct client *c)
+{
+	free(c->in);
+	free(c->out);
+	free(c);
+}
+
+static void client_close(struct client *c)
+{
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+
+	/* A queued write still refers to the client */
+	if (c->pending) {
+		c->dead = 1;
+		return;
+	}
+
+	client_free(c);
+}
+
+static int client_queue(struct client *c, const void *buf, size_t len)
+{
+	char *out;
+
+	out = realloc(c->out, c->out_len + len);
+	if (!out)
+		return -1;
+
+	memcpy(out + c->out_len, buf, len);
+	c->out = out;
+	c->out_len += len;
+	return 0;
+}
+
+static int client_backlogged(struct client *c)
+{
+	return c->out_len - c->out_off >= CLIENT_OUT_HIGH;
+}
+
+static int client_flush(struct client *c)
+{
+	struct epoll_event ev;
+	ssize_t cnt;
+
+	while (c->out_off < c->out_len) {
+		cnt = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+			   MSG_NOSIGNAL);
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+
+		c->out_off += cnt;
+	}
+
+	if (c->out_off == c->out_len) {
+		c->out_off = c->out_len = 0;
+		if (c->closing)
+			return -1;
+	}
+
+	/*
+	 * Only wait for the socket to become writable while output is pending,
+	 * and stop reading requests while a queued write is outstanding or the
+	 * client is not taking its replies.
+	 */
+	ev.events = (c->pending || client_backlogged(c) ? 0 : EPOLLIN) |
+		    (c->out_len ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* Checked once at accept, the peer credentials are those at connect */
+static int client_is_root(struct client *c)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(c->fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return 0;
+
+	return cred.uid == 0;
+}
+
+static int count_sockets(void)
+{
+	struct hsmp_telemetry t;
+	int n;
+
+	/* The max power limit is invariant and cached, probing is cheap */
+	for (n = 0; n < HSMPCTL_SHM_MAX_SOCKETS; n++) {
+		if (hsmp_socket_telemetry(n, &t, HSMP_TELEMETRY_MAX_POWER_LIMIT) &&
+		    (errno == EINVAL || errno == ENOTSUP || errno == EPERM))
+			break;
+	}
+
+	return n;
+}
+
+/*
+ * Per-socket workers
+ *
+ * Requests for a socket, the periodic telemetry sample of the socket and
+ * the writes of the power governor and DF tuner are queued to a worker
+ * thread for that socket, so a slow or timed out SMU on one socket does
+ * not hold up the event loop or the other sockets. Each worker serves its
+ * reads ahead of its writes, so reads do not wait behind queued writes.
+ *
+ * A queued write that has not been sent yet is replaced by a newer write
+ * to the same knob and target, which moves to the tail of the queue so it
+ * is not sent ahead of writes queued before it. A socket boost limit
+ * write also replaces the queued CPU boost limit writes of the socket.
+ * Every client of a replaced write gets the result of the write that was
+ * sent. Requests are not read from a connection while its request is
+ * outstanding, which keeps the replies of each connection in request
+ * order.
+ */
+#define MAX_WORKERS	HSMPCTL_SHM_MAX_SOCKETS
+
+enum queue_route {
+	ROUTE_SOCKET,
+	ROUTE_CPU,
+	ROUTE_BUS,
+};
+
+/* A num_args of -1 takes the target from args[0] whatever num_args is */
+static const struct {
+	enum hsmpctl_msg_t	msg_id;
+	int			num_args;
+	int			target_arg;
+	enum queue_route	route;
+	int			read;
+} queued_msgs[] = {
+	{HSMPCTL_SET_SOCKET_POWER_LIMIT,	2, 0, ROUTE_SOCKET,	0},
+	{HSMPCTL_SET_SOCKET_BOOST_LIMIT,	2, 0, ROUTE_SOCKET,	0},
+	{HSMPCTL_SET_CPU_BOOST_LIMIT,		2, 0, ROUTE_CPU,	0},
+	{HSMPCTL_DF_PSTATE,			1, 0, ROUTE_SOCKET,	0},
+	{HSMPCTL_NBIO_PSTATE,			2, 1, ROUTE_BUS,	0},
+	{HSMPCTL_SOCKET_POWER,			1, 0, ROUTE_SOCKET,	1},
+	{HSMPCTL_SOCKET_POWER_LIMIT,		1, 0, ROUTE_SOCKET,	1},
+	{HSMPCTL_SOCKET_POWER_MAX,		1, 0, ROUTE_SOCKET,	1},
+	{HSMPCTL_CPU_BOOST_LIMIT,		1, 0, ROUTE_CPU,	1},
+	{HSMPCTL_PROC_HOT,			1, 0, ROUTE_SOCKET,	1},
+	{HSMPCTL_FABRIC_CLOCKS,			-1, 0, ROUTE_SOCKET,	1},
+	{HSMPCTL_CORE_CLOCK_MAX,		1, 0, ROUTE_SOCKET,	1},
+	{HSMPCTL_C0_RESIDENCY,			1, 0, ROUTE_SOCKET,	1},
+	{HSMPCTL_DDR_BW,			-1, 0, ROUTE_SOCKET,	1},
+	{HSMPCTL_SOCKET_TELEMETRY,		2, 0, ROUTE_SOCKET,	1},
+};
+
+/* A client waiting for a queued request, msg is its own request */
+struct waiter {
+	struct client		*client;
+	struct hsmp_msg		msg;
+	struct waiter		*next;
+};
+
+/*
+ * A queued request. work is run on the worker in place of handling msg,
+ * done is called from the event loop with the result once it completes.
+ */
+struct queued_req {
+	struct hsmp_msg		msg;		/* Newest value for the knob */
+	int			target;
+	void			(*work)(struct hsmp_msg *msg);
+	void			(*done)(const struct hsmp_msg *msg);
+	void			*payload;	/* Reply payload */
+	struct waiter		*waiters;
+	struct queued_req	*next;
+};
+
+struct worker {
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		cond;
+	struct queued_req	*rhead;		/* Reads, served first */
+	struct queued_req	*rtail;
+	struct queued_req	*head;		/* Writes */
+	struct queued_req	*tail;
+	int			stop;
+	unsigned long long	reads;
+	unsigned long long	queued;
+	unsigned long long	coalesced;
+};
+
+static struct worker workers[MAX_WORKERS];
+static int num_workers;
+static u8 bus_socket[256];
+static short cpu_socket[HSMPCTL_MAX_CPUS];	/* -1 if the package is unknown */
+
+/* Completed requests, handed back to the event loop through done_fd */
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct queued_req *done_list;
+static int done_fd = -1;
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct queued_req *req;
+	uint64_t one = 1;
+
+	while (1) {
+		pthread_mutex_lock(&w->lock);
+		while (!w->rhead && !w->head && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+
+		if (w->rhead) {
+			req = w->rhead;
+			w->rhead = req->next;
+			if (!w->rhead)
+				w->rtail = NULL;
+		} else if (w->head) {
+			req = w->head;
+			w->head = req->next;
+			if (!w->head)
+				w->tail = NULL;
+		} else {
+			pthread_mutex_unlock(&w->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&w->lock);
+
+		if (req->work)
+			req->work(&req->msg);
+		else
+			handle_request(&req->msg);
+
+		req->payload = reply_payload;
+		reply_payload = NULL;
+
+		pthread_mutex_lock(&done_lock);
+		req->next = done_list;
+		done_list = req;
+		pthread_mutex_unlock(&done_lock);
+
+		if (write(done_fd, &one, sizeof(one)) < 0)
+			continue;
+	}
+}
+
+/*
+ * Returns the worker for a request, or -1 if it is handled inline. read
+ * is set for requests served ahead of the writes.
+ */
+static int msg_worker(const struct hsmp_msg *msg, int *target, int *read)
+{
+	int i, socket = -1;
+
+	for (i = 0; i < ARRAY_SIZE(queued_msgs); i++) {
+		if (queued_msgs[i].msg_id == msg->msg_id)
+			break;
+	}
+
+	if (i == ARRAY_SIZE(queued_msgs) || !num_workers ||
+	    (queued_msgs[i].num_args >= 0 &&
+	     msg->num_args != queued_msgs[i].num_args))
+		return -1;
+
+	*target = msg->args[queued_msgs[i].target_arg];
+	*read = queued_msgs[i].read;
+
+	switch (queued_msgs[i].route) {
+	case ROUTE_SOCKET:
+		socket = *target;
+		break;
+	case ROUTE_BUS:
+		*target &= 0xFF;
+		socket = bus_socket[*target];
+		break;
+	case ROUTE_CPU:
+		/* Any worker will do if the package is unknown */
+		socket = 0;
+		if (*target >= 0 && *target < HSMPCTL_MAX_CPUS &&
+		    cpu_socket[*target] >= 0)
+			socket = cpu_socket[*target];
+		break;
+	}
+
+	/* Invalid sockets are failed inline by the handler */
+	if (socket < 0 || socket >= num_workers)
+		return -1;
+
+	return socket;
+}
+
+/* Remove a queued write from the worker queue */
+static void unlink_write(struct worker *w, struct queued_req *req)
+{
+	struct queued_req **p, *prev = NULL;
+
+	for (p = &w->head; *p != req; p = &(*p)->next)
+		prev = *p;
+
+	*p = req->next;
+	if (w->tail == req)
+		w->tail = prev;
+	req->next = NULL;
+}
+
+/* Hand the clients of a replaced write to the write replacing it */
+static void replace_write(struct worker *w, struct queued_req *old,
+			  struct queued_req *req)
+{
+	struct waiter *waiter;
+
+	unlink_write(w, old);
+	while (old->waiters) {
+		waiter = old->waiters;
+		old->waiters = waiter->next;
+		waiter->next = req->waiters;
+		req->waiters = waiter;
+	}
+
+	if (!req->done)
+		req->done = old->done;
+
+	free(old);
+	w->coalesced++;
+}
+
+/* A socket boost limit overrides the CPU boost limits queued for it */
+static void replace_cpu_writes(struct worker *w, int socket,
+			       struct queued_req *req)
+{
+	struct queued_req *old, *next;
+
+	for (old = w->head; old; old = next) {
+		next = old->next;
+		if (old->msg.msg_id == HSMPCTL_SET_CPU_BOOST_LIMIT &&
+		    old->target >= 0 && old->target < HSMPCTL_MAX_CPUS &&
+		    cpu_socket[old->target] == socket)
+			replace_write(w, old, req);
+	}
+}
+
+/*
+ * Queue msg to a worker, coalescing writes. Returns the queued request
+ * with *wp locked, or NULL if msg should be handled inline.
+ */
+static struct queued_req *queue_msg(const struct hsmp_msg *msg,
+				    void (*work)(struct hsmp_msg *msg),
+				    void (*done)(const struct hsmp_msg *msg),
+				    struct worker **wp)
+{
+	struct queued_req *req = NULL;
+	int socket, target, read;
+	struct worker *w;
+
+	socket = msg_worker(msg, &target, &read);
+	if (socket < 0)
+		return NULL;
+
+	w = &workers[socket];
+	pthread_mutex_lock(&w->lock);
+
+	/* Work of the daemon itself is never coalesced */
+	if (!read && !work) {
+		for (req = w->head; req; req = req->next) {
+			if (req->msg.msg_id == msg->msg_id && req->target == target &&
+			    !req->work)
+				break;
+		}
+	}
+
+	if (!req) {
+		req = calloc(1, sizeof(*req));
+		if (!req) {
+			pthread_mutex_unlock(&w->lock);
+			return NULL;
+		}
+
+		req->target = target;
+		if (read)
+			w->reads++;
+		else
+			w->queued++;
+	} else {
+		/* The newer value is sent after the writes queued before it */
+		unlink_write(w, req);
+		w->coalesced++;
+	}
+
+	if (read) {
+		if (w->rtail)
+			w->rtail->next = req;
+		else
+			w->rhead = req;
+		w->rtail = req;
+	} else {
+		if (msg->msg_id == HSMPCTL_SET_SOCKET_BOOST_LIMIT)
+			replace_cpu_writes(w, socket, req);
+
+		if (w->tail)
+			w->tail->next = req;
+		else
+			w->head = req;
+		w->tail = req;
+	}
+
+	req->msg = *msg;
+	req->work = work;
+	if (done)
+		req->done = done;
+	pthread_cond_signal(&w->cond);
+	*wp = w;
+	return req;
+}
+
+/*
+ * Queue the request on the connection to a worker, returns 0 if it was
+ * queued and -1 if it should be handled inline.
+ */
+static int queue_request(struct client *c, struct hsmp_msg *msg)
+{
+	struct queued_req *req;
+	struct waiter *waiter;
+	struct worker *w;
+
+	waiter = malloc(sizeof(*waiter));
+	if (!waiter)
+		return -1;
+
+	req = queue_msg(msg, NULL, NULL, &w);
+	if (!req) {
+		free(waiter);
+		return -1;
+	}
+
+	waiter->client = c;
+	waiter->msg = *msg;
+	waiter->next = req->waiters;
+	req->waiters = waiter;
+	pthread_mutex_unlock(&w->lock);
+
+	c->pending = 1;
+	return 0;
+}
+
+/*
+ * Queue a request of the daemon itself. work, if set, is run in place of
+ * handling msg and done is called from the event loop with the result.
+ * Without a worker for the request it is handled inline.
+ */
+static void queue_work(const struct hsmp_msg *msg,
+		       void (*work)(struct hsmp_msg *msg),
+		       void (*done)(const struct hsmp_msg *msg))
+{
+	struct queued_req *req;
+	struct worker *w;
+	struct hsmp_msg m;
+
+	req = queue_msg(msg, work, done, &w);
+	if (req) {
+		pthread_mutex_unlock(&w->lock);
+		return;
+	}
+
+	m = *msg;
+	if (work)
+		work(&m);
+	else
+		handle_request(&m);
+
+	if (done)
+		done(&m);
+}
+
+/* Reply to the clients of every completed request */
+static void complete_requests(void)
+{
+	struct queued_req *req, *next_req;
+	struct waiter *waiter, *next;
+	uint64_t count;
+	struct client *c;
+	int err;
+
+	if (read(done_fd, &count, sizeof(count)) < 0)
+		return;
+
+	pthread_mutex_lock(&done_lock);
+	req = done_list;
+	done_list = NULL;
+	pthread_mutex_unlock(&done_lock);
+
+	for (; req; req = next_req) {
+		next_req = req->next;
+
+		if (req->done)
+			req->done(&req->msg);
+
+		for (waiter = req->waiters; waiter; waiter = next) {
+			next = waiter->next;
+			c = waiter->client;
+			c->pending = 0;
+
+			waiter->msg.err = req->msg.err;
+			waiter->msg.errnum = req->msg.errnum;
+			waiter->msg.num_responses = req->msg.num_responses;
+			waiter->msg.payload_sz = req->msg.payload_sz;
+			memcpy(waiter->msg.response, req->msg.response,
+			       sizeof(waiter->msg.response));
+
+			if (c->dead) {
+				client_free(c);
+			} else {
+				err = client_queue(c, &waiter->msg, sizeof(waiter->msg));
+				if (!err && req->msg.payload_sz)
+					err = client_queue(c, req->payload,
+							   req->msg.payload_sz);
+				if (err || client_flush(c))
+					client_close(c);
+			}
+
+			free(waiter);
+		}
+
+		free(req->payload);
+		free(req);
+	}
+}
+
+static void setup_bus_sockets(void)
+{
+	u8 bases[256];
+	int i, n, idx;
+	int bus;
+
+	n = 0;
+	idx = 0;
+	do {
+		idx = hsmp_next_bus(idx, &bases[n]);
+		if (idx < 0)
+			return;
+		n++;
+	} while (idx > 0 && n < ARRAY_SIZE(bases));
+
+	/* The NBIOs are sorted by bus base and evenly split between sockets */
+	for (i = 0; i < n; i++) {
+		for (bus = bases[i]; bus <= (i + 1 < n ? bases[i + 1] - 1 : 0xFF); bus++)
+			bus_socket[bus] = i * num_workers / n;
+	}
+}
+
+/* The package of each CPU, read once rather than for every write */
+static void setup_cpu_sockets(void)
+{
+	char path[64];
+	int cpu, socket;
+	long n;
+	FILE *fp;
+
+	n = sysconf(_SC_NPROCESSORS_CONF);
+	for (cpu = 0; cpu < HSMPCTL_MAX_CPUS; cpu++) {
+		cpu_socket[cpu] = -1;
+		if (cpu >= n)
+			continue;
+
+		snprintf(path, sizeof(path),
+			 "/sys/devices/system/cpu/cpu%d/topology/physical_package_id",
+			 cpu);
+		fp = fopen(path, "r");
+		if (!fp)
+			continue;
+
+		if (fscanf(fp, "%d", &socket) == 1 && socket >= 0 &&
+		    socket < num_workers)
+			cpu_socket[cpu] = socket;
+		fclose(fp);
+	}
+}
+
+/* Finish the queued writes and stop the workers */
+static void cleanup_workers(void)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_lock(&workers[i].lock);
+		workers[i].stop = 1;
+		pthread_cond_signal(&workers[i].cond);
+		pthread_mutex_unlock(&workers[i].lock);
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	num_workers = 0;
+	if (done_fd >= 0)
+		close(done_fd);
+	done_fd = -1;
+}
+
+static int setup_workers(void)
+{
+	struct epoll_event ev;
+	int i;
+
+	num_workers = count_sockets();
+	if (!num_workers)
+		return -1;
+
+	done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (done_fd < 0)
+		goto err;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &done_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_fd, &ev))
+		goto err;
+
+	setup_bus_sockets();
+	setup_cpu_sockets();
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_init(&workers[i].lock, NULL);
+		pthread_cond_init(&workers[i].cond, NULL);
+		if (pthread_create(&workers[i].thread, NULL, worker_thread,
+				   &workers[i]))
+			break;
+	}
+
+	if (i == num_workers)
+		return 0;
+
+	/* Stop the workers already started */
+	num_workers = i;
+	cleanup_workers();
+	return -1;
+
+err:
+	if (done_fd >= 0)
+		close(done_fd);
+	done_fd = -1;
+	num_workers = 0;
+	return -1;
+}
+
+/*
+ * Handle every complete request available on the connection, stopping at
+ * a request queued to a socket worker or once CLIENT_OUT_HIGH of replies are
+ * unsent. Returns 1 when a stop request is received and -1 if the
+ * connection should be closed.
+ */
+static int client_read(struct client *c)
+{
+	struct hsmp_msg *msg = &c->req;
+	ssize_t cnt;
+	int err;
+
+	while (1) {
+		if (client_backlogged(c))
+			return 0;
+
+		if (c->req_len < sizeof(*msg))
+			cnt = read(c->fd, (char *)msg + c->req_len,
+				   sizeof(*msg) - c->req_len);
+		else
+			cnt = read(c->fd, c->in + c->in_len,
+				   msg->payload_sz - c->in_len);
+		if (!cnt)
+			return -1;
+
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+
+		if (c->req_len < sizeof(*msg)) {
+			c->req_len += cnt;
+			if (c->req_len < sizeof(*msg))
+				continue;
+
+			if (msg->payload_sz) {
+				if (msg->payload_sz < 0 ||
+				    msg->payload_sz > HSMPCTL_MAX_PAYLOAD)
+					return -1;
+
+				c->in = malloc(msg->payload_sz);
+				if (!c->in)
+					return -1;
+
+				c->in_len = 0;
+				continue;
+			}
+		} else {
+			c->in_len += cnt;
+			if (c->in_len < msg->payload_sz)
+				continue;
+		}
+
+		c->req_len = 0;
+
+		if (!c->root && request_needs_root(msg)) {
+			msg->err = -1;
+			msg->errnum = EPERM;
+			msg->payload_sz = 0;
+		} else {
+			if (msg->msg_id == HSMPCTLD_EXIT)
+				return 1;
+
+			if (!msg->payload_sz && !queue_request(c, msg))
+				return 0;
+
+			request_payload = c->in;
+			request_payload_sz = msg->payload_sz;
+			msg->payload_sz = 0;
+			handle_request(msg);
+
+			request_payload = NULL;
+			request_payload_sz = 0;
+		}
+
+		free(c->in);
+		c->in = NULL;
+
+		err = client_queue(c, msg, sizeof(*msg));
+		if (!err && msg->payload_sz)
+			err = client_queue(c, reply_payload, msg->payload_sz);
+
+		free(reply_payload);
+		reply_payload = NULL;
+
+		if (err)
+			return -1;
+	}
+}
+
+static void accept_clients(int listen_fd, int metrics)
+{
+	struct epoll_event ev;
+	struct client *c;
+	int fd;
+
+	while (1) {
+		fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		c = calloc(1, sizeof(*c));
+		if (!c) {
+			close(fd);
+			continue;
+		}
+
+		c->fd = fd;
+		c->metrics = metrics;
+		c->root = client_is_root(c);
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			free(c);
+		}
+	}
+}
+
+static int setup_listener(void)
+{
+	struct sockaddr_un addr;
+	struct epoll_event ev;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, HSMPCTL_SOCKET, sizeof(addr.sun_path) - 1);
+
+	/*
+	 * Remove a stale socket left behind by a previous daemon, but not the
+	 * socket of one that is still running.
+	 */
+	if (!connect(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    errno == EAGAIN) {
+		close(fd);
+		errno = EADDRINUSE;
+		return -1;
+	}
+
+	close(fd);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	unlink(HSMPCTL_SOCKET);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, SOMAXCONN))
+		goto err;
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		goto err;
+
+	/* A NULL data pointer marks the listening socket */
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+		goto err;
+
+	return fd;
+
+err:
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+	close(fd);
+	unlink(HSMPCTL_SOCKET);
+	return -1;
+}
+
+#define DEFAULT_SAMPLE_INTERVAL	1000	/* ms */
+
+static struct hsmpctl_shm *shm;
+static size_t shm_size;
+static int timer_fd = -1;
+
+static void cleanup_sampler(void)
+{
+	if (timer_fd >= 0)
+		close(timer_fd);
+
+	if (shm) {
+		/* Tell readers still mapping the ring it is no longer updated */
+		__atomic_store_n(&shm->magic, 0, __ATOMIC_RELEASE);
+		munmap(shm, shm_size);
+	}
+
+	shm_unlink(HSMPCTL_SHM_NAME);
+	shm = NULL;
+	timer_fd = -1;
+}
+
+static int setup_sampler(int interval_ms)
+{
+	struct itimerspec its;
+	struct epoll_event ev;
+	int num_sockets;
+	int fd;
+
+	num_sockets = count_sockets();
+	if (!num_sockets)
+		return -1;
+
+	shm_size = HSMPCTL_SHM_SIZE(num_sockets);
+
+	fd = shm_open(HSMPCTL_SHM_NAME, O_CREAT | O_TRUNC | O_RDWR, 0644);
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, shm_size)) {
+		close(fd);
+		goto err;
+	}
+
+	shm = mmap(NULL, shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		shm = NULL;
+		goto err;
+	}
+
+	shm->version = HSMPCTL_SHM_VERSION;
+	shm->num_sockets = num_sockets;
+	shm->interval_ms = interval_ms;
+	__atomic_store_n(&shm->magic, HSMPCTL_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0)
+		goto err;
+
+	/* Take the first sample right away */
+	its.it_value.tv_sec = 0;
+	its.it_value.tv_nsec = 1;
+	its.it_interval.tv_sec = interval_ms / 1000;
+	its.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+	if (timerfd_settime(timer_fd, 0, &its, NULL))
+		goto err;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &timer_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev))
+		goto err;
+
+	gov.num_sockets = num_sockets;
+	df.num_sockets = num_sockets;
+	df.interval_ms = interval_ms;
+	return 0;
+
+err:
+	cleanup_sampler();
+	return -1;
+}
+
+/* Socket energy integrators, in uJ to keep the rounding out of energy_mj */
+struct socket_energy {
+	uint64_t	energy_uj;
+	uint64_t	last_ns;	/* Timestamp of the last power sample */
+	u32		last_power;
+};
+
+static struct socket_energy energy[HSMPCTL_SHM_MAX_SOCKETS];
+
+/* Add the energy since the last power sample, using the trapezoidal rule */
+static uint64_t integrate_energy(int socket_id, const struct hsmp_telemetry *t,
+				 uint64_t now)
+{
+	struct socket_energy *e = &energy[socket_id];
+
+	if (!(t->valid & HSMP_TELEMETRY_POWER))
+		return e->energy_uj / 1000;
+
+	/* mW * ns = 1e-6 uJ */
+	if (e->last_ns)
+		e->energy_uj += ((uint64_t)e->last_power + t->power) *
+				(now - e->last_ns) / 2000000;
+
+	e->last_ns = now;
+	e->last_power = t->power;
+	return e->energy_uj / 1000;
+}
+
+static void publish_sample(int socket_id, const struct hsmp_telemetry *t, int err)
+{
+	struct hsmpctl_ring *ring = &shm->rings[socket_id];
+	struct hsmpctl_sample *slot;
+	struct timespec ts;
+	uint64_t head, now;
+	uint32_t seq;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	head = ring->head;
+	slot = &ring->slots[head % HSMPCTL_SHM_SLOTS];
+	seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->err = err;
+	slot->index = head;
+	slot->timestamp_ns = now;
+	slot->energy_mj = integrate_energy(socket_id, t, now);
+	slot->telemetry = *t;
+
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* The latest sample of each socket, written by the socket's worker */
+static struct {
+	struct hsmp_telemetry	t[HSMPCTL_SHM_MAX_SOCKETS];
+	int			err[HSMPCTL_SHM_MAX_SOCKETS];
+	int			pending;	/* Sockets still to be sampled */
+} samples;
+
+/* Runs on the socket worker */
+static void sample_socket(struct hsmp_msg *msg)
+{
+	int i = msg->args[0];
+
+	samples.err[i] = hsmp_socket_telemetry(i, &samples.t[i], HSMP_TELEMETRY_ALL);
+	if (samples.err[i])
+		samples.err[i] = errno;
+
+	publish_sample(i, &samples.t[i], samples.err[i]);
+}
+
+/* Once every socket has been sampled the governor and tuner run */
+static void socket_sampled(const struct hsmp_msg *msg)
+{
+	if (--samples.pending)
+		return;
+
+	govern_power(samples.t, samples.err, shm->num_sockets);
+	tune_df_pstates(samples.t, samples.err, shm->num_sockets);
+}
+
+static void take_samples(void)
+{
+	struct hsmp_msg msg = { 0 };
+	uint64_t expirations;
+	int i;
+
+	/* Missed expirations are dropped rather than sampled back to back */
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	/* As are expirations while a socket is still being sampled */
+	if (samples.pending)
+		return;
+
+	msg.msg_id = HSMPCTL_SOCKET_TELEMETRY;
+	msg.num_args = 2;
+	msg.args[1] = HSMP_TELEMETRY_ALL;
+
+	samples.pending = shm->num_sockets;
+	for (i = 0; i < shm->num_sockets; i++) {
+		msg.args[0] = i;
+		queue_work(&msg, sample_socket, socket_sampled);
+	}
+}
+
+/*
+ * OpenMetrics exporter. Scrapes of http://127.0.0.1:<port>/metrics are
+ * answered from the newest sample in the telemetry ring and the library
+ * mailbox counters, they never cause HSMP mailbox traffic.
+ */
+static int metrics_fd = -1;
+
+static const struct {
+	const char	*name;
+	const char	*help;
+	unsigned int	field;
+	size_t		offset;
+	double		scale;
+} socket_metrics[] = {
+	{"hsmp_socket_power_watts", "Average socket power",
+	 HSMP_TELEMETRY_POWER, offsetof(struct hsmp_telemetry, power), 1e-3},
+	{"hsmp_socket_power_limit_watts", "Socket power limit",
+	 HSMP_TELEMETRY_POWER_LIMIT, offsetof(struct hsmp_telemetry, power_limit), 1e-3},
+	{"hsmp_socket_max_power_limit_watts", "Maximum socket power limit",
+	 HSMP_TELEMETRY_MAX_POWER_LIMIT, offsetof(struct hsmp_telemetry, max_power_limit), 1e-3},
+	{"hsmp_cclk_limit_hertz", "Core clock limit",
+	 HSMP_TELEMETRY_CCLK_LIMIT, offsetof(struct hsmp_telemetry, cclk_limit), 1e6},
+	{"hsmp_fclk_hertz", "Data fabric clock",
+	 HSMP_TELEMETRY_FABRIC_CLOCKS, offsetof(struct hsmp_telemetry, data_fabric_clock), 1e6},
+	{"hsmp_mclk_hertz", "Memory clock",
+	 HSMP_TELEMETRY_FABRIC_CLOCKS, offsetof(struct hsmp_telemetry, mem_clock), 1e6},
+	{"hsmp_c0_residency_ratio", "Average C0 residency of all cores",
+	 HSMP_TELEMETRY_C0_RESIDENCY, offsetof(struct hsmp_telemetry, c0_residency), 1e-2},
+	{"hsmp_ddr_max_bandwidth_bytes_per_second", "Theoretical maximum DDR bandwidth",
+	 HSMP_TELEMETRY_DDR_BANDWIDTH, offsetof(struct hsmp_telemetry, ddr_max_bw), 1e9},
+	{"hsmp_ddr_bandwidth_bytes_per_second", "Utilized DDR bandwidth",
+	 HSMP_TELEMETRY_DDR_BANDWIDTH, offsetof(struct hsmp_telemetry, ddr_utilized_bw), 1e9},
+	{"hsmp_ddr_utilization_ratio", "Utilized fraction of the maximum DDR bandwidth",
+	 HSMP_TELEMETRY_DDR_BANDWIDTH, offsetof(struct hsmp_telemetry, ddr_utilized_pct), 1e-2},
+	{"hsmp_prochot", "PROC_HOT asserted",
+	 HSMP_TELEMETRY_PROC_HOT, offsetof(struct hsmp_telemetry, proc_hot), 1},
+};
+
+static void write_socket_metrics(FILE *fp)
+{
+	struct hsmpctl_sample samples[HSMPCTL_SHM_MAX_SOCKETS];
+	int have[HSMPCTL_SHM_MAX_SOCKETS];
+	struct timespec ts;
+	uint64_t now;
+	int i, s, n;
+	u32 val;
+
+	n = shm ? shm->num_sockets : 0;
+	for (s = 0; s < n; s++)
+		have[s] = !hsmpctl_shm_read(shm, s, 0, &samples[s]);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	fprintf(fp, "# TYPE hsmp_sample_age_seconds gauge\n"
+		"# HELP hsmp_sample_age_seconds Age of the exported socket telemetry\n");
+	for (s = 0; s < n; s++) {
+		if (have[s])
+			fprintf(fp, "hsmp_sample_age_seconds{socket=\"%d\"} %g\n",
+				s, (now - samples[s].timestamp_ns) / 1e9);
+	}
+
+	fprintf(fp, "# TYPE hsmp_socket_energy_joules counter\n"
+		"# HELP hsmp_socket_energy_joules Socket energy integrated since hsmpctld started\n");
+	for (s = 0; s < n; s++) {
+		if (have[s])
+			fprintf(fp, "hsmp_socket_energy_joules_total{socket=\"%d\"} %g\n",
+				s, samples[s].energy_mj / 1e3);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(socket_metrics); i++) {
+		fprintf(fp, "# TYPE %s gauge\n# HELP %s %s\n", socket_metrics[i].name,
+			socket_metrics[i].name, socket_metrics[i].help);
+
+		for (s = 0; s < n; s++) {
+			if (!have[s] ||
+			    !(samples[s].telemetry.valid & socket_metrics[i].field))
+				continue;
+
+			memcpy(&val, (char *)&samples[s].telemetry + socket_metrics[i].offset,
+			       sizeof(val));
+			fprintf(fp, "%s{socket=\"%d\"} %g\n", socket_metrics[i].name, s,
+				val * socket_metrics[i].scale);
+		}
+	}
+}
+
+static void write_worker_metrics(FILE *fp)
+{
+	unsigned long long reads = 0, queued = 0, coalesced = 0;
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		pthread_mutex_lock(&workers[i].lock);
+		reads += workers[i].reads;
+		queued += workers[i].queued;
+		coalesced += workers[i].coalesced;
+		pthread_mutex_unlock(&workers[i].lock);
+	}
+
+	fprintf(fp, "# TYPE hsmpctld_reads_queued counter\n"
+		"# HELP hsmpctld_reads_queued Reads queued to the socket workers\n"
+		"hsmpctld_reads_queued_total %llu\n", reads);
+	fprintf(fp, "# TYPE hsmpctld_writes_queued counter\n"
+		"# HELP hsmpctld_writes_queued Writes queued to the socket workers\n"
+		"hsmpctld_writes_queued_total %llu\n", queued);
+	fprintf(fp, "# TYPE hsmpctld_writes_coalesced counter\n"
+		"# HELP hsmpctld_writes_coalesced Writes replaced by a newer value before being sent\n"
+		"hsmpctld_writes_coalesced_total %llu\n", coalesced);
+}
+
+static void write_mbox_metrics(FILE *fp)
+{
+	struct hsmp_mbox_counters counters;
+
+	if (hsmp_mbox_counters(&counters))
+		return;
+
+	fprintf(fp, "# TYPE hsmp_mailbox_messages counter\n"
+		"# HELP hsmp_mailbox_messages HSMP messages sent by hsmpctld\n"
+		"hsmp_mailbox_messages_total %llu\n", counters.messages);
+	fprintf(fp, "# TYPE hsmp_mailbox_errors counter\n"
+		"# HELP hsmp_mailbox_errors HSMP messages that failed, including timeouts\n"
+		"hsmp_mailbox_errors_total %llu\n", counters.errors);
+	fprintf(fp, "# TYPE hsmp_mailbox_timeouts counter\n"
+		"# HELP hsmp_mailbox_timeouts HSMP messages that timed out\n"
+		"hsmp_mailbox_timeouts_total %llu\n", counters.timeouts);
+	fprintf(fp, "# TYPE hsmp_mailbox_busy_seconds counter\n"
+		"# HELP hsmp_mailbox_busy_seconds Time spent sending HSMP messages\n"
+		"hsmp_mailbox_busy_seconds_total %g\n", counters.busy_ns / 1e9);
+	fprintf(fp, "# TYPE hsmp_mailbox_max_latency_seconds gauge\n"
+		"# HELP hsmp_mailbox_max_latency_seconds Longest HSMP message or batch\n"
+		"hsmp_mailbox_max_latency_seconds %g\n", counters.max_latency_ns / 1e9);
+}
+
+static int metrics_reply(struct client *c)
+{
+	char header[256];
+	size_t body_sz = 0;
+	char *body = NULL;
+	const char *status, *type;
+	FILE *fp;
+	int len, err;
+
+	fp = open_memstream(&body, &body_sz);
+	if (!fp)
+		return -1;
+
+	if (!strncmp(c->http, "GET /metrics", 12) &&
+	    (c->http[12] == ' ' || c->http[12] == '?')) {
+		status = "200 OK";
+		type = "application/openmetrics-text; version=1.0.0; charset=utf-8";
+		write_socket_metrics(fp);
+		write_mbox_metrics(fp);
+		write_worker_metrics(fp);
+		fprintf(fp, "# EOF\n");
+	} else {
+		status = "404 Not Found";
+		type = "text/plain";
+		fprintf(fp, "Only /metrics is served\n");
+	}
+
+	if (fclose(fp)) {
+		free(body);
+		return -1;
+	}
+
+	len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\n"
+		       "Content-Type: %s\r\n"
+		       "Content-Length: %zu\r\n"
+		       "Connection: close\r\n\r\n", status, type, body_sz);
+
+	err = client_queue(c, header, len);
+	if (!err)
+		err = client_queue(c, body, body_sz);
+
+	free(body);
+	c->closing = 1;
+	return err;
+}
+
+/*
+ * Read an HTTP request, the reply is sent once the end of the request
+ * headers is seen. Returns -1 if the connection should be closed.
+ */
+static int metrics_read(struct client *c)
+{
+	static const char eoh[] = "\r\n\r\n";
+	char buf[1024];
+	ssize_t cnt;
+	int i;
+
+	while (!c->closing) {
+		cnt = read(c->fd, buf, sizeof(buf));
+		if (!cnt)
+			return -1;
+
+		if (cnt < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+
+		/* Only the request line is needed, the headers are skipped */
+		for (i = 0; i < cnt; i++) {
+			if (c->req_len < HTTP_REQ_MAX - 1)
+				c->http[c->req_len++] = buf[i];
+
+			if (buf[i] == eoh[c->http_eoh])
+				c->http_eoh++;
+			else
+				c->http_eoh = buf[i] == '\r';
+
+			if (c->http_eoh == 4)
+				return metrics_reply(c);
+		}
+	}
+
+	return 0;
+}
+
+static int setup_metrics(int port)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	int one = 1;
+
+	metrics_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (metrics_fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	setsockopt(metrics_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(metrics_fd, SOMAXCONN))
+		goto err;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = &metrics_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_fd, &ev))
+		goto err;
+
+	return 0;
+
+err:
+	close(metrics_fd);
+	metrics_fd = -1;
+	return -1;
+}
+
+int main(int argc, const char **argv)
+{
+	struct epoll_event events[MAX_EVENTS];
+	int interval_ms = DEFAULT_SAMPLE_INTERVAL;
+	int metrics_port = 0;
+	struct client *c;
+	int requests_done = 0;
+	int listen_fd;
+	int done = 0;
+	int i, n, rc;
+
+	while ((i = getopt(argc, (char * const *)argv, "i:p:")) != -1) {
+		if (i == 'i')
+			interval_ms = strtol(optarg, NULL, 0);
+		else if (i == 'p')
+			metrics_port = strtol(optarg, NULL, 0);
+	}
+
+	/* Child process/daemon */
+	close(STDIN_FILENO);
+	close(STDOUT_FILENO);
+	close(STDERR_FILENO);
+
+	umask(0);
+
+	listen_fd = setup_listener();
+	if (listen_fd < 0)
+		return -1;
+
+	/* An interval of 0 disables sampling */
+	if (interval_ms > 0)
+		setup_sampler(interval_ms);
+
+	if (metrics_port > 0 && metrics_port <= 0xFFFF)
+		setup_metrics(metrics_port);
+
+	/* Without workers all requests are handled inline */
+	setup_workers();
+	hsmp_set_timeout_us(LOOP_TIMEOUT_US);
+
+	while (!done) {
+		n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if (!c) {
+				accept_clients(listen_fd, 0);
+				continue;
+			}
+
+			if (events[i].data.ptr == &metrics_fd) {
+				accept_clients(metrics_fd, 1);
+				continue;
+			}
+
+			if (events[i].data.ptr == &timer_fd) {
+				take_samples();
+				continue;
+			}
+
+			/* Replying may close clients with events in this batch */
+			if (events[i].data.ptr == &done_fd) {
+				requests_done = 1;
+				continue;
+			}
+
+			rc = 0;
+			if (c->pending)
+				rc = events[i].events & (EPOLLHUP | EPOLLERR) ? -1 : 0;
+			else if (events[i].events & EPOLLIN)
+				rc = c->metrics ? metrics_read(c) : client_read(c);
+			else if (events[i].events & (EPOLLHUP | EPOLLERR))
+				rc = -1;
+
+			if (rc == 1)
+				done = 1;
+
+			if (rc || client_flush(c))
+				client_close(c);
+		}
+
+		if (requests_done) {
+			complete_requests();
+			requests_done = 0;
+		}
+	}
+
+	cleanup_workers();
+	df_tuner_stop();
+	cleanup_sampler();
+	if (metrics_fd >= 0)
+		close(metrics_fd);
+	close(epoll_fd);
+	close(listen_fd);
+	unlink(HSMPCTL_SOCKET);
+	return 0;
+}
@@ -20,7 +20,7 @@
 
 #include <libhsmp.h>
 
-static const char version[] = "1.3";
+static const char version[] = "1.4";
 static const char *me;
 
 static void show_usage(void)
@@ -30,39 +30,106 @@ static void show_usage(void)
 	       "complexes in the system and locks the logic into the highest performance\n"
 	       "operational mode.\n\n"
 	       "Options:\n"
+	       "-d  --device <BDF>[,<BDF>...]\n"
+	       "		Only lock the root complexes hosting the specified PCI-e\n"
+	       "		devices, given as [domain:]bus:dev.fn in hex\n"
 	       "-v  --version	 Display program version and exit\n"
 	       "-h  --help	Display program usage and exit\n");
 }
 
+static const struct option long_options[] = {
+	{"device",	required_argument,	NULL,	'd'},
+	{"version",	no_argument,		NULL,	'v'},
+	{"help",	no_argument,		NULL,	'h'},
+	{NULL,		0,			NULL,	0},
+};
+
+#define MAX_DEVICES	256
+
+static struct hsmp_pci_bdf devices[MAX_DEVICES];
+static int num_devices;
+
+/* Parse a comma separated list of [domain:]bus:dev.fn device addresses */
+static int parse_devices(char *list)
+{
+	unsigned int domain, bus, dev, fn;
+	char *bdf;
+	int valid;
+
+	for (bdf = strtok(list, ","); bdf; bdf = strtok(NULL, ",")) {
+		valid = sscanf(bdf, "%x:%x:%x.%x", &domain, &bus, &dev, &fn) == 4;
+		if (!valid) {
+			domain = 0;
+			valid = sscanf(bdf, "%x:%x.%x", &bus, &dev, &fn) == 3;
+		}
+
+		if (!valid || domain > 0xFFFF || bus > 0xFF || dev > 0x1F || fn > 0x7) {
+			printf("Invalid PCI-e device %s\n", bdf);
+			return -1;
+		}
+
+		if (num_devices == MAX_DEVICES) {
+			printf("Too many PCI-e devices, at most %d are supported\n",
+			       MAX_DEVICES);
+			return -1;
+		}
+
+		devices[num_devices].domain = domain;
+		devices[num_devices].bus = bus;
+		devices[num_devices].dev = dev;
+		devices[num_devices].fn = fn;
+		num_devices++;
+	}
+
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	u8 bus_num;
 	int err;
 	int idx = 0;
+	int opt, i;
 	enum hsmp_nbio_pstate pstate = HSMP_NBIO_PSTATE_P0;
 
 	me = basename(argv[0]);
 
-	if (argc > 1) {
-		/* First argument is -v: print version */
-		if (strcmp(argv[1], "-v") == 0 ||
-		    strcmp(argv[1], "--version") == 0) {
+	while ((opt = getopt_long(argc, argv, "d:vh", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (parse_devices(optarg))
+				return -EINVAL;
+			break;
+		case 'v':
 			printf("%s version %s\n", me, version);
 			return 0;
-		}
-
-		/* First argument is -h / --help: print usage */
-		if (strcmp(argv[1], "-h") == 0 ||
-		    strcmp(argv[1], "--help") == 0) {
+		case 'h':
 			show_usage();
 			return 0;
+		default:
+			show_usage();
+			return -EINVAL;
 		}
+	}
 
-		printf("Unrecognized option %s\n", argv[1]);
+	if (optind < argc) {
+		printf("Unrecognized option %s\n", argv[optind]);
 		show_usage();
 		return -EINVAL;
 	}
 
+	errno = 0;
+	if (num_devices) {
+		/* One message is sent per root complex hosting the devices */
+		for (i = 0; i < num_devices; i++)
+			printf("Setting P-state %d for the root complex hosting "
+			       "%04x:%02x:%02x.%x\n", (int)pstate, devices[i].domain,
+			       devices[i].bus, devices[i].dev, devices[i].fn);
+		err = hsmp_set_nbio_pstate_for_devices(devices, num_devices, pstate);
+		printf("%s\n", hsmp_strerror(err, errno));
+		goto out;
+	}
+
 	/*
 	 * Loop through the base busses, one for each NBIO block.
 	 * Call the HSMP function to set the NBIO block to max performance.
@@ -71,7 +138,6 @@ int main(int argc, char **argv)
 	 * ends when the return value of hsmp_next_bus is 0. A return value of
 	 * < 0 indicates an error.
 	 */
-	errno = 0;
 	do {
 		idx = hsmp_next_bus(idx, &bus_num);
 		if (idx < 0)
@@ -82,6 +148,7 @@ int main(int argc, char **argv)
 		printf("%s\n", hsmp_strerror(err, errno));
 	} while (idx > 0 && err == 0);
 
+out:
 	switch (errno) {
 	case 0:
 		break;
@@ -111,7 +178,7 @@ int main(int argc, char **argv)
 		printf("HSMP message send failure\n");
 		break;
 	case EINVAL:
-		/* Should not happen in this example */
+		/* Only expected for a device not hosted by any root complex */
 		printf("Invalid parameter\n");
 		break;
 	default:
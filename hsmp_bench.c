@@ -0,0 +1,578 @@
+// SPDX-License-Identifier: MIT License
+/*
+ * Copyright (C) 2021 Advanced Micro Devices, Inc. - All Rights Reserved
+ *
+ * Author: Nathan Fontenot <nathan.fontenot@amd.com>
+ *
+ * AMD Host System Management Port library benchmark
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libhsmp.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define MAX_SAMPLES	100000	/* Latency samples kept per worker */
+#define MAX_SOCKETS	8
+#define BATCH_SZ	8
+
+int iterations = 1000;
+int duration_ms = 1000;
+int max_workers = 8;
+int num_sockets;
+
+/* Read-only messages, safe to send repeatedly */
+struct bench_msg {
+	const char	*name;
+	enum hsmp_msg_t	msg_id;
+	u16		num_args;
+	u32		arg;
+	u16		response_sz;
+};
+
+struct bench_msg bench_msgs[] = {
+	{ "HSMP_TEST",			HSMP_TEST,			1, 1, 1 },
+	{ "GET_SMU_VER",		HSMP_GET_SMU_VER,		0, 0, 1 },
+	{ "GET_PROTO_VER",		HSMP_GET_PROTO_VER,		0, 0, 1 },
+	{ "GET_SOCKET_POWER",		HSMP_GET_SOCKET_POWER,		0, 0, 1 },
+	{ "GET_SOCKET_POWER_LIMIT",	HSMP_GET_SOCKET_POWER_LIMIT,	0, 0, 1 },
+	{ "GET_SOCKET_POWER_LIMIT_MAX",	HSMP_GET_SOCKET_POWER_LIMIT_MAX, 0, 0, 1 },
+	{ "GET_BOOST_LIMIT",		HSMP_GET_BOOST_LIMIT,		1, 0, 1 },
+	{ "GET_PROC_HOT",		HSMP_GET_PROC_HOT,		0, 0, 1 },
+	{ "GET_FCLK_MCLK",		HSMP_GET_FCLK_MCLK,		0, 0, 2 },
+	{ "GET_CCLK_THROTTLE_LIMIT",	HSMP_GET_CCLK_THROTTLE_LIMIT,	0, 0, 1 },
+	{ "GET_C0_PERCENT",		HSMP_GET_C0_PERCENT,		0, 0, 1 },
+	{ "GET_DDR_BANDWIDTH",		HSMP_GET_DDR_BANDWIDTH,		0, 0, 1 },
+};
+
+/* Message used for the throughput and contention runs */
+#define CONTENTION_MSG	(&bench_msgs[3])
+
+struct samples {
+	uint64_t	*ns;
+	int		n;
+	uint64_t	count;		/* Messages sent, may exceed n */
+	uint64_t	errors;
+};
+
+uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void add_sample(struct samples *s, uint64_t ns, int err)
+{
+	s->count++;
+	if (err)
+		s->errors++;
+	else if (s->n < MAX_SAMPLES)
+		s->ns[s->n++] = ns;
+}
+
+void print_latency(const char *label, struct samples *s)
+{
+	uint64_t sum = 0;
+	int i;
+
+	if (!s->n) {
+		printf("  %-28s no successful messages (%llu errors)\n", label,
+		       (unsigned long long)s->errors);
+		return;
+	}
+
+	qsort(s->ns, s->n, sizeof(*s->ns), cmp_u64);
+	for (i = 0; i < s->n; i++)
+		sum += s->ns[i];
+
+	printf("  %-28s %7d %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f",
+	       label, s->n, s->ns[0] / 1e3, s->ns[s->n / 2] / 1e3,
+	       s->ns[s->n * 9 / 10] / 1e3, s->ns[s->n * 99 / 100] / 1e3,
+	       s->ns[s->n - 1] / 1e3, sum / 1e3 / s->n);
+
+	if (s->errors)
+		printf("  (%llu errors)", (unsigned long long)s->errors);
+	printf("\n");
+}
+
+void print_latency_header(void)
+{
+	printf("  %-28s %7s %9s %9s %9s %9s %9s %9s\n", "", "samples",
+	       "min us", "p50 us", "p90 us", "p99 us", "max us", "mean us");
+}
+
+struct samples *alloc_samples(void)
+{
+	struct samples *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+
+	s->ns = malloc(MAX_SAMPLES * sizeof(*s->ns));
+	if (!s->ns) {
+		free(s);
+		return NULL;
+	}
+
+	return s;
+}
+
+void free_samples(struct samples *s)
+{
+	free(s->ns);
+	free(s);
+}
+
+void init_request(struct hsmp_request *req, int socket_id, struct bench_msg *m)
+{
+	memset(req, 0, sizeof(*req));
+	req->socket_id = socket_id;
+	req->msg_id = m->msg_id;
+	req->num_args = m->num_args;
+	req->args[0] = m->arg;
+	req->response_sz = m->response_sz;
+}
+
+int send_one(int socket_id, struct bench_msg *m, int *errnum)
+{
+	struct hsmp_request req;
+	int err;
+
+	init_request(&req, socket_id, m);
+	err = hsmp_submit_batch(&req, 1);
+	*errnum = req.errnum;
+	return err;
+}
+
+int count_sockets(void)
+{
+	int errnum;
+	int n;
+
+	for (n = 0; n < MAX_SOCKETS; n++) {
+		if (send_one(n, &bench_msgs[0], &errnum) && errnum == EINVAL)
+			break;
+	}
+
+	return n;
+}
+
+/* Initialization cost, measured in fresh child processes */
+void bench_init(void)
+{
+	static const struct {
+		const char	*name;
+		unsigned int	flags;
+	} modes[] = {
+		{ "hsmp_init_ex(lazy)",		0 },
+		{ "hsmp_init_ex(eager)",	HSMP_INIT_EAGER_CPUS | HSMP_INIT_EAGER_NBIOS },
+		{ "hsmp_init_ex(pci scan)",	HSMP_INIT_PCI_SCAN },
+	};
+	struct samples *s;
+	uint64_t *result;
+	int runs, i, r;
+	pid_t pid;
+
+	printf("\nInitialization cost (new process per run)\n");
+	print_latency_header();
+
+	result = mmap(NULL, sizeof(*result), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (result == MAP_FAILED)
+		return;
+
+	s = alloc_samples();
+	if (!s)
+		goto out;
+
+	runs = iterations < 100 ? iterations : 100;
+
+	for (i = 0; i < ARRAY_SIZE(modes); i++) {
+		s->n = s->count = s->errors = 0;
+
+		for (r = 0; r < runs; r++) {
+			*result = 0;
+
+			pid = fork();
+			if (pid < 0)
+				break;
+
+			if (!pid) {
+				uint64_t start = now_ns();
+
+				if (!hsmp_init_ex(modes[i].flags))
+					*result = now_ns() - start;
+				_exit(0);
+			}
+
+			waitpid(pid, NULL, 0);
+			add_sample(s, *result, !*result);
+		}
+
+		print_latency(modes[i].name, s);
+	}
+
+	free_samples(s);
+out:
+	munmap(result, sizeof(*result));
+}
+
+/* Latency distribution of each supported message on each socket */
+void bench_latency(void)
+{
+	struct samples *s;
+	uint64_t start;
+	char label[64];
+	int socket_id;
+	int i, n, err, errnum;
+
+	printf("\nPer message latency (%d iterations)\n", iterations);
+	print_latency_header();
+
+	s = alloc_samples();
+	if (!s)
+		return;
+
+	for (socket_id = 0; socket_id < num_sockets; socket_id++) {
+		for (i = 0; i < ARRAY_SIZE(bench_msgs); i++) {
+			snprintf(label, sizeof(label), "%s/%d", bench_msgs[i].name,
+				 socket_id);
+
+			/* The boost limit argument, APIC ID 0, is a socket 0 CPU */
+			if (bench_msgs[i].msg_id == HSMP_GET_BOOST_LIMIT && socket_id)
+				continue;
+
+			if (send_one(socket_id, &bench_msgs[i], &errnum) &&
+			    errnum == ENOMSG) {
+				printf("  %-28s not supported\n", label);
+				continue;
+			}
+
+			s->n = s->count = s->errors = 0;
+			for (n = 0; n < iterations; n++) {
+				start = now_ns();
+				err = send_one(socket_id, &bench_msgs[i], &errnum);
+				add_sample(s, now_ns() - start, err);
+			}
+
+			print_latency(label, s);
+		}
+	}
+
+	free_samples(s);
+}
+
+/* Batched throughput against one socket and spread across all sockets */
+double batch_throughput(int sockets)
+{
+	struct hsmp_request reqs[BATCH_SZ];
+	uint64_t start, end, sent;
+	int i;
+
+	sent = 0;
+	start = now_ns();
+	end = start + duration_ms * 1000000ULL;
+
+	while (now_ns() < end) {
+		for (i = 0; i < BATCH_SZ; i++)
+			init_request(&reqs[i], i % sockets, CONTENTION_MSG);
+
+		hsmp_submit_batch(reqs, BATCH_SZ);
+
+		for (i = 0; i < BATCH_SZ; i++) {
+			if (!reqs[i].err)
+				sent++;
+		}
+	}
+
+	return sent * 1e9 / (now_ns() - start);
+}
+
+void bench_throughput(void)
+{
+	printf("\nThroughput, batches of %d GET_SOCKET_POWER messages\n", BATCH_SZ);
+	printf("  %-28s %9.0f msgs/s\n", "socket 0", batch_throughput(1));
+
+	if (num_sockets > 1)
+		printf("  %-28s %9.0f msgs/s\n", "all sockets",
+		       batch_throughput(num_sockets));
+}
+
+/* Send messages to socket 0 until the deadline, recording each latency */
+void contend(struct samples *s, uint64_t end)
+{
+	uint64_t start;
+	int err, errnum;
+
+	while ((start = now_ns()) < end) {
+		err = send_one(0, CONTENTION_MSG, &errnum);
+		add_sample(s, now_ns() - start, err);
+	}
+}
+
+struct worker {
+	pthread_t	thread;
+	struct samples	*s;
+	uint64_t	end;
+};
+
+void *contend_thread(void *arg)
+{
+	struct worker *w = arg;
+
+	contend(w->s, w->end);
+	return NULL;
+}
+
+/* Fold the samples of all workers into the first one */
+void merge_samples(struct samples **s, int n)
+{
+	int i, cnt;
+
+	for (i = 1; i < n; i++) {
+		cnt = s[i]->n;
+		if (cnt > MAX_SAMPLES - s[0]->n)
+			cnt = MAX_SAMPLES - s[0]->n;
+
+		memcpy(s[0]->ns + s[0]->n, s[i]->ns, cnt * sizeof(*s[i]->ns));
+		s[0]->n += cnt;
+		s[0]->count += s[i]->count;
+		s[0]->errors += s[i]->errors;
+	}
+}
+
+void print_contention(const char *label, struct samples *s, uint64_t elapsed)
+{
+	printf("  %-28s %9.0f msgs/s\n", label, s->count * 1e9 / elapsed);
+	print_latency("", s);
+}
+
+void bench_threads(void)
+{
+	struct samples *s[max_workers];
+	struct worker w[max_workers];
+	uint64_t start;
+	char label[64];
+	int n, i;
+
+	printf("\nLock contention, N threads sending GET_SOCKET_POWER to socket 0\n");
+	print_latency_header();
+
+	for (n = 1; n <= max_workers; n <<= 1) {
+		for (i = 0; i < n; i++) {
+			s[i] = alloc_samples();
+			if (!s[i])
+				goto out;
+		}
+
+		start = now_ns();
+		for (i = 0; i < n; i++) {
+			w[i].s = s[i];
+			w[i].end = start + duration_ms * 1000000ULL;
+			pthread_create(&w[i].thread, NULL, contend_thread, &w[i]);
+		}
+
+		for (i = 0; i < n; i++)
+			pthread_join(w[i].thread, NULL);
+
+		merge_samples(s, n);
+		snprintf(label, sizeof(label), "%d threads", n);
+		print_contention(label, s[0], now_ns() - start);
+
+out:
+		while (i--)
+			free_samples(s[i]);
+	}
+}
+
+/* Samples of a child process, shared with the parent */
+struct proc_samples {
+	struct samples	s;
+	uint64_t	ns[MAX_SAMPLES / 16];
+};
+
+/* Children start contending together once all have initialized */
+struct proc_ctl {
+	int		ready;
+	int		failed;
+	uint64_t	end;
+	struct proc_samples p[];
+};
+
+void proc_contend(struct proc_ctl *ctl, int i)
+{
+	struct proc_samples *p = &ctl->p[i];
+	struct samples *s;
+	uint64_t end;
+	int j;
+
+	s = alloc_samples();
+	if (!s || hsmp_init_ex(0)) {
+		__atomic_add_fetch(&ctl->failed, 1, __ATOMIC_RELEASE);
+		return;
+	}
+
+	__atomic_add_fetch(&ctl->ready, 1, __ATOMIC_RELEASE);
+	while (!(end = __atomic_load_n(&ctl->end, __ATOMIC_ACQUIRE)))
+		usleep(100);
+
+	contend(s, end);
+
+	p->s.count = s->count;
+	p->s.errors = s->errors;
+	p->s.n = s->n < ARRAY_SIZE(p->ns) ? s->n : ARRAY_SIZE(p->ns);
+
+	/* Keep an evenly spread subset of the samples */
+	for (j = 0; j < p->s.n; j++)
+		p->ns[j] = s->ns[(uint64_t)j * s->n / p->s.n];
+}
+
+/*
+ * Each child process initializes libhsmp itself, as separate programs
+ * would, so this must run before the parent initializes the library.
+ */
+void bench_processes(void)
+{
+	struct samples *merged[2];
+	struct samples s;
+	struct proc_ctl *ctl;
+	uint64_t start;
+	char label[64];
+	size_t size;
+	pid_t pid;
+	int n, i, j;
+
+	printf("\nLock contention, N processes sending GET_SOCKET_POWER to socket 0\n");
+	print_latency_header();
+
+	size = sizeof(*ctl) + max_workers * sizeof(ctl->p[0]);
+	ctl = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+		   -1, 0);
+	if (ctl == MAP_FAILED)
+		return;
+
+	merged[0] = alloc_samples();
+	if (!merged[0])
+		goto out;
+
+	for (n = 1; n <= max_workers; n <<= 1) {
+		memset(ctl, 0, size);
+
+		for (i = 0; i < n; i++) {
+			pid = fork();
+			if (pid < 0)
+				break;
+
+			if (!pid) {
+				proc_contend(ctl, i);
+				_exit(0);
+			}
+		}
+
+		while (__atomic_load_n(&ctl->ready, __ATOMIC_ACQUIRE) +
+		       __atomic_load_n(&ctl->failed, __ATOMIC_ACQUIRE) < i)
+			usleep(100);
+
+		start = now_ns();
+		__atomic_store_n(&ctl->end, start + duration_ms * 1000000ULL,
+				 __ATOMIC_RELEASE);
+
+		while (wait(NULL) > 0)
+			;
+
+		merged[0]->n = merged[0]->count = merged[0]->errors = 0;
+		for (j = 0; j < i; j++) {
+			s = ctl->p[j].s;
+			s.ns = ctl->p[j].ns;
+			merged[1] = &s;
+			merge_samples(merged, 2);
+		}
+
+		snprintf(label, sizeof(label), "%d processes", n);
+		print_contention(label, merged[0], now_ns() - start);
+		if (ctl->failed)
+			printf("  %d processes failed to initialize libhsmp\n",
+			       ctl->failed);
+	}
+
+	free_samples(merged[0]);
+out:
+	munmap(ctl, size);
+}
+
+void usage(void)
+{
+	printf("hsmp_bench [-i <iterations>] [-d <duration ms>] [-w <max workers>]\n");
+	printf("    -i  Iterations of each message for latency runs (default 1000)\n");
+	printf("    -d  Duration of each throughput and contention run (default 1000)\n");
+	printf("    -w  Maximum number of contending threads and processes (default 8)\n");
+}
+
+int main(int argc, char **argv)
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:d:w:h")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			duration_ms = strtol(optarg, NULL, 0);
+			break;
+		case 'w':
+			max_workers = strtol(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return -1;
+		}
+	}
+
+	if (iterations <= 0 || duration_ms <= 0 || max_workers <= 0) {
+		usage();
+		return -1;
+	}
+
+	/* These need child processes that initialize libhsmp themselves */
+	bench_init();
+	bench_processes();
+
+	if (hsmp_init_ex(0)) {
+		printf("libhsmp initialization failed: %s\n",
+		       hsmp_strerror(-1, errno));
+		return -1;
+	}
+
+	num_sockets = count_sockets();
+	printf("\nBenchmarking %d socket(s)\n", num_sockets);
+
+	bench_latency();
+	bench_throughput();
+	bench_threads();
+
+	return 0;
+}
@@ -7,12 +7,14 @@
  * AMD Host System Management Port library test module
  */
 
+#define _GNU_SOURCE  /* Needed by libhsmp.c for BUILD_STATIC */
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <poll.h>
 
 #ifndef BUILD_STATIC
 #include <cpuid.h>
@@ -340,6 +342,9 @@ void test_hsmp_ddr(void)
 void test_hsmp_boost_limit(void)
 {
 	u32 set_limit, limit;
+	int cpus[2] = { 0, 0 };
+	u32 limits[2];
+	cpu_set_t set;
 	int rc;
 
 	printf("Testing hsmp_set_cpu_boost_limit()...\n");
@@ -398,6 +403,61 @@ void test_hsmp_boost_limit(void)
 	rc = hsmp_cpu_boost_limit(-1, &limit);
 	eval_for_failure(rc);
 
+	printf("Testing hsmp_cpu_boost_limits()...\n");
+
+	pr_test_start("Testing with NULL boost limits pointer ");
+	rc = hsmp_cpu_boost_limits(cpus, 2, NULL);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing reading boost limits with invalid CPU ");
+	cpus[1] = -1;
+	rc = hsmp_cpu_boost_limits(cpus, 2, limits);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing reading CPU 0 boost limit in bulk ");
+	cpus[1] = 0;
+	rc = hsmp_cpu_boost_limits(cpus, 2, limits);
+	eval_for_pass_results(rc, limits[1], set_limit);
+
+	printf("Testing hsmp_set_cpu_boost_limits()...\n");
+
+	pr_test_start("Testing with NULL limits pointer ");
+	rc = hsmp_set_cpu_boost_limits(cpus, NULL, 2);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing setting boost limits with invalid CPU ");
+	limits[0] = limits[1] = set_limit;
+	cpus[1] = -1;
+	rc = hsmp_set_cpu_boost_limits(cpus, limits, 2);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing setting CPU 0 boost limit in bulk to 0x%x ", set_limit);
+	cpus[1] = 0;
+	rc = hsmp_set_cpu_boost_limits(cpus, limits, 2);
+	if (!rc)
+		rc = hsmp_cpu_boost_limit(0, &limit);
+	eval_for_pass_results(rc, limit, set_limit);
+
+	printf("Testing hsmp_set_cpuset_boost_limit()...\n");
+
+	pr_test_start("Testing with empty cpuset ");
+	CPU_ZERO(&set);
+	rc = hsmp_set_cpuset_boost_limit(&set, set_limit);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing cpuset with invalid CPU ");
+	CPU_SET(CPU_SETSIZE - 1, &set);
+	rc = hsmp_set_cpuset_boost_limit(&set, set_limit);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing setting CPU 0 boost limit by cpuset to 0x%x ", set_limit);
+	CPU_ZERO(&set);
+	CPU_SET(0, &set);
+	rc = hsmp_set_cpuset_boost_limit(&set, set_limit);
+	if (!rc)
+		rc = hsmp_cpu_boost_limit(0, &limit);
+	eval_for_pass_results(rc, limit, set_limit);
+
 	printf("Testing hsmp_set_socket_boost_limit()...\n");
 
 	pr_test_start("Testing setting socket boost limit with invalid socket id ");
@@ -549,6 +609,20 @@ void test_hsmp_socket_power(void)
 
 	if (test_passed && privileged_user && !hsmp_disabled)
 		pr_test_note("socket 0 max limit %d\n", limit);
+
+	pr_test_start("Testing cached socket power max limit for socket 0 ");
+	rc = hsmp_socket_max_power_limit(0, &power);
+	eval_for_pass_results(rc, power, limit);
+
+	printf("Testing hsmp_set_cache_ttl()...\n");
+
+	pr_test_start("Testing cached socket power limit for socket 0 ");
+	hsmp_set_cache_ttl(HSMP_CACHE_TTL_FOREVER);
+	rc = hsmp_socket_power_limit(0, &limit);
+	if (!rc)
+		rc = hsmp_socket_power_limit(0, &power);
+	eval_for_pass_results(rc, power, limit);
+	hsmp_set_cache_ttl(0);
 }
 
 void test_proc_hot_status(void)
@@ -616,11 +690,21 @@ void test_df_pstate(void)
 	pr_test_start("Testing DF pstate HSMP_DF_PSTATE_3 (%d) ", df_pstate);
 	rc = hsmp_set_data_fabric_pstate(0, df_pstate);
 	eval_for_pass(rc);
+
+	printf("Testing hsmp_data_fabric_pstate()...\n");
+
+	pr_test_start("Testing with NULL pstate pointer ");
+	rc = hsmp_data_fabric_pstate(0, NULL);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing last set DF pstate for socket 0 ");
+	rc = hsmp_data_fabric_pstate(0, &df_pstate);
+	eval_for_pass_results(rc, df_pstate, HSMP_DF_PSTATE_3);
 }
 
 void test_fabric_clocks(void)
 {
-	int mem_clock, df_clock;
+	int mem_clock = 0, df_clock = 0;
 	int rc;
 
 	printf("Testing hsmp_memory_clock()...\n");
@@ -741,6 +825,344 @@ void test_nbio_pstate(void)
 	unsupported_interface = 0;
 }
 
+void test_nbio_pstate_for_devices(void)
+{
+	struct hsmp_pci_bdf devs[3] = { { 0, 0, 0, 0 }, { 0, 0, 0, 2 }, { 0, 0xFF, 0, 0 } };
+	int rc;
+
+	if (interface_version < 2)
+		unsupported_interface = 1;
+
+	printf("Testing %s hsmp_set_nbio_pstate_for_device[s]()...\n",
+	       unsupported_interface ? "unsupported" : "");
+
+	pr_test_start("Testing device in PCI domain 1 ");
+	rc = hsmp_set_nbio_pstate_for_device(1, 0, 0, 0, HSMP_NBIO_PSTATE_P0);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing invalid device number 0x20 ");
+	rc = hsmp_set_nbio_pstate_for_device(0, 0, 0x20, 0, HSMP_NBIO_PSTATE_P0);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing device 0000:00:00.0 with invalid pstate 5 ");
+	rc = hsmp_set_nbio_pstate_for_device(0, 0, 0, 0, 5);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing HSMP_NBIO_PSTATE_P0 for device 0000:00:00.0 ");
+	rc = hsmp_set_nbio_pstate_for_device(0, 0, 0, 0, HSMP_NBIO_PSTATE_P0);
+	eval_for_pass(rc);
+
+	pr_test_start("Testing with NULL device list ");
+	rc = hsmp_set_nbio_pstate_for_devices(NULL, 1, HSMP_NBIO_PSTATE_P0);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing HSMP_NBIO_PSTATE_AUTO for devices on buses 0x00 and 0xFF ");
+	rc = hsmp_set_nbio_pstate_for_devices(devs, 3, HSMP_NBIO_PSTATE_AUTO);
+	eval_for_pass(rc);
+
+	unsupported_interface = 0;
+}
+
+void test_submit_batch(void)
+{
+	struct hsmp_request reqs[3];
+	int rc;
+
+	printf("Testing hsmp_submit_batch()...\n");
+
+	pr_test_start("Testing with NULL request pointer ");
+	rc = hsmp_submit_batch(NULL, 1);
+	eval_for_failure(rc);
+
+	memset(reqs, 0, sizeof(reqs));
+	reqs[0].socket_id = 0;
+	reqs[0].msg_id = HSMP_GET_SOCKET_POWER;
+	reqs[0].response_sz = 1;
+
+	pr_test_start("Testing with zero requests ");
+	rc = hsmp_submit_batch(reqs, 0);
+	eval_for_failure(rc);
+
+	reqs[1].socket_id = 0;
+	reqs[1].msg_id = HSMP_GET_C0_PERCENT;
+	reqs[1].response_sz = 1;
+
+	reqs[2].socket_id = 0;
+	reqs[2].msg_id = HSMP_TEST;
+	reqs[2].num_args = 1;
+	reqs[2].args[0] = 41;
+	reqs[2].response_sz = 1;
+
+	pr_test_start("Testing batch of three requests for socket 0 ");
+	rc = hsmp_submit_batch(reqs, 3);
+	eval_for_pass_results(rc, reqs[2].response[0], 42);
+
+	if (test_passed && privileged_user && !hsmp_disabled)
+		pr_test_note("socket power %d, C0 residency %d\n",
+			     reqs[0].response[0], reqs[1].response[0]);
+
+	pr_test_start("Testing batch with invalid socket_id ");
+	reqs[1].socket_id = -1;
+	rc = hsmp_submit_batch(reqs, 3);
+	if (rc == 0) {
+		pr_fail(rc);
+	} else if (!privileged_user || hsmp_disabled || cpu_family < 0x19) {
+		eval_for_failure(rc);
+	} else if (errno == EIO && reqs[1].err == -1 && reqs[1].errnum == EINVAL &&
+		   reqs[0].err == 0) {
+		pr_pass();
+	} else {
+		pr_fail(rc);
+	}
+
+	pr_test_start("Testing batch with mismatched response size ");
+	reqs[1].socket_id = 0;
+	reqs[1].response_sz = 2;
+	rc = hsmp_submit_batch(reqs, 3);
+	if (rc == 0) {
+		pr_fail(rc);
+	} else if (!privileged_user || hsmp_disabled || cpu_family < 0x19) {
+		eval_for_failure(rc);
+	} else if (errno == EIO && reqs[1].err == -1 && reqs[1].errnum == EINVAL &&
+		   reqs[0].err == 0 && reqs[2].err == 0) {
+		pr_pass();
+	} else {
+		pr_fail(rc);
+	}
+}
+
+void test_socket_telemetry(void)
+{
+	struct hsmp_telemetry telemetry;
+	int rc;
+
+	printf("Testing hsmp_socket_telemetry()...\n");
+
+	pr_test_start("Testing with NULL telemetry pointer ");
+	rc = hsmp_socket_telemetry(0, NULL, HSMP_TELEMETRY_ALL);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing with empty fields mask ");
+	rc = hsmp_socket_telemetry(0, &telemetry, 0);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing with invalid socket id ");
+	rc = hsmp_socket_telemetry(-1, &telemetry, HSMP_TELEMETRY_ALL);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing power and C0 residency for socket 0 ");
+	rc = hsmp_socket_telemetry(0, &telemetry,
+				   HSMP_TELEMETRY_POWER | HSMP_TELEMETRY_C0_RESIDENCY);
+	eval_for_pass_results(rc, telemetry.valid,
+			      HSMP_TELEMETRY_POWER | HSMP_TELEMETRY_C0_RESIDENCY);
+
+	pr_test_start("Testing all fields for socket 0 ");
+	rc = hsmp_socket_telemetry(0, &telemetry, HSMP_TELEMETRY_ALL);
+	eval_for_pass(rc);
+
+	if (test_passed && privileged_user && !hsmp_disabled)
+		pr_test_note("power %d mW, limit %d mW, fclk %d MHz, mclk %d MHz, C0 %d%%\n",
+			     telemetry.power, telemetry.power_limit,
+			     telemetry.data_fabric_clock, telemetry.mem_clock,
+			     telemetry.c0_residency);
+}
+
+void test_profiles(void)
+{
+	struct hsmp_setting setting, *snapshot;
+	struct hsmp_request reqs[2];
+	int rc, n, i, found;
+	u32 limit;
+
+	printf("Testing hsmp_apply_profile() and hsmp_snapshot_profile()...\n");
+
+	pr_test_start("Testing apply with NULL profile pointer ");
+	rc = hsmp_apply_profile(NULL, 1);
+	eval_for_failure(rc);
+
+	setting.type = HSMP_SETTING_SOCKET_POWER_LIMIT;
+	setting.target = -1;
+	setting.value = 120000;
+	pr_test_start("Testing apply with invalid socket id ");
+	rc = hsmp_apply_profile(&setting, 1);
+	eval_for_failure(rc);
+
+	setting.type = HSMP_SETTING_NBIO_PSTATE + 1;
+	setting.target = 0;
+	pr_test_start("Testing apply with invalid setting type ");
+	rc = hsmp_apply_profile(&setting, 1);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing snapshot with NULL settings pointer ");
+	rc = hsmp_snapshot_profile(NULL, 1);
+	eval_for_failure(rc);
+
+	/*
+	 * A core with a boost limit of its own is snapshot per CPU. Set it
+	 * with a raw message so this can be the first snapshot taken.
+	 */
+	memset(reqs, 0, sizeof(reqs));
+	reqs[0].socket_id = 0;
+	reqs[0].msg_id = HSMP_GET_BOOST_LIMIT;
+	reqs[0].num_args = 1;
+	reqs[0].response_sz = 1;
+	reqs[1].socket_id = 0;
+	reqs[1].msg_id = HSMP_SET_BOOST_LIMIT;
+	reqs[1].num_args = 1;
+
+	pr_test_start("Testing snapshot with non-uniform core boost limits ");
+	found = 0;
+	rc = hsmp_submit_batch(reqs, 1);
+	if (!rc) {
+		limit = reqs[0].response[0] == 2000 ? 1800 : 2000;
+		reqs[1].args[0] = 1 << 16 | limit;
+		rc = hsmp_submit_batch(&reqs[1], 1);
+	}
+	if (!rc) {
+		n = hsmp_snapshot_profile(NULL, 0);
+		snapshot = n > 0 ? calloc(n, sizeof(*snapshot)) : NULL;
+		rc = snapshot ? hsmp_snapshot_profile(snapshot, n) : -1;
+		for (i = 0; i < rc; i++) {
+			if (snapshot[i].type == HSMP_SETTING_CPU_BOOST_LIMIT &&
+			    snapshot[i].value == limit)
+				found = 1;
+		}
+		rc = rc < 0 ? rc : 0;
+		free(snapshot);
+
+		/* Restore the socket's original limit */
+		reqs[1].msg_id = HSMP_SET_BOOST_LIMIT_SOCKET;
+		reqs[1].args[0] = reqs[0].response[0];
+		if (hsmp_submit_batch(&reqs[1], 1))
+			rc = -1;
+	}
+	eval_for_pass_results(rc, 1, found);
+
+	pr_test_start("Testing snapshot size ");
+	n = hsmp_snapshot_profile(NULL, 0);
+	eval_for_pass(n < 0 ? n : 0);
+	if (n <= 0)
+		return;
+
+	snapshot = calloc(n, sizeof(*snapshot));
+	if (!snapshot)
+		return;
+
+	pr_test_start("Testing snapshot of %d settings ", n);
+	rc = hsmp_snapshot_profile(snapshot, n);
+	eval_for_pass_results(rc < 0 ? rc : 0, n, rc);
+
+	pr_test_start("Testing applying the snapshot ");
+	rc = hsmp_apply_profile(snapshot, n);
+	eval_for_pass(rc);
+
+	free(snapshot);
+}
+
+void test_async(void)
+{
+	struct hsmp_request reqs[2];
+	struct hsmp_async *handle;
+	int rc, fd;
+
+	printf("Testing hsmp_send_async()...\n");
+
+	pr_test_start("Testing with NULL request pointer ");
+	handle = hsmp_send_async(NULL, 1);
+	eval_for_failure(handle ? 0 : -1);
+
+	memset(reqs, 0, sizeof(reqs));
+	reqs[0].socket_id = 0;
+	reqs[0].msg_id = HSMP_GET_SOCKET_POWER;
+	reqs[0].response_sz = 1;
+
+	reqs[1].socket_id = 0;
+	reqs[1].msg_id = HSMP_TEST;
+	reqs[1].num_args = 1;
+	reqs[1].args[0] = 1;
+	reqs[1].response_sz = 1;
+
+	pr_test_start("Testing async submission with hsmp_wait() ");
+	handle = hsmp_send_async(reqs, 2);
+	rc = handle ? hsmp_wait(handle) : -1;
+	eval_for_pass_results(rc, reqs[1].response[0], 2);
+
+	printf("Testing hsmp_poll()...\n");
+
+	pr_test_start("Testing with NULL handle ");
+	rc = hsmp_poll(NULL);
+	if (einval_error(rc, errno))
+		pr_pass();
+	else
+		pr_fail(rc);
+
+	pr_test_start("Testing async submission with hsmp_poll() ");
+	handle = hsmp_send_async(reqs, 2);
+	if (handle) {
+		while ((rc = hsmp_poll(handle)) == -1 && errno == EAGAIN)
+			usleep(100);
+	} else {
+		rc = -1;
+	}
+	eval_for_pass_results(rc, reqs[1].response[0], 2);
+
+	printf("Testing hsmp_async_fd()...\n");
+
+	pr_test_start("Testing async event fd ");
+	fd = hsmp_async_fd();
+	eval_for_pass(fd >= 0 ? 0 : fd);
+}
+
+void test_watch_cb(const struct hsmp_watch_event *event, void *data)
+{
+	__atomic_store_n((int *)data, event->socket_id + 1, __ATOMIC_RELEASE);
+}
+
+void test_watch(void)
+{
+	struct hsmp_watch_event event;
+	struct pollfd pfd;
+	int called = 0;
+	int rc, i;
+
+	printf("Testing hsmp_watch()...\n");
+
+	pr_test_start("Testing watch with invalid socket id ");
+	rc = hsmp_watch(-1, HSMP_WATCH_ALL, NULL, NULL);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing watch with no events ");
+	rc = hsmp_watch(0, 0, NULL, NULL);
+	eval_for_failure(rc);
+
+	pr_test_start("Testing watch of socket 0 initial state event ");
+	rc = hsmp_watch(0, HSMP_WATCH_ALL, NULL, NULL);
+	if (!rc) {
+		pfd.fd = hsmp_watch_fd();
+		pfd.events = POLLIN;
+		rc = poll(&pfd, 1, 1000) == 1 ? 0 : -1;
+	}
+	if (!rc)
+		rc = hsmp_watch_read(&event, 1) == 1 ? 0 : -1;
+	eval_for_pass_results(rc, event.changed, HSMP_WATCH_ALL);
+
+	pr_test_start("Testing watch of socket 0 with callback ");
+	rc = hsmp_watch(0, HSMP_WATCH_CCLK_LIMIT, test_watch_cb, &called);
+	for (i = 0; !rc && i < 100 && !__atomic_load_n(&called, __ATOMIC_ACQUIRE); i++)
+		usleep(10000);
+	eval_for_pass_results(rc, __atomic_load_n(&called, __ATOMIC_ACQUIRE), 1);
+
+	printf("Testing hsmp_unwatch()...\n");
+
+	pr_test_start("Testing unwatch of socket 0 ");
+	rc = hsmp_unwatch(0);
+	eval_for_pass(rc);
+
+	pr_test_start("Testing unwatch of socket not watched ");
+	rc = hsmp_unwatch(0);
+	eval_for_failure(rc);
+}
+
 void test_hsmp_strerror(void)
 {
 	char *hsmp_errstring;
@@ -784,10 +1206,182 @@ void test_hsmp_strerror(void)
 	}
 }
 
+void test_poll_policy(void)
+{
+	struct hsmp_poll_policy saved, policy, result;
+	u32 power;
+	int rc;
+
+	printf("Testing hsmp_set_poll_policy()...\n");
+
+	pr_test_start("Testing with NULL poll policy pointer ");
+	rc = hsmp_set_poll_policy(HSMP_GET_SOCKET_POWER, NULL);
+	if (einval_error(rc, errno))
+		pr_pass();
+	else
+		pr_fail(rc);
+
+	pr_test_start("Testing with min sleep > max sleep ");
+	policy.spin_us = 10;
+	policy.min_sleep_us = 100;
+	policy.max_sleep_us = 10;
+	rc = hsmp_set_poll_policy(HSMP_GET_SOCKET_POWER, &policy);
+	if (einval_error(rc, errno))
+		pr_pass();
+	else
+		pr_fail(rc);
+
+	pr_test_start("Testing with invalid message ID ");
+	policy.min_sleep_us = 10;
+	policy.max_sleep_us = 100;
+	rc = hsmp_set_poll_policy(0xFF, &policy);
+	if (einval_error(rc, errno))
+		pr_pass();
+	else
+		pr_fail(rc);
+
+	hsmp_get_poll_policy(HSMP_GET_SOCKET_POWER, &saved);
+
+	pr_test_start("Testing valid poll policy for HSMP_GET_SOCKET_POWER ");
+	rc = hsmp_set_poll_policy(HSMP_GET_SOCKET_POWER, &policy);
+	if (rc) {
+		pr_fail(rc);
+	} else {
+		hsmp_get_poll_policy(HSMP_GET_SOCKET_POWER, &result);
+		if (memcmp(&policy, &result, sizeof(policy))) {
+			pr_fail(0);
+			pr_test_note("Poll policy read back does not match\n");
+		} else {
+			pr_pass();
+		}
+	}
+
+	hsmp_set_poll_policy(HSMP_GET_SOCKET_POWER, &saved);
+
+	printf("Testing hsmp_set_timeout_us()...\n");
+
+	pr_test_start("Testing setting a 100ms send timeout ");
+	rc = hsmp_set_timeout_us(100000);
+	if (rc || hsmp_get_timeout_us() != 100000)
+		pr_fail(rc);
+	else
+		pr_pass();
+
+	pr_test_start("Testing reading socket 0 power with a send timeout ");
+	rc = hsmp_socket_power(0, &power);
+	eval_for_pass(rc);
+
+	pr_test_start("Testing restoring the default send timeout ");
+	rc = hsmp_set_timeout_us(0);
+	if (rc || hsmp_get_timeout_us() != 0)
+		pr_fail(rc);
+	else
+		pr_pass();
+}
+
+void test_mbox_counters(void)
+{
+	struct hsmp_mbox_counters before, after;
+	u32 power;
+	int rc;
+
+	printf("Testing hsmp_mbox_counters()...\n");
+
+	pr_test_start("Testing with NULL counters pointer ");
+	rc = hsmp_mbox_counters(NULL);
+	if (einval_error(rc, errno))
+		pr_pass();
+	else
+		pr_fail(rc);
+
+	pr_test_start("Testing counters follow a socket power read ");
+	hsmp_mbox_counters(&before);
+	rc = hsmp_socket_power(0, &power);
+	hsmp_mbox_counters(&after);
+
+	if (rc) {
+		/* The message may not have been sent */
+		if (after.messages < before.messages)
+			pr_fail(0);
+		else
+			pr_pass();
+	} else if (after.messages != before.messages + 1 ||
+		   after.busy_ns <= before.busy_ns) {
+		pr_fail(0);
+		pr_test_note("Counters did not advance\n");
+	} else {
+		pr_pass();
+	}
+}
+
+void test_stats(void)
+{
+	struct hsmp_msg_stats stats;
+	u32 power;
+	int rc;
+
+	printf("Testing hsmp_get_stats()...\n");
+
+	rc = hsmp_get_stats(HSMP_GET_SOCKET_POWER, &stats);
+	if (rc && errno == ENOTSUP) {
+		pr_test_start("Testing without statistics built in ");
+		rc = hsmp_reset_stats();
+		if (rc && errno == ENOTSUP) {
+			pr_pass();
+			pr_test_note("libhsmp built without --enable-stats\n");
+		} else {
+			pr_fail(rc);
+		}
+		return;
+	}
+
+	pr_test_start("Testing with NULL stats pointer ");
+	rc = hsmp_get_stats(HSMP_GET_SOCKET_POWER, NULL);
+	if (einval_error(rc, errno))
+		pr_pass();
+	else
+		pr_fail(rc);
+
+	pr_test_start("Testing with invalid message ID ");
+	rc = hsmp_get_stats(0xFF, &stats);
+	if (einval_error(rc, errno))
+		pr_pass();
+	else
+		pr_fail(rc);
+
+	pr_test_start("Testing reset clears statistics ");
+	hsmp_reset_stats();
+	rc = hsmp_get_stats(0, &stats);
+	if (rc || stats.calls || stats.service_ns)
+		pr_fail(rc);
+	else
+		pr_pass();
+
+	pr_test_start("Testing statistics follow a socket power read ");
+	rc = hsmp_socket_power(0, &power);
+	hsmp_get_stats(HSMP_GET_SOCKET_POWER, &stats);
+	if (!rc && (stats.calls != 1 || stats.successes != 1)) {
+		pr_fail(0);
+		pr_test_note("calls %llu successes %llu\n", stats.calls,
+			     stats.successes);
+	} else if (rc && stats.successes) {
+		pr_fail(0);
+	} else {
+		pr_pass();
+	}
+}
+
 void get_cpu_info(void)
 {
 	unsigned int eax, ebx, ecx, edx;
 
+	/* The simulated SMU presents itself as Family 19h */
+	if (getenv("HSMP_SIM")) {
+		cpu_family = 0x19;
+		cpu_model = 0;
+		return;
+	}
+
         __cpuid(1, eax, ebx, ecx, edx);
         cpu_family = (eax >> 8) & 0xf;
         cpu_model = (eax >> 4) & 0xf;
@@ -843,15 +1437,42 @@ struct hsmp_testcase hsmp_testcases[] = {
 	{ "NBIO P-state",
 	  test_nbio_pstate,
 	},
+	{ "NBIO P-state for Devices",
+	  test_nbio_pstate_for_devices,
+	},
 	{ "DDR Bandwidth",
 	  test_hsmp_ddr,
 	},
 	{ "HSMP strerror",
 	  test_hsmp_strerror,
 	},
+	{ "Poll Policy",
+	  test_poll_policy,
+	},
+	{ "Batch Submission",
+	  test_submit_batch,
+	},
+	{ "Async Submission",
+	  test_async,
+	},
+	{ "Throttle Watch",
+	  test_watch,
+	},
+	{ "Socket Telemetry",
+	  test_socket_telemetry,
+	},
+	{ "Performance Profiles",
+	  test_profiles,
+	},
+	{ "Mailbox Counters",
+	  test_mbox_counters,
+	},
+	{ "Message Statistics",
+	  test_stats,
+	},
 };
 
-int max_testcase = 12;
+int max_testcase = 21;
 
 void usage(void)
 {
@@ -869,6 +1490,7 @@ int main(int argc, char **argv)
 {
 	int test_index;
 	int do_seteuid;
+	int sim_mode;
 	uid_t euid;
 	char opt;
 	int rc;
@@ -904,10 +1526,12 @@ int main(int argc, char **argv)
 	get_cpu_info();
 	printf("Testing on CPU Family %xh, Model %xh\n", cpu_family, cpu_model);
 
+	/* The simulator does not require root */
 	euid = geteuid();
-	privileged_user = euid ? 0 : 1;
+	sim_mode = getenv("HSMP_SIM") != NULL;
+	privileged_user = (euid && !sim_mode) ? 0 : 1;
 	printf("Running test as %sprivileged user (euid %d)\n",
-	       euid ? "non-" : "", euid);
+	       privileged_user ? "" : "non-", euid);
 
 	test_hsmp_enablement();
 
@@ -956,13 +1580,22 @@ int main(int argc, char **argv)
 		else
 			pr_pass();
 
-		if (euid != 0)
+		if (euid != 0 && !sim_mode)
 			privileged_user = 0;
 	}
 
 	test_nbio_pstate();
+	test_nbio_pstate_for_devices();
 	test_hsmp_ddr();
 	test_hsmp_strerror();
+	test_poll_policy();
+	test_submit_batch();
+	test_async();
+	test_watch();
+	test_socket_telemetry();
+	test_profiles();
+	test_mbox_counters();
+	test_stats();
 
 	print_results();
 	return 0;
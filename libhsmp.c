@@ -8,21 +8,29 @@
  * AMD Host System Management Port library
  */
 
+#define _GNU_SOURCE  /* Needed for F_OFD_SETLKW */
 #include <unistd.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
 #include <cpuid.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sched.h>
 #include <string.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <pci/pci.h>
 #include <pci/types.h>
-#include <sys/file.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 
 #include "libhsmp.h"
 
@@ -50,34 +58,35 @@ static struct {
 	u32 mbox_timeout;   /* Timeout in MS to consider the SMU hung */
 } hsmp_access;
 
+/* Highest message ID known to the library */
+#define HSMP_MAX_MSG_ID		HSMP_GET_DDR_BANDWIDTH
+
 /*
- * Message types
- *
- * All implementations are required to support HSMP_TEST, HSMP_GET_SMU_VER,
- * and HSMP_GET_PROTO_VER. All other messages are implementation dependent.
+ * Default mailbox polling policy. Most messages are serviced by the SMU
+ * within a few tens of microseconds, spin briefly before backing off.
  */
-enum hsmp_msg_t {
-	HSMP_TEST				=  1,
-	HSMP_GET_SMU_VER			=  2,
-	HSMP_GET_PROTO_VER			=  3,
-	HSMP_GET_SOCKET_POWER			=  4,
-	HSMP_SET_SOCKET_POWER_LIMIT		=  5,
-	HSMP_GET_SOCKET_POWER_LIMIT		=  6,
-	HSMP_GET_SOCKET_POWER_LIMIT_MAX		=  7,
-	HSMP_SET_BOOST_LIMIT			=  8,
-	HSMP_SET_BOOST_LIMIT_SOCKET		=  9,
-	HSMP_GET_BOOST_LIMIT			= 10,
-	HSMP_GET_PROC_HOT			= 11,
-	HSMP_SET_XGMI_LINK_WIDTH		= 12,
-	HSMP_SET_DF_PSTATE			= 13,
-	HSMP_AUTO_DF_PSTATE			= 14,
-	HSMP_GET_FCLK_MCLK			= 15,
-	HSMP_GET_CCLK_THROTTLE_LIMIT		= 16,
-	HSMP_GET_C0_PERCENT			= 17,
-	HSMP_SET_NBIO_DPM_LEVEL			= 18,
-	HSMP_GET_DDR_BANDWIDTH			= 20,
+#define HSMP_DEFAULT_SPIN_US		50
+#define HSMP_DEFAULT_MIN_SLEEP_US	20
+#define HSMP_DEFAULT_MAX_SLEEP_US	1000
+
+static pthread_mutex_t poll_policy_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct hsmp_poll_policy poll_policy[HSMP_MAX_MSG_ID + 1] = {
+	[0 ... HSMP_MAX_MSG_ID] = {
+		.spin_us	= HSMP_DEFAULT_SPIN_US,
+		.min_sleep_us	= HSMP_DEFAULT_MIN_SLEEP_US,
+		.max_sleep_us	= HSMP_DEFAULT_MAX_SLEEP_US,
+	},
 };
 
+/*
+ * Per thread send timeout, see hsmp_set_timeout_us(), 0 for the default
+ * of waiting for the socket lock indefinitely and allowing each message
+ * mbox_timeout. send_deadline is the deadline of the message or batch
+ * the thread is sending, 0 if none.
+ */
+static __thread uint64_t thread_timeout_ns;
+static __thread uint64_t send_deadline;
+
 struct hsmp_message {
 	enum hsmp_msg_t	msg_num;	/* Message number */
 	u16		num_args;	/* Number of arguments in message */
@@ -91,34 +100,156 @@ union smu_fw_ver {
 	u32 raw_u32;
 };
 
+/*
+ * A cached SMU value, stamp is the hsmp_now_ns() time the value was
+ * stored or 0 if no value is cached.
+ */
+struct cached_val {
+	u32		val;
+	uint64_t	stamp;
+};
+
 struct nbio_dev {
 	struct pci_dev *dev;		/* Pointer to PCI-e device in the socket */
+	volatile u8	*ecam;		/* Mapped config space for ECAM access */
 	u8		id;		/* NBIO tile number within the socket */
 	u8		bus_base;	/* Lowest hosted PCI-e bus number */
-	u8		bus_limit;	/* Highest hosted PCI-e bus number + 1 */
+	u8		bus_limit;	/* Highest hosted PCI-e bus number */
+	struct cached_val pstate;	/* Last set by libhsmp */
+};
+
+struct socket_cache {
+	struct cached_val	max_power_limit;	/* Invariant */
+	struct cached_val	ddr_max_bw;		/* Invariant */
+	struct cached_val	power_limit;
+	struct cached_val	df_pstate;		/* Last set by libhsmp */
+	struct cached_val	xgmi_width;		/* Last set, min << 8 | max */
 };
 
 struct cpu_dev {
-	int	valid;
-	int	socket_id;
-	int	apicid;
+	int			valid;
+	int			socket_id;
+	int			apicid;
+	struct cached_val	boost_limit;
+};
+
+/* Physical core, indexed by APIC ID >> smt_shift */
+struct core_dev {
+	int			socket_id;	/* -1 if no CPU maps to the core */
+	bool			limit_set;
+	u32			boost_limit;	/* Last boost limit set by libhsmp */
+};
+
+struct socket_dev {
+	struct nbio_dev		*root;		/* IOHC hosting the lowest bus */
+	pthread_mutex_t		lock;		/* Serializes threads, see hsmp_lock() */
+	struct socket_cache	cache;
+};
+
+#define NBIOS_PER_SOCKET	4
+
+/*
+ * Message descriptors, indexed by message ID. Every message sent, whether
+ * by a wrapper, a batch or an async job, must match its descriptor's
+ * argument and response counts. IDs without a descriptor (min_proto of 0)
+ * are not defined by any interface version.
+ *
+ * The scope is what the message acts on, the SMU of a socket, a core of
+ * the socket given by its APIC ID in the argument, or every socket in the
+ * system. The cache policy of single word, socket scope reads selects how
+ * long the response is kept in cache_off of the socket cache, see
+ * hsmp_get_socket_val().
+ */
+enum msg_scope {
+	MSG_SCOPE_SOCKET,
+	MSG_SCOPE_CORE,
+	MSG_SCOPE_SYSTEM,
+};
+
+enum msg_cache {
+	MSG_CACHE_NONE,
+	MSG_CACHE_TTL,		/* Kept for the hsmp_set_cache_ttl() TTL */
+	MSG_CACHE_INVARIANT,	/* Kept until hsmp_fini() */
+};
+
+struct hsmp_msg_desc {
+	const char	*name;
+	u8		num_args;	/* Number of arguments in message */
+	u8		response_sz;	/* Number of expected response words */
+	u8		min_proto;	/* First interface version with the message */
+	u8		scope;		/* enum msg_scope */
+	u8		cache;		/* enum msg_cache */
+	u8		cache_off;	/* Offset of the cached_val in socket_cache */
 };
 
-#define MAX_SOCKETS	2
-#define MAX_NBIOS	8
-#define MAX_CPUS	256
+#define MSG_DESC(id, args, resp, proto, sc) \
+	[id] = { .name = #id, .num_args = args, .response_sz = resp, \
+		 .min_proto = proto, .scope = MSG_SCOPE_##sc }
+
+#define MSG_DESC_CACHED(id, args, resp, proto, sc, policy, member) \
+	[id] = { .name = #id, .num_args = args, .response_sz = resp, \
+		 .min_proto = proto, .scope = MSG_SCOPE_##sc, \
+		 .cache = MSG_CACHE_##policy, \
+		 .cache_off = offsetof(struct socket_cache, member) }
+
+static const struct hsmp_msg_desc msg_descs[HSMP_MAX_MSG_ID + 1] = {
+	MSG_DESC(HSMP_TEST,			  1, 1, 1, SOCKET),
+	MSG_DESC(HSMP_GET_SMU_VER,		  0, 1, 1, SYSTEM),
+	MSG_DESC(HSMP_GET_PROTO_VER,		  0, 1, 1, SYSTEM),
+	MSG_DESC(HSMP_GET_SOCKET_POWER,		  0, 1, 1, SOCKET),
+	MSG_DESC(HSMP_SET_SOCKET_POWER_LIMIT,	  1, 0, 1, SOCKET),
+	MSG_DESC_CACHED(HSMP_GET_SOCKET_POWER_LIMIT, 0, 1, 1, SOCKET,
+			TTL, power_limit),
+	MSG_DESC_CACHED(HSMP_GET_SOCKET_POWER_LIMIT_MAX, 0, 1, 1, SOCKET,
+			INVARIANT, max_power_limit),
+	MSG_DESC(HSMP_SET_BOOST_LIMIT,		  1, 0, 1, CORE),
+	MSG_DESC(HSMP_SET_BOOST_LIMIT_SOCKET,	  1, 0, 1, SOCKET),
+	MSG_DESC(HSMP_GET_BOOST_LIMIT,		  1, 1, 1, CORE),
+	MSG_DESC(HSMP_GET_PROC_HOT,		  0, 1, 1, SOCKET),
+	MSG_DESC(HSMP_SET_XGMI_LINK_WIDTH,	  1, 0, 1, SYSTEM),
+	MSG_DESC(HSMP_SET_DF_PSTATE,		  1, 0, 1, SOCKET),
+	MSG_DESC(HSMP_AUTO_DF_PSTATE,		  0, 0, 1, SOCKET),
+	MSG_DESC(HSMP_GET_FCLK_MCLK,		  0, 2, 1, SOCKET),
+	MSG_DESC(HSMP_GET_CCLK_THROTTLE_LIMIT,	  0, 1, 1, SOCKET),
+	MSG_DESC(HSMP_GET_C0_PERCENT,		  0, 1, 1, SOCKET),
+	MSG_DESC(HSMP_SET_NBIO_DPM_LEVEL,	  1, 0, 2, SOCKET),
+	MSG_DESC(HSMP_GET_DDR_BANDWIDTH,	  0, 1, 3, SOCKET),
+};
 
+/*
+ * The NBIO, socket and CPU tables are sized from the discovered topology.
+ * The NBIO table is sorted by bus base, so the NBIOs of socket N are at
+ * indexes N * NBIOS_PER_SOCKET and up. The CPU table is indexed by the
+ * Linux CPU number.
+ */
 static struct {
 	struct pci_access	*pacc;			/* PCIlib */
-	struct nbio_dev		nbios[MAX_NBIOS];	/* Array of DevID 0x1480 devices */
-	struct cpu_dev		cpus[MAX_CPUS];
+	struct nbio_dev		*nbios;			/* Array of DevID 0x1480 devices */
+	int			num_nbios;
+	short			bus_nbio[256];		/* NBIO index by bus, -1 if none */
+	struct socket_dev	*sockets;
+	int			num_sockets;
+	struct cpu_dev		*cpus;
+	int			num_cpus;		/* Highest CPU number + 1 */
+	int			max_apicid;
+	unsigned int		smt_shift;		/* APIC ID bits for SMT thread */
+	struct core_dev		*cores;
+	int			num_cores;
 	union smu_fw_ver	smu_firmware;		/* SMU firmware version code */
 	unsigned int		hsmp_proto_ver;		/* HSMP implementation level */
 	unsigned int		x86_family;		/* Family number */
 	int			initialized;
-	int			lock_fd;
-	int			hsmp_disabled;
-} hsmp_data;
+	int			pci_scanned;		/* IOHC devs from pci_scan_bus() */
+	int			nbio_ids_ready;		/* IOHC IDs read */
+	int			cpus_ready;		/* CPU map built */
+	int			lock_fd;		/* HSMP_LOCK_FILE descriptor */
+	int			lock_cmd;		/* fcntl() record lock command */
+} hsmp_data = {
+	.lock_fd = -1,
+};
+
+/* hsmp_init_ex() flags, the defaults are used for implicit initialization */
+static unsigned int init_flags;
 
 /* HSMP Status codes used internally */
 #define HSMP_STATUS_NOT_READY   0x00
@@ -164,26 +295,32 @@ char *hsmp_strerror(int err, int errno_val)
  */
 static bool msg_id_supported(enum hsmp_msg_t msg_id)
 {
-	enum hsmp_msg_t max_supported_id;
+	if (msg_id < HSMP_TEST || msg_id > HSMP_MAX_MSG_ID ||
+	    !msg_descs[msg_id].min_proto)
+		return false;
 
-	switch (hsmp_data.hsmp_proto_ver) {
-	case 1:
-		max_supported_id = HSMP_GET_C0_PERCENT;
-		break;
+	return hsmp_data.hsmp_proto_ver >= msg_descs[msg_id].min_proto;
+}
 
-	case 2:
-		max_supported_id = HSMP_SET_NBIO_DPM_LEVEL;
-		break;
+#define NSEC_PER_USEC	1000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_SEC	1000000000ULL
 
-	case 3:
-		max_supported_id = HSMP_GET_DDR_BANDWIDTH;
-		break;
+static uint64_t hsmp_now_ns(void)
+{
+	struct timespec ts;
 
-	default:
-		return false;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
 
-	return msg_id <= max_supported_id;
+static void hsmp_sleep_us(u32 usecs)
+{
+	struct timespec delay;
+
+	delay.tv_sec = usecs / 1000000;
+	delay.tv_nsec = (usecs % 1000000) * NSEC_PER_USEC;
+	nanosleep(&delay, NULL);
 }
 
 #define PCI_VENDOR_ID_AMD		0x1022
@@ -192,689 +329,4568 @@ static bool msg_id_supported(enum hsmp_msg_t msg_id)
 #define SMN_IOHCMISC_OFFSET		0x00100000  /* Offset for MISC[1..3] */
 
 /*
- * SMU access functions
- * Returns 0 on success, negative error code on failure. The return status
- * is for the SMU access, not the result of the intended SMU or HSMP operation.
+ * PCI config space access backends
  *
- * SMU PCI config space access method
- * There are two access apertures defined in the PCI-e config space for the
- * North Bridge, one for general purpose SMU register reads/writes and a second
- * aperture specific for HSMP messages and responses. For both reads and writes,
- * step one is to write the register to be accessed to the appropriate aperture
- * index register. Step two is to read or write the appropriate aperture data
- * register.
+ * The default backend uses libpci, which usually costs a syscall for each
+ * config space access. The ECAM backend maps the config space of each IOHC
+ * device once, using the MMCONFIG base address from the ACPI MCFG table,
+ * and accesses the config space registers with plain loads and stores.
+ *
+ * The ECAM backend is selected by setting HSMP_PCI_ACCESS=ecam in the
+ * environment, libpci is used if the mapping cannot be established.
  */
-static int smu_pci_write(struct pci_dev *root, u32 reg_addr,
-			 u32 reg_data, struct smu_port *port)
-{
-	pr_debug_pci("pci_write_long dev 0x%p, addr 0x%08X, data 0x%08X\n",
-		     root, port->index_reg, reg_addr);
-	pci_write_long(root, port->index_reg, reg_addr);
-
-	pr_debug_pci("pci_write_long dev 0x%p, addr 0x%08X, data 0x%08X\n",
-		     root, port->index_reg, reg_addr);
-	pci_write_long(root, port->data_reg, reg_data);
+struct smu_pci_ops {
+	const char	*name;
+	int		(*setup)(struct nbio_dev *nbio);
+	void		(*cleanup)(struct nbio_dev *nbio);
+	u32		(*read)(struct nbio_dev *nbio, int reg);
+	void		(*write)(struct nbio_dev *nbio, int reg, u32 val);
+};
 
-	return 0;
+static u32 libpci_read(struct nbio_dev *nbio, int reg)
+{
+	return pci_read_long(nbio->dev, reg);
 }
 
-static int smu_pci_read(struct pci_dev *root, u32 reg_addr,
-			u32 *reg_data, struct smu_port *port)
+static void libpci_write(struct nbio_dev *nbio, int reg, u32 val)
 {
-	pr_debug_pci("pci_write_long dev 0x%p, addr 0x%08X, data 0x%08X\n",
-		     root, port->index_reg, reg_addr);
-	pci_write_long(root, port->index_reg, reg_addr);
+	pci_write_long(nbio->dev, reg, val);
+}
 
-	*reg_data = pci_read_long(root, port->data_reg);
-	pr_debug_pci("pci_read_long  dev 0x%p, addr 0x%08X, data 0x%08X\n",
-		     root, port->data_reg, *reg_data);
+static const struct smu_pci_ops libpci_ops = {
+	.name	= "libpci",
+	.read	= libpci_read,
+	.write	= libpci_write,
+};
 
-	return 0;
-}
+#define ACPI_MCFG_TABLE		"/sys/firmware/acpi/tables/MCFG"
+#define ACPI_MCFG_HDR_SZ	44	/* ACPI table header + reserved */
+#define ECAM_MAP_SZ		4096
+
+struct acpi_mcfg_entry {
+	uint64_t	base;		/* ECAM base address */
+	u16		segment;	/* PCI segment group */
+	u8		start_bus;
+	u8		end_bus;
+	u32		reserved;
+} __attribute__ ((packed));
 
 /*
- * Return the PCI device pointer for the IOHC dev hosting the lowest numbered
- * PCI bus in the specified socket (0 or 1). If socket_id 1 is passed on a 1P
- * system, NULL will be returned.
+ * Find the ECAM base address of a bus from the ACPI MCFG table. The base
+ * address of an MCFG entry corresponds to bus 0 of its segment, even when
+ * the entry's bus range starts above 0.
  */
-static struct pci_dev *socket_id_to_dev(int socket_id)
+static int ecam_base_address(u16 segment, u8 bus, uint64_t *base)
 {
-	int idx;
+	struct acpi_mcfg_entry *entry;
+	char buf[ECAM_MAP_SZ];
+	ssize_t len;
+	int fd, off;
 
-	if (socket_id < 0 || socket_id >= MAX_SOCKETS)
-		return NULL;
+	fd = open(ACPI_MCFG_TABLE, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
 
-	idx = socket_id * 4;
-	return hsmp_data.nbios[idx].dev;
-}
+	len = read(fd, buf, sizeof(buf));
+	close(fd);
+
+	for (off = ACPI_MCFG_HDR_SZ; off + (ssize_t)sizeof(*entry) <= len;
+	     off += sizeof(*entry)) {
+		entry = (struct acpi_mcfg_entry *)&buf[off];
+		if (entry->segment == segment && bus >= entry->start_bus &&
+		    bus <= entry->end_bus) {
+			*base = entry->base + ((uint64_t)bus << 20);
+			return 0;
+		}
+	}
 
-#define HSMP_LOCK_FILE	"/var/lock/hsmp"
+	return -1;
+}
 
-static int hsmp_lock(void)
+static int ecam_setup(struct nbio_dev *nbio)
 {
-	int err;
+	uint64_t base;
+	void *map;
+	int fd;
 
-	hsmp_data.lock_fd = open(HSMP_LOCK_FILE, O_CREAT, S_IROTH | S_IWOTH);
-	if (hsmp_data.lock_fd == -1)
+	if (ecam_base_address(nbio->dev->domain, nbio->dev->bus, &base))
 		return -1;
 
-	err = flock(hsmp_data.lock_fd, LOCK_EX);
-	if (err) {
-		/* Should we re-try? */
-		close(hsmp_data.lock_fd);
+	base += (nbio->dev->dev << 15) | (nbio->dev->func << 12);
+
+	fd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
+	if (fd == -1)
 		return -1;
-	}
 
+	map = mmap(NULL, ECAM_MAP_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, base);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return -1;
+
+	nbio->ecam = map;
 	return 0;
 }
 
-static void hsmp_unlock(void)
+static void ecam_cleanup(struct nbio_dev *nbio)
 {
-	flock(hsmp_data.lock_fd, LOCK_UN);
-	close(hsmp_data.lock_fd);
+	if (nbio->ecam) {
+		munmap((void *)nbio->ecam, ECAM_MAP_SZ);
+		nbio->ecam = NULL;
+	}
+}
+
+static u32 ecam_read(struct nbio_dev *nbio, int reg)
+{
+	return *(volatile u32 *)(nbio->ecam + reg);
 }
 
+static void ecam_write(struct nbio_dev *nbio, int reg, u32 val)
+{
+	*(volatile u32 *)(nbio->ecam + reg) = val;
+}
+
+static const struct smu_pci_ops ecam_ops = {
+	.name		= "ecam",
+	.setup		= ecam_setup,
+	.cleanup	= ecam_cleanup,
+	.read		= ecam_read,
+	.write		= ecam_write,
+};
+
 /*
- * Send a message to the SMU access port via PCI-e config space registers.
- * The caller is expected to zero out any unused arguments. If a response
- * is expected, the number of response words should be greater than 0.
- * Returns 0 for success and populates the requested number of arguments
- * in the passed struct. Returns a negative error code for failure.
+ * Simulated SMU
+ *
+ * Setting HSMP_SIM in the environment, or passing HSMP_INIT_SIM to
+ * hsmp_init_ex(), replaces the IOHC devices with a simulated topology and
+ * the config space backend with an emulation of the SMU index/data
+ * apertures and the HSMP mailbox registers. No PCI, CPUID or /dev/hsmp
+ * access is made, so libhsmp can be tested and benchmarked on any system.
+ *
+ * HSMP_SIM is a comma separated list of key=value options, an empty value
+ * or "1" selects the defaults shown in brackets.
+ *	sockets=N	Sockets, each with NBIOS_PER_SOCKET IOHCs [2]
+ *	cpus=N		CPUs, numbered socket by socket [32 per socket]
+ *	proto=N		HSMP interface version [3]
+ *	latency_us=N	Mailbox service time [20]
+ *	jitter_us=N	Random additional service time, up to N [10]
+ *	error_pct=P	Messages failing with HSMP_ERR_INVALID_ARG [0]
+ *	timeout_pct=P	Messages never completing [0]
+ *	seed=N		Random number seed [1]
+ *
+ * Faults are only injected once libhsmp is initialized. The SMU state is
+ * private to the process, mailbox access is still serialized across
+ * processes, using HSMP_SIM_LOCK_FILE.
  */
-static int _hsmp_send_message(struct pci_dev *root_dev, struct hsmp_message *msg)
+#define SIM_SMU_VERSION		0x00452E00	/* 69.46.0 */
+#define SIM_MAX_POWER		280000		/* mW */
+#define SIM_DEFAULT_POWER	225000		/* mW */
+#define SIM_FMAX		3500		/* MHz */
+#define SIM_DDR_MAX_BW		204		/* GB/s */
+
+static const u32 sim_fclk[] = { 1600, 1467, 1333, 1200 };
+
+struct sim_nbio {
+	u32		smu_index;	/* SMU aperture index register */
+	u32		hsmp_index;	/* HSMP aperture index register */
+};
+
+struct sim_mbox {
+	u32		status;		/* Status register */
+	u32		result;		/* Status once the message is serviced */
+	u32		data[8];	/* Argument and response registers */
+	bool		busy;
+	uint64_t	ready;		/* Service completion time */
+	unsigned int	seed;
+	u32		power_limit;
+	u32		xgmi_width;
+	int		df_pstate;	/* -1 for automatic P-state selection */
+};
+
+static struct {
+	bool		enabled;
+	int		sockets;
+	int		cpus;
+	unsigned int	proto;
+	u32		latency_us;
+	u32		jitter_us;
+	double		error_pct;
+	double		timeout_pct;
+	unsigned int	seed;
+	struct sim_nbio	*nbios;
+	struct sim_mbox	*mboxes;		/* One per socket */
+	u32		*boost_limits;		/* Indexed by APIC ID */
+} sim;
+
+static int sim_parse_option(const char *key, const char *val)
 {
-	struct timespec one_ms = { 0, 1000 * 1000 };
-	unsigned int arg_num = 0;
-	int err, timeout;
-	u32 mbox_status;
+	unsigned long n;
+	double pct;
+	char *end;
 
-	/* Zero the status register */
-	mbox_status = HSMP_STATUS_NOT_READY;
-	err = smu_pci_write(root_dev, hsmp_access.mbox_status, mbox_status, &hsmp);
-	if (err) {
-		pr_debug("Error %d clearing HSMP mailbox status register\n", err);
-		return err;
-	}
+	if (!strcmp(key, "error_pct") || !strcmp(key, "timeout_pct")) {
+		pct = strtod(val, &end);
+		if (end == val || *end || pct < 0 || pct > 100)
+			return -1;
 
-	/* Write any message arguments */
-	for (arg_num = 0; arg_num < msg->num_args; arg_num++) {
-		err = smu_pci_write(root_dev, hsmp_access.mbox_data + (arg_num << 2),
-				    msg->args[arg_num], &hsmp);
-		if (err) {
-			pr_debug("Error %d writing HSMP message argument %d\n",
-				 err, arg_num);
-			return err;
-		}
+		if (key[0] == 'e')
+			sim.error_pct = pct;
+		else
+			sim.timeout_pct = pct;
+		return 0;
 	}
 
-	/* Write the message ID which starts the operation */
-	err = smu_pci_write(root_dev, hsmp_access.mbox_msg_id, msg->msg_num, &hsmp);
-	if (err) {
-		pr_debug("Error %d writing HSMP message ID %u\n", err, msg->msg_num);
-		return err;
-	}
+	errno = 0;
+	n = strtoul(val, &end, 0);
+	if (end == val || *end || errno || n > INT_MAX)
+		return -1;
 
-	timeout = hsmp_access.mbox_timeout;
+	if (!strcmp(key, "sockets"))
+		sim.sockets = n;
+	else if (!strcmp(key, "cpus"))
+		sim.cpus = n;
+	else if (!strcmp(key, "proto"))
+		sim.proto = n;
+	else if (!strcmp(key, "latency_us"))
+		sim.latency_us = n;
+	else if (!strcmp(key, "jitter_us"))
+		sim.jitter_us = n;
+	else if (!strcmp(key, "seed"))
+		sim.seed = n;
+	else
+		return -1;
 
-	/*
-	 * Assume it takes at least one SMU FW cycle (1 MS) to complete
-	 * the operation. Some operations might complete in two, some in
-	 * more. So first thing we do is yield the CPU.
-	 */
-retry:
-	nanosleep(&one_ms, NULL);
-	err = smu_pci_read(root_dev, hsmp_access.mbox_status, &mbox_status, &hsmp);
-	if (err) {
-		pr_debug("HSMP message ID %u - error %d reading mailbox status\n",
-			 err, msg->msg_num);
-		return err;
-	}
+	return 0;
+}
 
-	/* SMU has not responded to the message yet. */
-	if (mbox_status == HSMP_STATUS_NOT_READY) {
-		if (--timeout == 0) {
-			pr_debug("SMU timeout for message ID %u\n", msg->msg_num);
-			errno = ETIMEDOUT;
+/*
+ * Enable the simulator if requested and parse its options. Returns -1
+ * with errno set to EINVAL if the options are invalid.
+ */
+static int sim_setup(void)
+{
+	char *opts, *opt, *val, *save;
+	const char *env;
+	int err = 0;
+
+	env = secure_getenv("HSMP_SIM");
+	sim.enabled = env || (init_flags & HSMP_INIT_SIM);
+	if (!sim.enabled)
+		return 0;
+
+	sim.sockets = 2;
+	sim.cpus = 0;
+	sim.proto = 3;
+	sim.latency_us = 20;
+	sim.jitter_us = 10;
+	sim.error_pct = 0;
+	sim.timeout_pct = 0;
+	sim.seed = 1;
+
+	if (env && *env && strcmp(env, "1")) {
+		opts = strdup(env);
+		if (!opts) {
+			errno = ENOMEM;
 			return -1;
 		}
 
-		goto retry;
-	}
+		for (opt = strtok_r(opts, ",", &save); opt && !err;
+		     opt = strtok_r(NULL, ",", &save)) {
+			val = strchr(opt, '=');
+			if (!val) {
+				err = -1;
+				break;
+			}
 
-	/*
-	 * Some platforms may not support every HSMP interface covered
-	 * by the HSMP interface version specified. For these instances
-	 * a status code of HSMP_ERR_INVALID_MSG_ID is returned. If we
-	 * see this status and the msg_id is considered supported by the
-	 * interface version we return EBADMSG.
-	 */
-	if (mbox_status == HSMP_ERR_INVALID_MSG_ID &&
-	    msg_id_supported(msg->msg_num)) {
-		errno = EBADMSG;
-		return -1;
+			*val++ = '\0';
+			err = sim_parse_option(opt, val);
+		}
+
+		free(opts);
 	}
 
-	if (mbox_status != HSMP_STATUS_OK)
-		return mbox_status;
+	if (!sim.cpus)
+		sim.cpus = 32 * sim.sockets;
 
-	/* SMU has responded OK. Read response data */
-	for (arg_num = 0; arg_num < msg->response_sz; arg_num++) {
-		err = smu_pci_read(root_dev, hsmp_access.mbox_data + (arg_num << 2),
-				   &msg->response[arg_num], &hsmp);
-		if (err) {
-			pr_debug("Error %d reading HSMP response %u for message ID %u\n",
-				 err, arg_num, msg->msg_num);
-			return err;
-		}
+	/* Bus numbers are split evenly between the IOHCs, APIC IDs are 16 bit */
+	if (err || sim.sockets < 1 || sim.sockets * NBIOS_PER_SOCKET > 256 ||
+	    sim.cpus < sim.sockets || sim.cpus % sim.sockets || sim.cpus > 0x10000) {
+		pr_debug("Invalid HSMP_SIM options \"%s\"\n", env);
+		sim.enabled = false;
+		errno = EINVAL;
+		return -1;
 	}
 
+	pr_debug("Simulating %d sockets, %d CPUs, HSMP interface version %u\n",
+		 sim.sockets, sim.cpus, sim.proto);
 	return 0;
 }
 
-static int hsmp_send_message(int socket_id, struct hsmp_message *msg)
+static void sim_cleanup(void)
 {
-	struct pci_dev *root_dev;
-	int err;
-#ifdef DEBUG_HSMP
-	unsigned int arg_num = 0;
-#endif
+	free(sim.nbios);
+	sim.nbios = NULL;
+	free(sim.mboxes);
+	sim.mboxes = NULL;
+	free(sim.boost_limits);
+	sim.boost_limits = NULL;
+}
 
-	root_dev = socket_id_to_dev(socket_id);
-	if (!root_dev) {
-		errno = EINVAL;
+/* Populate the NBIO table with the simulated IOHC devices */
+static int sim_add_nbios(void)
+{
+	int num_nbios = sim.sockets * NBIOS_PER_SOCKET;
+	int i;
+
+	hsmp_data.nbios = calloc(num_nbios, sizeof(struct nbio_dev));
+	sim.nbios = calloc(num_nbios, sizeof(*sim.nbios));
+	sim.mboxes = calloc(sim.sockets, sizeof(*sim.mboxes));
+	sim.boost_limits = calloc(sim.cpus, sizeof(u32));
+	if (!hsmp_data.nbios || !sim.nbios || !sim.mboxes || !sim.boost_limits) {
+		pr_debug("Failed to allocate simulated SMU state\n");
 		return -1;
 	}
 
-	err = hsmp_lock();
-	if (err)
-		return -1;
+	for (i = 0; i < num_nbios; i++)
+		hsmp_data.nbios[i].bus_base = i * (256 / num_nbios);
+	hsmp_data.num_nbios = num_nbios;
 
-#ifdef DEBUG_HSMP
-	pr_debug("Sending message ID %d to socket %d\n", msg->msg_num, socket_id);
-	while (msg->num_args && arg_num < msg->num_args) {
-		pr_debug("    arg[%d] 0x%08X\n", arg_num, msg->args[arg_num]);
-			 arg_num++;
+	for (i = 0; i < sim.sockets; i++) {
+		sim.mboxes[i].seed = sim.seed + i;
+		sim.mboxes[i].power_limit = SIM_DEFAULT_POWER;
+		sim.mboxes[i].xgmi_width = HSMP_XGMI_WIDTH_X2 << 8 | HSMP_XGMI_WIDTH_X16;
+		sim.mboxes[i].df_pstate = -1;
 	}
-#endif
 
-	err = _hsmp_send_message(root_dev, msg);
-	hsmp_unlock();
+	for (i = 0; i < sim.cpus; i++)
+		sim.boost_limits[i] = SIM_FMAX;
 
-	return err;
+	return num_nbios;
 }
 
-/* Read a register in SMN address space */
-static int smu_read(struct pci_dev *root, u32 addr, u32 *val)
+static int sim_cpu_socket(u32 apicid)
 {
-	return smu_pci_read(root, addr, val, &smu);
+	return apicid / (sim.cpus / sim.sockets);
 }
 
-/*
- * Takes a PCI-e bus number and returns the index into the NBIOs array
- * matching the host NBIO device. Returns -1 if the bus is not found.
- */
-static int bus_to_nbio(u8 bus)
+static u32 sim_boost_limit(u32 limit)
 {
-	int idx;
-
-	for (idx = 0; idx < MAX_NBIOS; idx++) {
-		if (bus >= hsmp_data.nbios[idx].bus_base &&
-		    bus <= hsmp_data.nbios[idx].bus_limit)
-			return idx;
-	}
+	return limit < SIM_FMAX ? limit : SIM_FMAX;
+}
 
-	return -1;
+static bool sim_chance(struct sim_mbox *mbox, double pct)
+{
+	return pct > 0 && rand_r(&mbox->seed) < pct / 100 * ((double)RAND_MAX + 1);
 }
 
-static int cpu_apicid(int cpu)
+/* Service a message the way the SMU would, returns the mailbox status */
+static u32 sim_service(int socket_id, struct sim_mbox *mbox, u32 msg_id)
 {
-	if (cpu > MAX_CPUS) {
-		errno = EINVAL;
-		return -1;
-	}
+	u32 *data = mbox->data;
+	u32 apicid, min, max, used;
+	int cpu, per_socket;
 
-	if (!hsmp_data.cpus[cpu].valid) {
-		errno = EINVAL;
-		return -1;
+	if (msg_id > HSMP_MAX_MSG_ID || !msg_descs[msg_id].min_proto ||
+	    msg_descs[msg_id].min_proto > sim.proto)
+		return HSMP_ERR_INVALID_MSG_ID;
+
+	switch (msg_id) {
+	case HSMP_TEST:
+		data[0]++;
+		break;
+	case HSMP_GET_SMU_VER:
+		data[0] = SIM_SMU_VERSION;
+		break;
+	case HSMP_GET_PROTO_VER:
+		data[0] = sim.proto;
+		break;
+	case HSMP_GET_SOCKET_POWER:
+		data[0] = mbox->power_limit / 2 +
+			  rand_r(&mbox->seed) % (mbox->power_limit / 2 + 1);
+		break;
+	case HSMP_SET_SOCKET_POWER_LIMIT:
+		mbox->power_limit = data[0] < SIM_MAX_POWER ? data[0] : SIM_MAX_POWER;
+		break;
+	case HSMP_GET_SOCKET_POWER_LIMIT:
+		data[0] = mbox->power_limit;
+		break;
+	case HSMP_GET_SOCKET_POWER_LIMIT_MAX:
+		data[0] = SIM_MAX_POWER;
+		break;
+	case HSMP_SET_BOOST_LIMIT:
+		apicid = data[0] >> 16;
+		if (apicid >= sim.cpus || sim_cpu_socket(apicid) != socket_id)
+			return HSMP_ERR_INVALID_ARG;
+		sim.boost_limits[apicid] = sim_boost_limit(data[0] & 0xFFFF);
+		break;
+	case HSMP_SET_BOOST_LIMIT_SOCKET:
+		per_socket = sim.cpus / sim.sockets;
+		for (cpu = socket_id * per_socket; cpu < (socket_id + 1) * per_socket; cpu++)
+			sim.boost_limits[cpu] = sim_boost_limit(data[0] & 0xFFFF);
+		break;
+	case HSMP_GET_BOOST_LIMIT:
+		apicid = data[0];
+		if (apicid >= sim.cpus || sim_cpu_socket(apicid) != socket_id)
+			return HSMP_ERR_INVALID_ARG;
+		data[0] = sim.boost_limits[apicid];
+		break;
+	case HSMP_GET_PROC_HOT:
+		data[0] = mbox->power_limit < SIM_DEFAULT_POWER / 2;
+		break;
+	case HSMP_SET_XGMI_LINK_WIDTH:
+		min = (data[0] >> 8) & 0xFF;
+		max = data[0] & 0xFF;
+		if (max > HSMP_XGMI_WIDTH_X16 || min > max)
+			return HSMP_ERR_INVALID_ARG;
+		mbox->xgmi_width = data[0];
+		break;
+	case HSMP_SET_DF_PSTATE:
+		if (data[0] > HSMP_DF_PSTATE_3)
+			return HSMP_ERR_INVALID_ARG;
+		mbox->df_pstate = data[0];
+		break;
+	case HSMP_AUTO_DF_PSTATE:
+		mbox->df_pstate = -1;
+		break;
+	case HSMP_GET_FCLK_MCLK:
+		data[0] = sim_fclk[mbox->df_pstate < 0 ? 0 : mbox->df_pstate];
+		data[1] = data[0];
+		break;
+	case HSMP_GET_CCLK_THROTTLE_LIMIT:
+		/* Power limits below the default throttle the cores */
+		data[0] = mbox->power_limit < SIM_DEFAULT_POWER ?
+			  (uint64_t)SIM_FMAX * mbox->power_limit / SIM_DEFAULT_POWER :
+			  SIM_FMAX;
+		break;
+	case HSMP_GET_C0_PERCENT:
+		data[0] = rand_r(&mbox->seed) % 101;
+		break;
+	case HSMP_SET_NBIO_DPM_LEVEL:
+		min = data[0] & 0xFF;
+		max = (data[0] >> 8) & 0xFF;
+		if (((data[0] >> 16) & 0xFF) >= NBIOS_PER_SOCKET || max > 2 || min > max)
+			return HSMP_ERR_INVALID_ARG;
+		break;
+	case HSMP_GET_DDR_BANDWIDTH:
+		used = rand_r(&mbox->seed) % (SIM_DDR_MAX_BW + 1);
+		data[0] = SIM_DDR_MAX_BW << 20 | used << 8 | used * 100 / SIM_DDR_MAX_BW;
+		break;
+	default:
+		return HSMP_ERR_INVALID_MSG_ID;
 	}
 
-	return hsmp_data.cpus[cpu].apicid;
+	return HSMP_STATUS_OK;
 }
 
-static int cpu_socket_id(int cpu)
+/*
+ * Writing the message ID starts the message, the response is computed
+ * straight away and the status becomes visible once the service time
+ * has passed. A message chosen to time out stays busy until the status
+ * register is cleared for the next message.
+ */
+static void sim_mbox_write(int socket_id, u32 reg, u32 val)
 {
-	if (cpu > MAX_CPUS) {
-		errno = EINVAL;
-		return -1;
-	}
+	struct sim_mbox *mbox = &sim.mboxes[socket_id];
+	bool faults = hsmp_data.initialized;
+	u32 service_us;
+
+	if (reg == hsmp_access.mbox_status) {
+		mbox->status = val;
+		mbox->busy = false;
+	} else if (reg >= hsmp_access.mbox_data &&
+		   reg < hsmp_access.mbox_data + sizeof(mbox->data)) {
+		mbox->data[(reg - hsmp_access.mbox_data) >> 2] = val;
+	} else if (reg == hsmp_access.mbox_msg_id) {
+		mbox->busy = true;
+		if (faults && sim_chance(mbox, sim.timeout_pct)) {
+			mbox->ready = UINT64_MAX;
+			return;
+		}
 
-	if (!hsmp_data.cpus[cpu].valid) {
-		errno = EINVAL;
-		return -1;
+		if (faults && sim_chance(mbox, sim.error_pct))
+			mbox->result = HSMP_ERR_INVALID_ARG;
+		else
+			mbox->result = sim_service(socket_id, mbox, val);
+
+		service_us = sim.latency_us;
+		if (sim.jitter_us)
+			service_us += rand_r(&mbox->seed) % (sim.jitter_us + 1);
+		mbox->ready = hsmp_now_ns() + service_us * NSEC_PER_USEC;
 	}
+}
 
-	return hsmp_data.cpus[cpu].socket_id;
+static u32 sim_mbox_read(int socket_id, u32 reg)
+{
+	struct sim_mbox *mbox = &sim.mboxes[socket_id];
+
+	if (reg == hsmp_access.mbox_status) {
+		if (mbox->busy && hsmp_now_ns() >= mbox->ready) {
+			mbox->status = mbox->result;
+			mbox->busy = false;
+		}
+		return mbox->status;
+	}
+
+	if (reg >= hsmp_access.mbox_data &&
+	    reg < hsmp_access.mbox_data + sizeof(mbox->data))
+		return mbox->data[(reg - hsmp_access.mbox_data) >> 2];
+
+	return 0;
 }
 
 /*
- * Probe HSMP mailboxes to verify HSMP is enabled, if successful retrieve
- * the SMU fw version and HSMP interface version.
- *
- * Returns -1 with errno set to ENOTSUP if the test message fails, or
- * errno set to EAGAIN if retrieving the SMU fw version or interface
- * version fails.
+ * The only SMN registers read through the SMU aperture are the bus number
+ * registers of the IOHCs. IOHC IDs are deliberately not in bus order, as
+ * on real systems, to exercise hsmp_map_nbio_ids().
  */
-static int hsmp_probe(void)
+static u32 sim_smn_read(int socket_id, u32 addr)
 {
-	struct hsmp_message msg = { 0 };
-	int socket_found;
-	int socket_id;
-	int err;
-
-	/*
-	 * Check each socket to be safe. The test message takes one argument and
-	 * returns the value of that argument + 1. The protocol version and SMU
-	 * version messages take no arguments and return one.
-	 */
-	socket_found = 0;
-	for (socket_id = 0; socket_id < MAX_SOCKETS; socket_id++) {
-		if (!socket_id_to_dev(socket_id))
-			break;
+	u32 off = addr - SMN_IOHCMISC0_NB_BUS_NUM_CNTL;
+	int id = off / SMN_IOHCMISC_OFFSET;
 
-		msg.msg_num = HSMP_TEST;
-		msg.num_args = 1;
-		msg.args[0] = 1;
-		msg.response_sz = 1;
+	if (addr < SMN_IOHCMISC0_NB_BUS_NUM_CNTL || off % SMN_IOHCMISC_OFFSET ||
+	    id >= NBIOS_PER_SOCKET)
+		return 0;
 
-		/*
-		 * Send a test message to verify HSMP enablement. If this call
-		 * fails the issue is due to HSMP not being enabled in BIOS.
-		 *
-		 * Set the disabled flag to short-circuit future library calls
-		 * from going through library initialization.
-		 */
-		err = hsmp_send_message(socket_id, &msg);
-		if (err) {
-			pr_debug("HSMP Test failed for socket %d\n", socket_id);
-			hsmp_data.hsmp_disabled = 1;
-			errno = ENOTSUP;
-			return -1;
-		}
+	id = (id + 1) % NBIOS_PER_SOCKET;
+	return hsmp_data.nbios[socket_id * NBIOS_PER_SOCKET + id].bus_base;
+}
 
-		if (msg.response[0] != msg.args[0] + 1) {
-			pr_debug("HSMP test failed for socket %d, expected %x, received %x\n",
-				 socket_id, msg.args[0] + 1, msg.response[0]);
-			hsmp_data.hsmp_disabled = 1;
-			errno = ENOTSUP;
-			return -1;
-		}
+static u32 sim_read(struct nbio_dev *nbio, int reg)
+{
+	int idx = nbio - hsmp_data.nbios;
+	int socket_id = idx / NBIOS_PER_SOCKET;
+
+	if (reg == smu.data_reg)
+		return sim_smn_read(socket_id, sim.nbios[idx].smu_index);
+	if (reg == hsmp.data_reg)
+		return sim_mbox_read(socket_id, sim.nbios[idx].hsmp_index);
+	if (reg == smu.index_reg)
+		return sim.nbios[idx].smu_index;
+	if (reg == hsmp.index_reg)
+		return sim.nbios[idx].hsmp_index;
+
+	return 0xFFFFFFFF;
+}
 
-		if (!socket_found) {
-			/* Retrieve SMU FW Version */
-			msg.msg_num = HSMP_GET_SMU_VER;
-			msg.num_args = 0;
-			msg.args[0] = 0xDEADBEEF;
-			msg.response_sz = 1;
+static void sim_write(struct nbio_dev *nbio, int reg, u32 val)
+{
+	int idx = nbio - hsmp_data.nbios;
+
+	if (reg == smu.index_reg)
+		sim.nbios[idx].smu_index = val;
+	else if (reg == hsmp.index_reg)
+		sim.nbios[idx].hsmp_index = val;
+	else if (reg == hsmp.data_reg)
+		sim_mbox_write(idx / NBIOS_PER_SOCKET, sim.nbios[idx].hsmp_index, val);
+}
 
-			err = hsmp_send_message(socket_id, &msg);
-			if (err) {
-				pr_debug("Could not retrieve SMU FW Version\n");
-				errno = EAGAIN;
-				return -1;
-			}
+static const struct smu_pci_ops sim_ops = {
+	.name	= "sim",
+	.read	= sim_read,
+	.write	= sim_write,
+};
 
-			hsmp_data.smu_firmware.raw_u32 = msg.response[0];
+static const struct smu_pci_ops *pci_ops = &libpci_ops;
 
-			pr_debug("SMU FW Version %u:%u:%u\n",
-				 hsmp_data.smu_firmware.ver.major,
-				 hsmp_data.smu_firmware.ver.minor,
-				 hsmp_data.smu_firmware.ver.debug);
+/*
+ * SMU access functions
+ * Returns 0 on success, negative error code on failure. The return status
+ * is for the SMU access, not the result of the intended SMU or HSMP operation.
+ *
+ * SMU PCI config space access method
+ * There are two access apertures defined in the PCI-e config space for the
+ * North Bridge, one for general purpose SMU register reads/writes and a second
+ * aperture specific for HSMP messages and responses. For both reads and writes,
+ * step one is to write the register to be accessed to the appropriate aperture
+ * index register. Step two is to read or write the appropriate aperture data
+ * register.
+ */
+static int smu_pci_write(struct nbio_dev *root, u32 reg_addr,
+			 u32 reg_data, struct smu_port *port)
+{
+	pr_debug_pci("%s write dev 0x%p, addr 0x%08X, data 0x%08X\n",
+		     pci_ops->name, root->dev, port->index_reg, reg_addr);
+	pci_ops->write(root, port->index_reg, reg_addr);
 
-			/* Retrieve HSMP Interface Version */
-			msg.msg_num = HSMP_GET_PROTO_VER;
-			msg.num_args = 0;
-			msg.args[0] = 0xDEADBEEF;
-			msg.response_sz = 1;
+	pr_debug_pci("%s write dev 0x%p, addr 0x%08X, data 0x%08X\n",
+		     pci_ops->name, root->dev, port->data_reg, reg_data);
+	pci_ops->write(root, port->data_reg, reg_data);
 
-			err = hsmp_send_message(socket_id, &msg);
-			if (err) {
-				pr_debug("Could not retrieve HSMP Interface Version\n");
-				errno = EAGAIN;
-				return -1;
-			}
+	return 0;
+}
 
-			hsmp_data.hsmp_proto_ver = msg.response[0];
-			pr_debug("Interface Version: %d\n", hsmp_data.hsmp_proto_ver);
+static int smu_pci_read(struct nbio_dev *root, u32 reg_addr,
+			u32 *reg_data, struct smu_port *port)
+{
+	pr_debug_pci("%s write dev 0x%p, addr 0x%08X, data 0x%08X\n",
+		     pci_ops->name, root->dev, port->index_reg, reg_addr);
+	pci_ops->write(root, port->index_reg, reg_addr);
 
-			socket_found = 1;
-		}
-	}
+	*reg_data = pci_ops->read(root, port->data_reg);
+	pr_debug_pci("%s read  dev 0x%p, addr 0x%08X, data 0x%08X\n",
+		     pci_ops->name, root->dev, port->data_reg, *reg_data);
 
 	return 0;
 }
 
-static int get_system_info(void)
+/*
+ * Return the NBIO device for the IOHC dev hosting the lowest numbered
+ * PCI bus in the specified socket. If the socket does not exist, NULL
+ * will be returned.
+ */
+static struct nbio_dev *socket_id_to_dev(int socket_id)
 {
-	unsigned int eax, ebx, ecx, edx;
-	unsigned int family, model;
-	int id = 0;
-	char vendstr[3][8] __attribute__ ((unused)) = {"unknown", "Intel", "AMD"};
+	if (socket_id < 0 || socket_id >= hsmp_data.num_sockets)
+		return NULL;
 
-	__cpuid(0, eax, ebx, ecx, edx);
-	if (ebx == 0x756e6547 && ecx == 0x6c65746e && edx == 0x49656e69)
-		id = 1;
-	else if (ebx == 0x68747541 && ecx == 0x444d4163 && edx == 0x69746e65)
-		id = 2;
+	return hsmp_data.sockets[socket_id].root;
+}
 
-	__cpuid(1, eax, ebx, ecx, edx);
-	family = (eax >> 8) & 0xf;
-	model = (eax >> 4) & 0xf;
+#define HSMP_LOCK_FILE		"/var/lock/hsmp"
+#define HSMP_SIM_LOCK_FILE	"/var/lock/hsmp-sim"
+#define HSMP_SIM_USER_LOCK_FILE	"/tmp/hsmp-sim-%u"	/* Unprivileged, by uid */
 
-	if (family == 0xf)
-		family += (eax >> 20) & 0xff;
+static char lock_path[32];
 
-	if (family >= 6)
-		model += ((eax >> 16) & 0xf) << 4;
+/*
+ * HSMP mailbox access is serialized across processes with a record lock
+ * on HSMP_LOCK_FILE. Each socket has an independent mailbox, so each
+ * socket gets its own lock domain, a single byte at offset socket_id,
+ * allowing messages to different sockets to proceed in parallel.
+ *
+ * The lock file is opened once during library initialization and kept
+ * open until the library is unloaded. Open file description locks are
+ * preferred, falling back to traditional POSIX record locks on kernels
+ * that do not support them. The lock command is chosen here so the
+ * message path only reads lock_fd and lock_cmd.
+ *
+ * Record locks and flock() locks do not exclude each other. Earlier
+ * libhsmp builds, and binaries statically linked against them, flock()
+ * the same file and are not serialized against this library.
+ *
+ * The simulator may run unprivileged. Non-root users can't share a lock
+ * file root created in /var/lock, so each user gets a lock file of its own.
+ */
+static int hsmp_open_lock(void)
+{
+	struct flock fl = { 0 };
+	mode_t mode = S_IROTH | S_IWOTH;
+	int flags = O_RDWR | O_CREAT | O_CLOEXEC;
+
+	if (!sim.enabled) {
+		strcpy(lock_path, HSMP_LOCK_FILE);
+	} else if (!geteuid()) {
+		strcpy(lock_path, HSMP_SIM_LOCK_FILE);
+	} else {
+		snprintf(lock_path, sizeof(lock_path), HSMP_SIM_USER_LOCK_FILE,
+			 geteuid());
+		mode = S_IRUSR | S_IWUSR;
+		flags |= O_NOFOLLOW;
+	}
 
-	hsmp_data.x86_family = family;
+	hsmp_data.lock_fd = open(lock_path, flags, mode);
+	if (hsmp_data.lock_fd == -1) {
+		pr_debug("Failed to open lock file %s\n", lock_path);
+		return -1;
+	}
 
-	/*
-	 * Family 0x17 = Zen/Zen2, models 30h - 3Fh
-	 * Family 0x19 = Zen3
-	 */
-	if (id == 2 && (
-#ifdef HSMP_FAMILY_0x17
-		(family == 0x17 && model >= 0x30 && model <= 0x3F) ||
-#endif
-		(family >= 0x19))) {
-		pr_debug("Detected %s CPU family %xh model %xh\n",
-			 vendstr[id], family, model);
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_len = 1;
 
-		if (family == 0x17)
-			fprintf(stderr,
-				"WARNING: libhsmp not supported on %s CPU Family 0x17 CPUs\n",
-				vendstr[id]);
-		return 0;
+	hsmp_data.lock_cmd = F_OFD_SETLKW;
+	if (fcntl(hsmp_data.lock_fd, F_OFD_GETLK, &fl) && errno == EINVAL) {
+		pr_debug("OFD locks not supported, using POSIX record locks\n");
+		hsmp_data.lock_cmd = F_SETLKW;
 	}
 
-	pr_debug("libhsmp not supported on %s CPU family %xh model %xh\n",
-		 vendstr[id], family, model);
-	hsmp_data.hsmp_disabled = 1;
-	errno = ENOTSUP;
-	return -1;
+	return 0;
 }
 
-static void hsmp_clear_nbio_table(void)
+/*
+ * A forked child inherits the lock file descriptor and, with it, the open
+ * file description that owns the parent's OFD locks, so parent and child
+ * would not exclude each other. Give the child its own open file
+ * description. The socket mutexes are reset as well, a thread holding one
+ * in the parent does not exist in the child.
+ */
+static void hsmp_lock_atfork_child(void)
 {
 	int i;
 
-	for (i = 0; i < MAX_NBIOS; i++) {
-		hsmp_data.nbios[i].dev = NULL;
-		hsmp_data.nbios[i].id = 0;
-		hsmp_data.nbios[i].bus_base = 0xFF;
-		hsmp_data.nbios[i].bus_limit = 0;
-	}
+	if (hsmp_data.lock_fd == -1)
+		return;
+
+	close(hsmp_data.lock_fd);
+	hsmp_data.lock_fd = open(lock_path, O_RDWR | O_CLOEXEC);
+
+	for (i = 0; i < hsmp_data.num_sockets; i++)
+		pthread_mutex_init(&hsmp_data.sockets[i].lock, NULL);
 }
 
-static void hsmp_cleanup_nbios(void)
+static void hsmp_close_lock(void)
 {
-	if (hsmp_data.pacc) {
-		pci_cleanup(hsmp_data.pacc);
-		hsmp_data.pacc = NULL;
+	if (hsmp_data.lock_fd != -1) {
+		close(hsmp_data.lock_fd);
+		hsmp_data.lock_fd = -1;
 	}
-
-	hsmp_clear_nbio_table();
 }
 
-static int hsmp_setup_nbios(void)
+static int hsmp_lock_op(int socket_id, short type)
 {
-	struct pci_dev *dev;
-	int num_nbios;
-	u8 base;
-	int i;
+	struct flock fl = { 0 };
+	int err;
 
-	hsmp_clear_nbio_table();
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = socket_id;
+	fl.l_len = 1;
 
-	/* Setup pcilib */
-	hsmp_data.pacc = pci_alloc();
-	if (!hsmp_data.pacc) {
-		pr_debug("Failed to allocate PCI access structures\n");
-		goto nbio_setup_error;
-	}
+	do {
+		err = fcntl(hsmp_data.lock_fd, hsmp_data.lock_cmd, &fl);
+	} while (err && errno == EINTR);
 
-	/* First, find all IOHC devices (root complex) */
-	pci_init(hsmp_data.pacc);
-	pci_scan_bus(hsmp_data.pacc);
+	return err;
+}
 
-	num_nbios = 0;
-	for (dev = hsmp_data.pacc->devices; dev; dev = dev->next) {
-		pci_fill_info(dev, PCI_FILL_IDENT);
+/*
+ * Take the socket mutex and record lock before send_deadline, polling the
+ * record lock with back-off. Returns -1 with errno set to EBUSY if the
+ * deadline expires.
+ */
+static int hsmp_lock_deadline(int socket_id)
+{
+	pthread_mutex_t *lock = &hsmp_data.sockets[socket_id].lock;
+	struct flock fl = { 0 };
+	struct timespec abstime;
+	uint64_t now;
+	u32 sleep_us = 10;
+	int cmd, err;
+
+	/* send_deadline is on the CLOCK_MONOTONIC timeline of hsmp_now_ns() */
+	abstime.tv_sec = send_deadline / NSEC_PER_SEC;
+	abstime.tv_nsec = send_deadline % NSEC_PER_SEC;
+
+	err = pthread_mutex_clocklock(lock, CLOCK_MONOTONIC, &abstime);
+	if (err) {
+		errno = (err == ETIMEDOUT) ? EBUSY : err;
+		return -1;
+	}
 
-		if (dev->vendor_id != PCI_VENDOR_ID_AMD ||
-		    dev->device_id != F17F19_IOHC_DEVID)
-			continue;
+	cmd = (hsmp_data.lock_cmd == F_OFD_SETLKW) ? F_OFD_SETLK : F_SETLK;
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = socket_id;
+	fl.l_len = 1;
+
+	for (;;) {
+		err = fcntl(hsmp_data.lock_fd, cmd, &fl);
+		if (!err)
+			return 0;
 
-		base = dev->bus;
-		pr_debug("Found IOHC dev on bus 0x%02X\n", base);
+		if (errno != EAGAIN && errno != EACCES && errno != EINTR)
+			break;
 
-		if (num_nbios == MAX_NBIOS) {
-			pr_debug("Exceeded max NBIO devices\n");
-			goto nbio_setup_error;
+		now = hsmp_now_ns();
+		if (now >= send_deadline) {
+			errno = EBUSY;
+			break;
 		}
 
-		hsmp_data.nbios[num_nbios].dev = dev;
-		hsmp_data.nbios[num_nbios].bus_base = base;
-		num_nbios++;
-	}
+		if (sleep_us * NSEC_PER_USEC > send_deadline - now)
+			sleep_us = (send_deadline - now) / NSEC_PER_USEC + 1;
 
-	if (num_nbios == 0 || (num_nbios % (MAX_NBIOS / 2))) {
-		pr_debug("Expected %d or %d IOHC devices, found %d\n",
-			 MAX_NBIOS / 2, MAX_NBIOS, num_nbios);
-		goto nbio_setup_error;
+		hsmp_sleep_us(sleep_us);
+		sleep_us = sleep_us < 500 ? sleep_us * 2 : 1000;
 	}
 
-	/* Sort the table by bus_base */
-	for (i = 0; i < num_nbios - 1; i++) {
-		int j;
+	err = errno;
+	pthread_mutex_unlock(lock);
+	errno = err;
+	return -1;
+}
 
-		for (j = i + 1; j < num_nbios; j++) {
-			if (hsmp_data.nbios[j].bus_base < hsmp_data.nbios[i].bus_base) {
-				struct pci_dev *temp_dev = hsmp_data.nbios[i].dev;
-				u8 temp_bus_base         = hsmp_data.nbios[i].bus_base;
+/*
+ * Record locks do not serialize threads sharing the lock file descriptor,
+ * threads within the process are serialized per socket with a mutex taken
+ * before the record lock.
+ */
+static int hsmp_lock(int socket_id)
+{
+	pthread_mutex_t *lock = &hsmp_data.sockets[socket_id].lock;
+	int err;
 
-				hsmp_data.nbios[i].dev      = hsmp_data.nbios[j].dev;
-				hsmp_data.nbios[i].bus_base = hsmp_data.nbios[j].bus_base;
+	if (send_deadline)
+		return hsmp_lock_deadline(socket_id);
 
-				hsmp_data.nbios[j].dev      = temp_dev;
-				hsmp_data.nbios[j].bus_base = temp_bus_base;
-			}
-		}
-	}
+	pthread_mutex_lock(lock);
 
-	/* Calculate bus limits - we can safely assume no overlapping ranges */
-	for (i = 0; i < num_nbios; i++) {
-		if (i < num_nbios - 1)
-			hsmp_data.nbios[i].bus_limit = hsmp_data.nbios[i + 1].bus_base - 1;
-		else
-			hsmp_data.nbios[i].bus_limit = 0xFF;
-	}
+	err = hsmp_lock_op(socket_id, F_WRLCK);
+	if (err)
+		pthread_mutex_unlock(lock);
 
-	/* Finally get IOHC ID for each bus base */
-	for (i = 0; i < num_nbios; i++) {
-		int err, idx;
-		u32 addr, val;
+	return err;
+}
 
-		addr = SMN_IOHCMISC0_NB_BUS_NUM_CNTL + (i & 0x3) * SMN_IOHCMISC_OFFSET;
-		err = smu_read(hsmp_data.nbios[i].dev, addr, &val);
-		if (err) {
-			pr_debug("Error %d accessing socket %d IOHCMISC%d\n",
-				 err, i >> 2, i & 0x3);
-			goto nbio_setup_error;
-		}
+static void hsmp_unlock(int socket_id)
+{
+	hsmp_lock_op(socket_id, F_UNLCK);
+	pthread_mutex_unlock(&hsmp_data.sockets[socket_id].lock);
+}
 
-		pr_debug("Socket %d IOHC%d smu_read addr 0x%08X = 0x%08X\n",
-			 i >> 2, i & 0x3, addr, val);
-		base = val & 0xFF;
+/*
+ * SMU value cache
+ *
+ * Values that cannot change at runtime (e.g. the maximum socket power
+ * limit) are cached after the first read. Values that can change, such
+ * as the current power limit or a core boost limit, are only cached for
+ * the TTL set with hsmp_set_cache_ttl(), caching of these is disabled by
+ * default. Setting a value through libhsmp invalidates its cached copy.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cache_ttl_ns;
 
-		/* Look up this bus base in our array */
-		idx = bus_to_nbio(base);
-		if (idx == -1) {
-			pr_debug("Unable to map bus 0x%02X to an IOHC device\n", base);
-			goto nbio_setup_error;
+static bool cache_get(struct cached_val *c, u32 *val, bool invariant)
+{
+	bool valid;
+
+	pthread_mutex_lock(&cache_lock);
+	valid = c->stamp &&
+		(invariant || hsmp_now_ns() - c->stamp < cache_ttl_ns);
+	if (valid)
+		*val = c->val;
+	pthread_mutex_unlock(&cache_lock);
+
+	return valid;
+}
+
+static void cache_put(struct cached_val *c, u32 val)
+{
+	pthread_mutex_lock(&cache_lock);
+	c->val = val;
+	c->stamp = hsmp_now_ns();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+static void cache_invalidate(struct cached_val *c)
+{
+	pthread_mutex_lock(&cache_lock);
+	c->stamp = 0;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/* The socket cache entry for msg_id's response, NULL if it is not cached */
+static struct cached_val *msg_cache(int socket_id, enum hsmp_msg_t msg_id)
+{
+	const struct hsmp_msg_desc *desc = &msg_descs[msg_id];
+
+	if (desc->scope != MSG_SCOPE_SOCKET || desc->cache == MSG_CACHE_NONE)
+		return NULL;
+
+	return (struct cached_val *)((char *)&hsmp_data.sockets[socket_id].cache +
+				     desc->cache_off);
+}
+
+static bool msg_cache_get(int socket_id, enum hsmp_msg_t msg_id, u32 *val)
+{
+	struct cached_val *c = msg_cache(socket_id, msg_id);
+
+	return c && cache_get(c, val, msg_descs[msg_id].cache == MSG_CACHE_INVARIANT);
+}
+
+static void msg_cache_put(int socket_id, enum hsmp_msg_t msg_id, u32 val)
+{
+	struct cached_val *c = msg_cache(socket_id, msg_id);
+
+	if (c)
+		cache_put(c, val);
+}
+
+/*
+ * Record a boost limit set for a core, or for every core in the socket if
+ * core is -1. The cached boost limits read back for the socket are
+ * invalidated. If the set failed the limit applied is unknown and the
+ * last set value is forgotten.
+ */
+static void record_boost_limit(int socket_id, int core, u32 boost_limit,
+			       bool set)
+{
+	struct core_dev *c;
+	int cpu, i;
+
+	if (!hsmp_data.cpus_ready)
+		return;
+
+	pthread_mutex_lock(&cache_lock);
+	for (cpu = 0; cpu < hsmp_data.num_cpus; cpu++) {
+		if (hsmp_data.cpus[cpu].valid &&
+		    hsmp_data.cpus[cpu].socket_id == socket_id)
+			hsmp_data.cpus[cpu].boost_limit.stamp = 0;
+	}
+
+	for (i = 0; i < hsmp_data.num_cores; i++) {
+		c = &hsmp_data.cores[i];
+		if (c->socket_id != socket_id || (core != -1 && core != i))
+			continue;
+
+		c->limit_set = set;
+		c->boost_limit = boost_limit;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Mailbox status polling state for a message in flight. Polling spins for
+ * the policy spin window and then backs off exponentially up to the
+ * policy maximum so that long running operations do not hammer PCI
+ * config space.
+ */
+struct mbox_poll {
+	struct hsmp_poll_policy	policy;
+	uint64_t		start;
+	uint64_t		spin_end;
+	uint64_t		deadline;
+	u32			sleep_us;
+	u32			polls;		/* Status reads, HSMP_STATS only */
+};
+
+static void mbox_poll_init(struct mbox_poll *poll, enum hsmp_msg_t msg_id)
+{
+	uint64_t start;
+
+	pthread_mutex_lock(&poll_policy_lock);
+	poll->policy = poll_policy[msg_id <= HSMP_MAX_MSG_ID ? msg_id : 0];
+	pthread_mutex_unlock(&poll_policy_lock);
+	poll->sleep_us = poll->policy.min_sleep_us;
+
+	start = hsmp_now_ns();
+	poll->start = start;
+	poll->polls = 0;
+	poll->spin_end = start + poll->policy.spin_us * NSEC_PER_USEC;
+	poll->deadline = start + hsmp_access.mbox_timeout * NSEC_PER_MSEC;
+}
+
+/*
+ * A message is not started once the send deadline has expired. Once
+ * started it is always given the full mailbox timeout, the socket lock
+ * must not be released while the SMU may still be handling the message
+ * or the next sender would post over it.
+ */
+static int send_deadline_expired(void)
+{
+	if (send_deadline && hsmp_now_ns() >= send_deadline) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns the number of microseconds to wait before the next status read,
+ * 0 to keep spinning, or -1 if the mailbox timeout has expired.
+ */
+static long mbox_poll_delay(struct mbox_poll *poll, uint64_t now)
+{
+	u32 delay;
+
+	if (now >= poll->deadline)
+		return -1;
+
+	if (now < poll->spin_end || !poll->sleep_us)
+		return 0;
+
+	delay = poll->sleep_us;
+
+	poll->sleep_us <<= 1;
+	if (poll->sleep_us > poll->policy.max_sleep_us)
+		poll->sleep_us = poll->policy.max_sleep_us;
+
+	return delay;
+}
+
+/*
+ * Per message ID statistics, see hsmp_get_stats(). Only built with
+ * HSMP_STATS defined, otherwise the hooks below compile to nothing.
+ */
+#ifdef HSMP_STATS
+static struct hsmp_msg_stats msg_stats[HSMP_MAX_MSG_ID + 1];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint64_t stats_now(void)
+{
+	return hsmp_now_ns();
+}
+
+static inline void stats_poll(struct mbox_poll *poll)
+{
+	poll->polls++;
+}
+
+static void stats_hist_add(unsigned long long *hist, uint64_t ns)
+{
+	uint64_t us = ns / NSEC_PER_USEC;
+	int bucket = 0;
+
+	while (us && bucket < HSMP_STATS_BUCKETS - 1) {
+		us >>= 1;
+		bucket++;
+	}
+
+	hist[bucket]++;
+}
+
+static void stats_lock_wait(u32 msg_id, uint64_t wait)
+{
+	struct hsmp_msg_stats *stats;
+
+	if (msg_id > HSMP_MAX_MSG_ID)
+		return;
+
+	stats = &msg_stats[msg_id];
+
+	pthread_mutex_lock(&stats_lock);
+	stats->lock_wait_ns += wait;
+	stats_hist_add(stats->lock_wait_hist, wait);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*
+ * Account a completed message. err follows the _hsmp_send_message()
+ * convention, > 0 is a SMU status and -1 is an errno failure.
+ */
+static void stats_message(u32 msg_id, int err, uint64_t start, u32 polls)
+{
+	struct hsmp_msg_stats *stats;
+	int errnum = errno;
+	uint64_t service;
+
+	if (msg_id > HSMP_MAX_MSG_ID)
+		return;
+
+	service = hsmp_now_ns() - start;
+	stats = &msg_stats[msg_id];
+
+	pthread_mutex_lock(&stats_lock);
+	stats->calls++;
+	if (!err)
+		stats->successes++;
+	else if (err > 0 || errnum == EBADMSG)
+		stats->smu_errors++;
+	else if (errnum == ETIMEDOUT)
+		stats->timeouts++;
+	else
+		stats->errors++;
+
+	stats->polls += polls;
+	stats->service_ns += service;
+	if (service > stats->max_service_ns)
+		stats->max_service_ns = service;
+	stats_hist_add(stats->service_hist, service);
+	pthread_mutex_unlock(&stats_lock);
+
+	errno = errnum;
+}
+#else
+static inline uint64_t stats_now(void) { return 0; }
+static inline void stats_poll(struct mbox_poll *poll) {}
+static inline void stats_lock_wait(u32 msg_id, uint64_t wait) {}
+static inline void stats_message(u32 msg_id, int err, uint64_t start,
+				 u32 polls) {}
+#endif
+
+/*
+ * Start a message on the SMU access port via PCI-e config space registers.
+ * The caller is expected to zero out any unused arguments.
+ */
+static int hsmp_mbox_start(struct nbio_dev *root_dev, struct hsmp_message *msg)
+{
+	unsigned int arg_num = 0;
+	u32 mbox_status;
+	int err;
+
+	/* Zero the status register */
+	mbox_status = HSMP_STATUS_NOT_READY;
+	err = smu_pci_write(root_dev, hsmp_access.mbox_status, mbox_status, &hsmp);
+	if (err) {
+		pr_debug("Error %d clearing HSMP mailbox status register\n", err);
+		return err;
+	}
+
+	/* Write any message arguments */
+	for (arg_num = 0; arg_num < msg->num_args; arg_num++) {
+		err = smu_pci_write(root_dev, hsmp_access.mbox_data + (arg_num << 2),
+				    msg->args[arg_num], &hsmp);
+		if (err) {
+			pr_debug("Error %d writing HSMP message argument %d\n",
+				 err, arg_num);
+			return err;
+		}
+	}
+
+	/* Write the message ID which starts the operation */
+	err = smu_pci_write(root_dev, hsmp_access.mbox_msg_id, msg->msg_num, &hsmp);
+	if (err) {
+		pr_debug("Error %d writing HSMP message ID %u\n", err, msg->msg_num);
+		return err;
+	}
+
+	return 0;
+}
+
+static int hsmp_mbox_status(struct nbio_dev *root_dev, struct hsmp_message *msg,
+			    u32 *mbox_status)
+{
+	int err;
+
+	err = smu_pci_read(root_dev, hsmp_access.mbox_status, mbox_status, &hsmp);
+	if (err)
+		pr_debug("HSMP message ID %u - error %d reading mailbox status\n",
+			 err, msg->msg_num);
+
+	return err;
+}
+
+/*
+ * Complete a message the SMU has responded to. Returns 0 for success and
+ * populates the requested number of response words in the passed struct.
+ */
+static int hsmp_mbox_finish(struct nbio_dev *root_dev, struct hsmp_message *msg,
+			    u32 mbox_status)
+{
+	unsigned int arg_num = 0;
+	int err;
+
+	/*
+	 * Some platforms may not support every HSMP interface covered
+	 * by the HSMP interface version specified. For these instances
+	 * a status code of HSMP_ERR_INVALID_MSG_ID is returned. If we
+	 * see this status and the msg_id is considered supported by the
+	 * interface version we return EBADMSG.
+	 */
+	if (mbox_status == HSMP_ERR_INVALID_MSG_ID &&
+	    msg_id_supported(msg->msg_num)) {
+		errno = EBADMSG;
+		return -1;
+	}
+
+	if (mbox_status != HSMP_STATUS_OK)
+		return mbox_status;
+
+	/* SMU has responded OK. Read response data */
+	for (arg_num = 0; arg_num < msg->response_sz; arg_num++) {
+		err = smu_pci_read(root_dev, hsmp_access.mbox_data + (arg_num << 2),
+				   &msg->response[arg_num], &hsmp);
+		if (err) {
+			pr_debug("Error %d reading HSMP response %u for message ID %u\n",
+				 err, arg_num, msg->msg_num);
+			return err;
 		}
+	}
 
-		hsmp_data.nbios[idx].id = i & 0x3;
+	return 0;
+}
+
+/*
+ * Send a message to the SMU access port via PCI-e config space registers.
+ * The caller is expected to zero out any unused arguments. If a response
+ * is expected, the number of response words should be greater than 0.
+ * Returns 0 for success and populates the requested number of arguments
+ * in the passed struct. Returns a negative error code for failure.
+ */
+static int _hsmp_send_message(struct nbio_dev *root_dev, struct hsmp_message *msg)
+{
+	struct mbox_poll poll;
+	u32 mbox_status;
+	long delay;
+	int err;
+
+	mbox_poll_init(&poll, msg->msg_num);
+
+	err = send_deadline_expired();
+	if (err)
+		goto out;
+
+	err = hsmp_mbox_start(root_dev, msg);
+	if (err)
+		goto out;
+
+	for (;;) {
+		err = hsmp_mbox_status(root_dev, msg, &mbox_status);
+		if (err)
+			goto out;
+
+		stats_poll(&poll);
+
+		/* SMU has responded to the message. */
+		if (mbox_status != HSMP_STATUS_NOT_READY)
+			break;
+
+		delay = mbox_poll_delay(&poll, hsmp_now_ns());
+		if (delay < 0) {
+			pr_debug("SMU timeout for message ID %u\n", msg->msg_num);
+			errno = ETIMEDOUT;
+			err = -1;
+			goto out;
+		}
+
+		if (delay)
+			hsmp_sleep_us(delay);
 	}
 
-	/* Dump the final table */
+	err = hsmp_mbox_finish(root_dev, msg, mbox_status);
+out:
+	stats_message(msg->msg_num, err, poll.start, poll.polls);
+	return err;
+}
+
+static void hsmp_debug_message(int socket_id, struct hsmp_message *msg)
+{
 #ifdef DEBUG_HSMP
-	for (i = 0; i < MAX_NBIOS; i++) {
-		pr_debug("IDX %d: Bus range 0x%02X - 0x%02X --> Socket %d IOHC %d\n",
-			 i, hsmp_data.nbios[i].bus_base, hsmp_data.nbios[i].bus_limit,
-			 i >> 2, hsmp_data.nbios[i].id);
+	unsigned int arg_num = 0;
+
+	pr_debug("Sending message ID %d (%s) to socket %d\n", msg->msg_num,
+		 msg->msg_num <= HSMP_MAX_MSG_ID && msg_descs[msg->msg_num].name ?
+		 msg_descs[msg->msg_num].name : "unknown", socket_id);
+	while (msg->num_args && arg_num < msg->num_args) {
+		pr_debug("    arg[%d] 0x%08X\n", arg_num, msg->args[arg_num]);
+			 arg_num++;
 	}
 #endif
+}
 
-	return 0;
+static int pci_send_message(int socket_id, struct hsmp_message *msg)
+{
+	struct nbio_dev *root_dev;
+	uint64_t lock_start;
+	int err;
+
+	root_dev = socket_id_to_dev(socket_id);
+
+	lock_start = stats_now();
+	err = hsmp_lock(socket_id);
+	if (err)
+		return -1;
+
+	stats_lock_wait(msg->msg_num, stats_now() - lock_start);
+
+	err = _hsmp_send_message(root_dev, msg);
+	hsmp_unlock(socket_id);
+
+	return err;
+}
+
+/*
+ * Batched message submission
+ *
+ * Requests in a batch are grouped by socket, each socket's lock is taken
+ * once for the whole batch and each socket works through its requests in
+ * array order. The mailboxes of all sockets involved are kept busy and
+ * polled together so a batch spanning sockets completes in roughly the
+ * time of the longest per-socket sequence.
+ *
+ * Requests not yet completed are marked with err = -1 and
+ * errnum = EINPROGRESS.
+ */
+struct batch_socket {
+	struct nbio_dev		*dev;
+	struct hsmp_request	*req;		/* Request in flight, NULL if idle */
+	struct hsmp_message	msg;		/* Message for the request in flight */
+	struct mbox_poll	poll;
+	int			next;		/* Next request index to consider */
+	bool			locked;
+	uint64_t		lock_wait;	/* Lock wait, HSMP_STATS only */
+};
+
+static bool request_pending(struct hsmp_request *req)
+{
+	return req->err == -1 && req->errnum == EINPROGRESS;
+}
+
+static void complete_request(struct hsmp_request *req, int err)
+{
+	req->err = err;
+	req->errnum = (err == -1) ? errno : 0;
+}
+
+static int validate_request(struct hsmp_request *req)
+{
+	if (req->msg_id < HSMP_TEST || req->num_args > 8 || req->response_sz > 8 ||
+	    !socket_id_to_dev(req->socket_id)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!msg_id_supported(req->msg_id)) {
+		errno = ENOMSG;
+		return -1;
+	}
+
+	if (req->num_args != msg_descs[req->msg_id].num_args ||
+	    req->response_sz != msg_descs[req->msg_id].response_sz) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Start the next pending request for a socket, returns false if none remain */
+static bool batch_start_next(struct batch_socket *bs, int socket_id,
+			     struct hsmp_request *reqs, int n)
+{
+	struct hsmp_request *req;
+	int err;
+
+	while (bs->next < n) {
+		req = &reqs[bs->next++];
+		if (req->socket_id != socket_id || !request_pending(req))
+			continue;
+
+		memset(&bs->msg, 0, sizeof(bs->msg));
+		bs->msg.msg_num = req->msg_id;
+		bs->msg.num_args = req->num_args;
+		bs->msg.response_sz = req->response_sz;
+		memcpy(bs->msg.args, req->args, req->num_args * sizeof(u32));
+
+		hsmp_debug_message(socket_id, &bs->msg);
+
+		mbox_poll_init(&bs->poll, req->msg_id);
+
+		/* Only the first message on each socket waits for the lock */
+		stats_lock_wait(req->msg_id, bs->lock_wait);
+		bs->lock_wait = 0;
+
+		err = send_deadline_expired();
+		if (!err)
+			err = hsmp_mbox_start(bs->dev, &bs->msg);
+		if (err) {
+			stats_message(req->msg_id, err, bs->poll.start, 0);
+			complete_request(req, err);
+			continue;
+		}
+
+		bs->req = req;
+		return true;
+	}
+
+	return false;
+}
+
+static void batch_finish(struct batch_socket *bs, u32 mbox_status)
+{
+	struct hsmp_request *req = bs->req;
+	int err;
+
+	err = hsmp_mbox_finish(bs->dev, &bs->msg, mbox_status);
+	if (!err)
+		memcpy(req->response, bs->msg.response, req->response_sz * sizeof(u32));
+
+	stats_message(req->msg_id, err, bs->poll.start, bs->poll.polls);
+	complete_request(req, err);
+	bs->req = NULL;
+}
+
+/*
+ * Returns 0 if every request in a batch succeeded, otherwise returns -1
+ * with errno set to EIO.
+ */
+static int batch_result(struct hsmp_request *reqs, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (reqs[i].err) {
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Send a batch of requests. Returns 0 if every request succeeded,
+ * otherwise returns -1 with errno set to EIO and the err and errnum fields
+ * of each failed request set.
+ */
+static int pci_send_batch(struct hsmp_request *reqs, int n)
+{
+	int num_sockets = hsmp_data.num_sockets;
+	struct batch_socket *sockets;
+	struct batch_socket *bs;
+	int socket_id, i, err;
+	u32 mbox_status;
+	long delay, min_delay;
+	uint64_t now, lock_start;
+	bool in_flight;
+
+	sockets = calloc(num_sockets, sizeof(*sockets));
+	if (!sockets) {
+		for (i = 0; i < n; i++)
+			complete_request(&reqs[i], -1);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (validate_request(&reqs[i])) {
+			complete_request(&reqs[i], -1);
+			continue;
+		}
+
+		reqs[i].err = -1;
+		reqs[i].errnum = EINPROGRESS;
+		sockets[reqs[i].socket_id].dev = socket_id_to_dev(reqs[i].socket_id);
+	}
+
+	/* Take the socket locks in ascending order */
+	for (socket_id = 0; socket_id < num_sockets; socket_id++) {
+		bs = &sockets[socket_id];
+		if (!bs->dev)
+			continue;
+
+		lock_start = stats_now();
+		if (hsmp_lock(socket_id)) {
+			for (i = 0; i < n; i++) {
+				if (reqs[i].socket_id == socket_id && request_pending(&reqs[i]))
+					complete_request(&reqs[i], -1);
+			}
+
+			bs->dev = NULL;
+			continue;
+		}
+
+		bs->locked = true;
+		bs->lock_wait = stats_now() - lock_start;
+	}
+
+	for (;;) {
+		in_flight = false;
+		for (socket_id = 0; socket_id < num_sockets; socket_id++) {
+			bs = &sockets[socket_id];
+			if (!bs->dev)
+				continue;
+
+			if (bs->req || batch_start_next(bs, socket_id, reqs, n))
+				in_flight = true;
+		}
+
+		if (!in_flight)
+			break;
+
+		/* Poll every mailbox in flight, sleep for the shortest back-off */
+		min_delay = -1;
+		now = hsmp_now_ns();
+		for (socket_id = 0; socket_id < num_sockets; socket_id++) {
+			bs = &sockets[socket_id];
+			if (!bs->req)
+				continue;
+
+			err = hsmp_mbox_status(bs->dev, &bs->msg, &mbox_status);
+			if (err) {
+				stats_message(bs->req->msg_id, err, bs->poll.start,
+					      bs->poll.polls);
+				complete_request(bs->req, err);
+				bs->req = NULL;
+				min_delay = 0;
+				continue;
+			}
+
+			stats_poll(&bs->poll);
+
+			if (mbox_status != HSMP_STATUS_NOT_READY) {
+				batch_finish(bs, mbox_status);
+				min_delay = 0;
+				continue;
+			}
+
+			delay = mbox_poll_delay(&bs->poll, now);
+			if (delay < 0) {
+				pr_debug("SMU timeout for message ID %u\n", bs->msg.msg_num);
+				errno = ETIMEDOUT;
+				stats_message(bs->req->msg_id, -1, bs->poll.start,
+					      bs->poll.polls);
+				complete_request(bs->req, -1);
+				bs->req = NULL;
+				min_delay = 0;
+				continue;
+			}
+
+			if (min_delay == -1 || delay < min_delay)
+				min_delay = delay;
+		}
+
+		if (min_delay > 0)
+			hsmp_sleep_us(min_delay);
+	}
+
+	for (socket_id = 0; socket_id < num_sockets; socket_id++) {
+		if (sockets[socket_id].locked)
+			hsmp_unlock(socket_id);
+	}
+
+	free(sockets);
+	return batch_result(reqs, n);
+}
+
+/*
+ * Kernel amd_hsmp driver access
+ *
+ * The amd_hsmp driver exposes the HSMP mailboxes through /dev/hsmp. The
+ * driver performs the mailbox handshake and serializes access to each
+ * socket, so a message costs a single ioctl and no userspace locking.
+ * On success the response words are returned in the args array.
+ */
+#define HSMP_DEV_FILE		"/dev/hsmp"
+
+struct hsmp_dev_message {
+	u32	msg_id;		/* Message ID */
+	u16	num_args;	/* Number of input argument words */
+	u16	response_sz;	/* Number of expected response words */
+	u32	args[8];	/* Argument(s), response word(s) on return */
+	u16	sock_ind;	/* Socket number */
+};
+
+#define HSMP_DEV_IOCTL_CMD	_IOWR(0xF8, 0, struct hsmp_dev_message)
+
+static int hsmp_dev_fd = -1;
+
+static int dev_open(void)
+{
+	hsmp_dev_fd = open(HSMP_DEV_FILE, O_RDWR | O_CLOEXEC);
+	if (hsmp_dev_fd == -1) {
+		pr_debug("Could not open %s, %s\n", HSMP_DEV_FILE, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void dev_close(void)
+{
+	if (hsmp_dev_fd != -1) {
+		close(hsmp_dev_fd);
+		hsmp_dev_fd = -1;
+	}
+}
+
+/*
+ * Send a message through the amd_hsmp driver. The driver reports HSMP
+ * error statuses as errno values, map these back to the HSMP error codes
+ * (or EBADMSG) returned by the PCI mailbox path.
+ */
+static int dev_ioctl_message(int socket_id, struct hsmp_message *msg)
+{
+	struct hsmp_dev_message dev_msg = { 0 };
+	int err;
+
+	dev_msg.msg_id = msg->msg_num;
+	dev_msg.num_args = msg->num_args;
+	dev_msg.response_sz = msg->response_sz;
+	dev_msg.sock_ind = socket_id;
+	memcpy(dev_msg.args, msg->args, msg->num_args * sizeof(u32));
+
+	do {
+		err = ioctl(hsmp_dev_fd, HSMP_DEV_IOCTL_CMD, &dev_msg);
+	} while (err == -1 && errno == EINTR);
+
+	if (err == -1) {
+		switch (errno) {
+		case ENOMSG:
+			if (msg_id_supported(msg->msg_num)) {
+				errno = EBADMSG;
+				return -1;
+			}
+			return HSMP_ERR_INVALID_MSG_ID;
+		case EINVAL:
+			return HSMP_ERR_INVALID_ARG;
+		default:
+			return -1;
+		}
+	}
+
+	memcpy(msg->response, dev_msg.args, msg->response_sz * sizeof(u32));
+	return 0;
+}
+
+/* The driver does the locking and polling, service time covers both */
+static int dev_send_message(int socket_id, struct hsmp_message *msg)
+{
+	uint64_t start = stats_now();
+	int err;
+
+	err = dev_ioctl_message(socket_id, msg);
+	stats_message(msg->msg_num, err, start, 0);
+
+	return err;
+}
+
+/* The driver serializes each message, send the batch in array order */
+static int dev_send_batch(struct hsmp_request *reqs, int n)
+{
+	struct hsmp_message msg;
+	struct hsmp_request *req;
+	int i, err;
+
+	for (i = 0; i < n; i++) {
+		req = &reqs[i];
+		if (validate_request(req)) {
+			complete_request(req, -1);
+			continue;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_num = req->msg_id;
+		msg.num_args = req->num_args;
+		msg.response_sz = req->response_sz;
+		memcpy(msg.args, req->args, req->num_args * sizeof(u32));
+
+		hsmp_debug_message(req->socket_id, &msg);
+
+		err = dev_send_message(req->socket_id, &msg);
+		if (!err)
+			memcpy(req->response, msg.response, req->response_sz * sizeof(u32));
+
+		complete_request(req, err);
+	}
+
+	return batch_result(reqs, n);
+}
+
+/*
+ * Message transports
+ *
+ * The kernel amd_hsmp driver is used when /dev/hsmp is available, messages
+ * are otherwise sent through the PCI-e config space mailbox apertures.
+ * Setting HSMP_TRANSPORT=pci in the environment forces the PCI-e path,
+ * which is also the only path to the simulated SMU.
+ */
+struct hsmp_transport {
+	const char	*name;
+	int		(*open)(void);
+	void		(*close)(void);
+	int		(*send)(int socket_id, struct hsmp_message *msg);
+	int		(*send_batch)(struct hsmp_request *reqs, int n);
+};
+
+static const struct hsmp_transport dev_transport = {
+	.name		= "amd_hsmp",
+	.open		= dev_open,
+	.close		= dev_close,
+	.send		= dev_send_message,
+	.send_batch	= dev_send_batch,
+};
+
+static const struct hsmp_transport pci_transport = {
+	.name		= "pci",
+	.open		= hsmp_open_lock,
+	.close		= hsmp_close_lock,
+	.send		= pci_send_message,
+	.send_batch	= pci_send_batch,
+};
+
+static const struct hsmp_transport *transport = &pci_transport;
+
+static int hsmp_open_transport(void)
+{
+	const char *name;
+
+	name = secure_getenv("HSMP_TRANSPORT");
+	if (!sim.enabled && (!name || strcmp(name, pci_transport.name))) {
+		if (!dev_transport.open()) {
+			transport = &dev_transport;
+			pr_debug("Using %s transport\n", transport->name);
+			return 0;
+		}
+	}
+
+	transport = &pci_transport;
+	pr_debug("Using %s transport\n", transport->name);
+	return transport->open();
+}
+
+static void hsmp_close_transport(void)
+{
+	transport->close();
+	transport = &pci_transport;
+}
+
+/* Running totals reported by hsmp_mbox_counters() */
+static struct hsmp_mbox_counters mbox_counters;
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void count_messages(int n, int errors, int timeouts, uint64_t start)
+{
+	uint64_t elapsed = hsmp_now_ns() - start;
+
+	pthread_mutex_lock(&counters_lock);
+	mbox_counters.messages += n;
+	mbox_counters.errors += errors;
+	mbox_counters.timeouts += timeouts;
+	mbox_counters.busy_ns += elapsed;
+	if (elapsed > mbox_counters.max_latency_ns)
+		mbox_counters.max_latency_ns = elapsed;
+	pthread_mutex_unlock(&counters_lock);
+}
+
+static int hsmp_send_message(int socket_id, struct hsmp_message *msg)
+{
+	uint64_t start;
+	int err, errnum;
+
+	if (!socket_id_to_dev(socket_id)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	hsmp_debug_message(socket_id, msg);
+
+	start = hsmp_now_ns();
+	send_deadline = thread_timeout_ns ? start + thread_timeout_ns : 0;
+	err = transport->send(socket_id, msg);
+	errnum = errno;
+	send_deadline = 0;
+
+	count_messages(1, !!err, err && errnum == ETIMEDOUT, start);
+
+	errno = errnum;
+	return err;
+}
+
+static int hsmp_send_batch(struct hsmp_request *reqs, int n)
+{
+	int errors, timeouts;
+	uint64_t start;
+	int i, err, errnum;
+
+	start = hsmp_now_ns();
+	send_deadline = thread_timeout_ns ? start + thread_timeout_ns : 0;
+	err = transport->send_batch(reqs, n);
+	errnum = errno;
+	send_deadline = 0;
+
+	errors = timeouts = 0;
+	for (i = 0; i < n; i++) {
+		if (!reqs[i].err)
+			continue;
+
+		errors++;
+		if (reqs[i].errnum == ETIMEDOUT)
+			timeouts++;
+	}
+
+	count_messages(n, errors, timeouts, start);
+
+	errno = errnum;
+	return err;
+}
+
+/* Read a register in SMN address space */
+static int smu_read(struct nbio_dev *root, u32 addr, u32 *val)
+{
+	return smu_pci_read(root, addr, val, &smu);
+}
+
+/*
+ * Takes a PCI-e bus number and returns the index into the NBIOs array
+ * matching the host NBIO device. Returns -1 if the bus is not found.
+ */
+static int bus_to_nbio(u8 bus)
+{
+	return hsmp_data.bus_nbio[bus];
+}
+
+/*
+ * Probe HSMP mailboxes to verify HSMP is enabled, if successful retrieve
+ * the SMU fw version and HSMP interface version.
+ *
+ * Returns -1 with errno set to ENOTSUP if the test message fails, or
+ * errno set to EAGAIN if retrieving the SMU fw version or interface
+ * version fails.
+ */
+static int hsmp_probe(void)
+{
+	struct hsmp_message msg = { 0 };
+	int socket_found;
+	int socket_id;
+	int err;
+
+	/*
+	 * Check each socket to be safe. The test message takes one argument and
+	 * returns the value of that argument + 1. The protocol version and SMU
+	 * version messages take no arguments and return one.
+	 */
+	socket_found = 0;
+	for (socket_id = 0; socket_id < hsmp_data.num_sockets; socket_id++) {
+		msg.msg_num = HSMP_TEST;
+		msg.num_args = 1;
+		msg.args[0] = 1;
+		msg.response_sz = 1;
+
+		/*
+		 * Send a test message to verify HSMP enablement. If this call
+		 * fails the issue is due to HSMP not being enabled in BIOS.
+		 */
+		err = hsmp_send_message(socket_id, &msg);
+		if (err) {
+			pr_debug("HSMP Test failed for socket %d\n", socket_id);
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		if (msg.response[0] != msg.args[0] + 1) {
+			pr_debug("HSMP test failed for socket %d, expected %x, received %x\n",
+				 socket_id, msg.args[0] + 1, msg.response[0]);
+			errno = ENOTSUP;
+			return -1;
+		}
+
+		if (!socket_found) {
+			/* Retrieve SMU FW Version */
+			msg.msg_num = HSMP_GET_SMU_VER;
+			msg.num_args = 0;
+			msg.args[0] = 0xDEADBEEF;
+			msg.response_sz = 1;
+
+			err = hsmp_send_message(socket_id, &msg);
+			if (err) {
+				pr_debug("Could not retrieve SMU FW Version\n");
+				errno = EAGAIN;
+				return -1;
+			}
+
+			hsmp_data.smu_firmware.raw_u32 = msg.response[0];
+
+			pr_debug("SMU FW Version %u:%u:%u\n",
+				 hsmp_data.smu_firmware.ver.major,
+				 hsmp_data.smu_firmware.ver.minor,
+				 hsmp_data.smu_firmware.ver.debug);
+
+			/* Retrieve HSMP Interface Version */
+			msg.msg_num = HSMP_GET_PROTO_VER;
+			msg.num_args = 0;
+			msg.args[0] = 0xDEADBEEF;
+			msg.response_sz = 1;
+
+			err = hsmp_send_message(socket_id, &msg);
+			if (err) {
+				pr_debug("Could not retrieve HSMP Interface Version\n");
+				errno = EAGAIN;
+				return -1;
+			}
+
+			hsmp_data.hsmp_proto_ver = msg.response[0];
+			pr_debug("Interface Version: %d\n", hsmp_data.hsmp_proto_ver);
+
+			socket_found = 1;
+		}
+	}
+
+	return 0;
+}
+
+static int get_system_info(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int family, model;
+	int id = 0;
+	char vendstr[3][8] __attribute__ ((unused)) = {"unknown", "Intel", "AMD"};
+
+	__cpuid(0, eax, ebx, ecx, edx);
+	if (ebx == 0x756e6547 && ecx == 0x6c65746e && edx == 0x49656e69)
+		id = 1;
+	else if (ebx == 0x68747541 && ecx == 0x444d4163 && edx == 0x69746e65)
+		id = 2;
+
+	__cpuid(1, eax, ebx, ecx, edx);
+	family = (eax >> 8) & 0xf;
+	model = (eax >> 4) & 0xf;
+
+	if (family == 0xf)
+		family += (eax >> 20) & 0xff;
+
+	if (family >= 6)
+		model += ((eax >> 16) & 0xf) << 4;
+
+	hsmp_data.x86_family = family;
+
+	/*
+	 * Family 0x17 = Zen/Zen2, models 30h - 3Fh
+	 * Family 0x19 = Zen3
+	 */
+	if (id == 2 && (
+#ifdef HSMP_FAMILY_0x17
+		(family == 0x17 && model >= 0x30 && model <= 0x3F) ||
+#endif
+		(family >= 0x19))) {
+		pr_debug("Detected %s CPU family %xh model %xh\n",
+			 vendstr[id], family, model);
+
+		if (family == 0x17)
+			fprintf(stderr,
+				"WARNING: libhsmp not supported on %s CPU Family 0x17 CPUs\n",
+				vendstr[id]);
+		return 0;
+	}
+
+	pr_debug("libhsmp not supported on %s CPU family %xh model %xh\n",
+		 vendstr[id], family, model);
+	errno = ENOTSUP;
+	return -1;
+}
+
+static void hsmp_clear_nbio_table(void)
+{
+	int i;
+
+	for (i = 0; i < hsmp_data.num_sockets; i++)
+		pthread_mutex_destroy(&hsmp_data.sockets[i].lock);
+
+	free(hsmp_data.sockets);
+	hsmp_data.sockets = NULL;
+	hsmp_data.num_sockets = 0;
+
+	free(hsmp_data.nbios);
+	hsmp_data.nbios = NULL;
+	hsmp_data.num_nbios = 0;
+	memset(hsmp_data.bus_nbio, 0xFF, sizeof(hsmp_data.bus_nbio));
+
+	hsmp_data.nbio_ids_ready = 0;
+}
+
+/* Free IOHC devices looked up with pci_get_dev(), scanned devices are
+ * freed by pci_cleanup().
+ */
+static void hsmp_free_nbio_devs(void)
+{
+	int i;
+
+	if (hsmp_data.pci_scanned)
+		return;
+
+	for (i = 0; i < hsmp_data.num_nbios; i++) {
+		if (hsmp_data.nbios[i].dev) {
+			pci_free_dev(hsmp_data.nbios[i].dev);
+			hsmp_data.nbios[i].dev = NULL;
+		}
+	}
+}
+
+static void hsmp_cleanup_nbios(void)
+{
+	int i;
+
+	if (pci_ops->cleanup) {
+		for (i = 0; i < hsmp_data.num_nbios; i++)
+			pci_ops->cleanup(&hsmp_data.nbios[i]);
+	}
+	pci_ops = &libpci_ops;
+
+	hsmp_free_nbio_devs();
+
+	if (hsmp_data.pacc) {
+		pci_cleanup(hsmp_data.pacc);
+		hsmp_data.pacc = NULL;
+	}
+
+	hsmp_clear_nbio_table();
+	sim_cleanup();
+}
+
+/*
+ * Select the config space access backend. Falls back to libpci if the
+ * requested backend cannot be set up for every IOHC device.
+ */
+static void hsmp_setup_pci_ops(int num_nbios)
+{
+	const char *access;
+	int i;
+
+	if (sim.enabled) {
+		pci_ops = &sim_ops;
+		pr_debug("Using simulated SMU\n");
+		return;
+	}
+
+	access = secure_getenv("HSMP_PCI_ACCESS");
+	if (!access || strcmp(access, ecam_ops.name))
+		return;
+
+	for (i = 0; i < num_nbios; i++) {
+		if (ecam_ops.setup(&hsmp_data.nbios[i])) {
+			pr_debug("ECAM setup failed for bus 0x%02X, using libpci\n",
+				 hsmp_data.nbios[i].bus_base);
+			while (i--)
+				ecam_ops.cleanup(&hsmp_data.nbios[i]);
+			return;
+		}
+	}
+
+	pci_ops = &ecam_ops;
+	pr_debug("Using ECAM config space access\n");
+}
+
+/* Append an IOHC device to the NBIO table, growing it a socket at a time */
+static int hsmp_add_nbio(struct pci_dev *dev)
+{
+	int n = hsmp_data.num_nbios;
+	struct nbio_dev *nbios;
+
+	pr_debug("Found IOHC dev on bus 0x%02X\n", dev->bus);
+
+	if (!(n % NBIOS_PER_SOCKET)) {
+		nbios = realloc(hsmp_data.nbios,
+				(n + NBIOS_PER_SOCKET) * sizeof(*nbios));
+		if (!nbios) {
+			pr_debug("Failed to allocate NBIO table\n");
+			return -1;
+		}
+
+		hsmp_data.nbios = nbios;
+	}
+
+	memset(&hsmp_data.nbios[n], 0, sizeof(struct nbio_dev));
+	hsmp_data.nbios[n].dev = dev;
+	hsmp_data.nbios[n].bus_base = dev->bus;
+	hsmp_data.num_nbios++;
+
+	return 0;
+}
+
+static bool is_iohc_dev(struct pci_dev *dev)
+{
+	pci_fill_info(dev, PCI_FILL_IDENT);
+
+	return dev->vendor_id == PCI_VENDOR_ID_AMD &&
+	       dev->device_id == F17F19_IOHC_DEVID;
+}
+
+/*
+ * Each IOHC device is function 0 of device 0 on the root bus it hosts.
+ * Instead of scanning the entire PCI tree, look up device 00.0 on every
+ * root bus listed in sysfs. Returns the number of IOHC devices found.
+ */
+static int hsmp_lookup_nbios(void)
+{
+	unsigned int domain, bus;
+	struct pci_dev *dev;
+	struct dirent *ent;
+	DIR *dir;
+
+	dir = opendir("/sys/devices");
+	if (!dir)
+		return 0;
+
+	while ((ent = readdir(dir))) {
+		if (sscanf(ent->d_name, "pci%x:%x", &domain, &bus) != 2)
+			continue;
+
+		dev = pci_get_dev(hsmp_data.pacc, domain, bus, 0, 0);
+		if (!dev)
+			continue;
+
+		if (!is_iohc_dev(dev) || hsmp_add_nbio(dev)) {
+			pci_free_dev(dev);
+			continue;
+		}
+	}
+
+	closedir(dir);
+	return hsmp_data.num_nbios;
+}
+
+static int hsmp_scan_nbios(void)
+{
+	struct pci_dev *dev;
+
+	pci_scan_bus(hsmp_data.pacc);
+	hsmp_data.pci_scanned = 1;
+
+	for (dev = hsmp_data.pacc->devices; dev; dev = dev->next) {
+		if (!is_iohc_dev(dev))
+			continue;
+
+		if (hsmp_add_nbio(dev))
+			return -1;
+	}
+
+	return hsmp_data.num_nbios;
+}
+
+static bool valid_nbio_count(int num_nbios)
+{
+	return num_nbios > 0 && !(num_nbios % NBIOS_PER_SOCKET);
+}
+
+/* Find the IOHC devices with libpci, returns the number found or -1 */
+static int hsmp_find_nbios(void)
+{
+	int num_nbios;
+
+	/* Setup pcilib */
+	hsmp_data.pacc = pci_alloc();
+	if (!hsmp_data.pacc) {
+		pr_debug("Failed to allocate PCI access structures\n");
+		return -1;
+	}
+
+	pci_init(hsmp_data.pacc);
+
+	/* Fall back to a full scan if the root bus lookup comes up short */
+	num_nbios = 0;
+	if (!(init_flags & HSMP_INIT_PCI_SCAN))
+		num_nbios = hsmp_lookup_nbios();
+
+	if (!valid_nbio_count(num_nbios)) {
+		hsmp_free_nbio_devs();
+		hsmp_clear_nbio_table();
+		num_nbios = hsmp_scan_nbios();
+	}
+
+	return num_nbios;
+}
+
+/*
+ * Find the IOHC devices and sort them by the base bus number they host.
+ * The IOHC ID of each device is read separately by hsmp_map_nbio_ids().
+ */
+static int hsmp_setup_nbios(void)
+{
+	int num_nbios;
+	int i;
+
+	hsmp_clear_nbio_table();
+	hsmp_data.pci_scanned = 0;
+
+	num_nbios = sim.enabled ? sim_add_nbios() : hsmp_find_nbios();
+	if (num_nbios < 0)
+		goto nbio_setup_error;
+
+	if (!valid_nbio_count(num_nbios)) {
+		pr_debug("Expected a multiple of %d IOHC devices, found %d\n",
+			 NBIOS_PER_SOCKET, num_nbios);
+		goto nbio_setup_error;
+	}
+
+	/* Sort the table by bus_base */
+	for (i = 0; i < num_nbios - 1; i++) {
+		int j;
+
+		for (j = i + 1; j < num_nbios; j++) {
+			if (hsmp_data.nbios[j].bus_base < hsmp_data.nbios[i].bus_base) {
+				struct pci_dev *temp_dev = hsmp_data.nbios[i].dev;
+				u8 temp_bus_base         = hsmp_data.nbios[i].bus_base;
+
+				hsmp_data.nbios[i].dev      = hsmp_data.nbios[j].dev;
+				hsmp_data.nbios[i].bus_base = hsmp_data.nbios[j].bus_base;
+
+				hsmp_data.nbios[j].dev      = temp_dev;
+				hsmp_data.nbios[j].bus_base = temp_bus_base;
+			}
+		}
+	}
+
+	/* Calculate bus limits - we can safely assume no overlapping ranges */
+	for (i = 0; i < num_nbios; i++) {
+		int bus;
+
+		if (i < num_nbios - 1)
+			hsmp_data.nbios[i].bus_limit = hsmp_data.nbios[i + 1].bus_base - 1;
+		else
+			hsmp_data.nbios[i].bus_limit = 0xFF;
+
+		for (bus = hsmp_data.nbios[i].bus_base;
+		     bus <= hsmp_data.nbios[i].bus_limit; bus++)
+			hsmp_data.bus_nbio[bus] = i;
+	}
+
+	/* The first NBIO of each socket hosts the lowest bus in the socket */
+	hsmp_data.num_sockets = num_nbios / NBIOS_PER_SOCKET;
+	hsmp_data.sockets = calloc(hsmp_data.num_sockets, sizeof(struct socket_dev));
+	if (!hsmp_data.sockets) {
+		hsmp_data.num_sockets = 0;
+		goto nbio_setup_error;
+	}
+
+	for (i = 0; i < hsmp_data.num_sockets; i++) {
+		hsmp_data.sockets[i].root = &hsmp_data.nbios[i * NBIOS_PER_SOCKET];
+		pthread_mutex_init(&hsmp_data.sockets[i].lock, NULL);
+	}
+
+	hsmp_setup_pci_ops(num_nbios);
+
+	return 0;
+
+nbio_setup_error:
+	hsmp_cleanup_nbios();
+	errno = ENODEV;
+	return -1;
+}
+
+/* Get the IOHC ID for each bus base */
+static int hsmp_map_nbio_ids(void)
+{
+	int i;
+	u8 base;
+
+	for (i = 0; i < hsmp_data.num_nbios; i++) {
+		int err, idx;
+		u32 addr, val;
+
+		addr = SMN_IOHCMISC0_NB_BUS_NUM_CNTL + (i & 0x3) * SMN_IOHCMISC_OFFSET;
+		err = smu_read(&hsmp_data.nbios[i], addr, &val);
+		if (err) {
+			pr_debug("Error %d accessing socket %d IOHCMISC%d\n",
+				 err, i >> 2, i & 0x3);
+			errno = ENODEV;
+			return -1;
+		}
+
+		pr_debug("Socket %d IOHC%d smu_read addr 0x%08X = 0x%08X\n",
+			 i >> 2, i & 0x3, addr, val);
+		base = val & 0xFF;
+
+		/* Look up this bus base in our array */
+		idx = bus_to_nbio(base);
+		if (idx == -1) {
+			pr_debug("Unable to map bus 0x%02X to an IOHC device\n", base);
+			errno = ENODEV;
+			return -1;
+		}
+
+		hsmp_data.nbios[idx].id = i & 0x3;
+	}
+
+	/* Dump the final table */
+#ifdef DEBUG_HSMP
+	for (i = 0; i < hsmp_data.num_nbios; i++) {
+		pr_debug("IDX %d: Bus range 0x%02X - 0x%02X --> Socket %d IOHC %d\n",
+			 i, hsmp_data.nbios[i].bus_base, hsmp_data.nbios[i].bus_limit,
+			 i >> 2, hsmp_data.nbios[i].id);
+	}
+#endif
+
+	return 0;
+}
+
+/*
+ * Find the value of a "key : value" line in a /proc/cpuinfo block,
+ * returns -1 if the key is not present before the end of the block.
+ */
+static int cpuinfo_field(const char *block, const char *end, const char *key)
+{
+	const char *line;
+	size_t len = strlen(key);
+
+	for (line = block; line && line < end; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+
+		if (!strncmp(line, key, len) && (line[len] == ' ' || line[len] == '\t')) {
+			line = strchr(line, ':');
+			return line ? strtol(line + 1, NULL, 10) : -1;
+		}
+	}
+
+	return -1;
+}
+
+/* Grow the CPU table to hold the specified CPU number */
+static int hsmp_grow_cpus(int cpu_id)
+{
+	struct cpu_dev *cpus;
+	int n;
+
+	n = hsmp_data.num_cpus ? hsmp_data.num_cpus : 64;
+	while (n <= cpu_id)
+		n *= 2;
+
+	cpus = realloc(hsmp_data.cpus, n * sizeof(*cpus));
+	if (!cpus) {
+		pr_debug("Failed to allocate CPU table\n");
+		return -1;
+	}
+
+	memset(&cpus[hsmp_data.num_cpus], 0,
+	       (n - hsmp_data.num_cpus) * sizeof(*cpus));
+	hsmp_data.cpus = cpus;
+	hsmp_data.num_cpus = n;
+
+	return 0;
+}
+
+static void hsmp_cleanup_cpus(void)
+{
+	free(hsmp_data.cores);
+	hsmp_data.cores = NULL;
+	hsmp_data.num_cores = 0;
+
+	free(hsmp_data.cpus);
+	hsmp_data.cpus = NULL;
+	hsmp_data.num_cpus = 0;
+	hsmp_data.max_apicid = 0;
+	hsmp_data.cpus_ready = 0;
+}
+
+/*
+ * Number of low order APIC ID bits identifying the thread within a core,
+ * SMT siblings share the APIC ID bits above this.
+ */
+static unsigned int get_smt_shift(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int threads, shift;
+
+	if (!__get_cpuid(0x8000001E, &eax, &ebx, &ecx, &edx))
+		return 0;
+
+	threads = ((ebx >> 8) & 0xFF) + 1;
+	for (shift = 0; (1U << shift) < threads; shift++) {}
+
+	return shift;
+}
+
+/* Build the core table from the CPU map */
+static int hsmp_setup_cores(void)
+{
+	struct cpu_dev *cpu;
+	int i;
+
+	hsmp_data.num_cores = (hsmp_data.max_apicid >> hsmp_data.smt_shift) + 1;
+	hsmp_data.cores = calloc(hsmp_data.num_cores, sizeof(struct core_dev));
+	if (!hsmp_data.cores) {
+		hsmp_cleanup_cpus();
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (i = 0; i < hsmp_data.num_cores; i++)
+		hsmp_data.cores[i].socket_id = -1;
+
+	for (i = 0; i < hsmp_data.num_cpus; i++) {
+		cpu = &hsmp_data.cpus[i];
+		if (cpu->valid)
+			hsmp_data.cores[cpu->apicid >> hsmp_data.smt_shift].socket_id =
+				cpu->socket_id;
+	}
+
+	return 0;
+}
+
+/* The simulated CPUs are numbered socket by socket, APIC ID == CPU number */
+static int sim_get_cpu_data(void)
+{
+	int cpu;
+
+	if (hsmp_grow_cpus(sim.cpus - 1)) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (cpu = 0; cpu < sim.cpus; cpu++) {
+		hsmp_data.cpus[cpu].socket_id = sim_cpu_socket(cpu);
+		hsmp_data.cpus[cpu].apicid = cpu;
+		hsmp_data.cpus[cpu].valid = 1;
+	}
+
+	hsmp_data.max_apicid = sim.cpus - 1;
+	hsmp_data.smt_shift = 0;
+
+	return hsmp_setup_cores();
+}
+
+/*
+ * Build the CPU map from /proc/cpuinfo. sysfs does not expose the APIC ID
+ * of a CPU, so /proc/cpuinfo is read in a single pass into one buffer and
+ * only the processor, physical id and apicid fields are parsed.
+ */
+static int hsmp_get_cpu_data(void)
+{
+	char *buf, *block, *end;
+	size_t sz, len;
+	ssize_t rd;
+	int cpu_id, socket_id, apicid;
+	int fd, err;
+
+	if (sim.enabled)
+		return sim_get_cpu_data();
+
+	fd = open("/proc/cpuinfo", O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		pr_debug("Failed to open \"/proc/cpuinfo\"\n");
+		return -1;
+	}
+
+	sz = 256 * 1024;
+	len = 0;
+	buf = malloc(sz + 1);
+	while (buf && (rd = read(fd, buf + len, sz - len)) > 0) {
+		len += rd;
+		if (len == sz) {
+			char *tmp;
+
+			sz *= 2;
+			tmp = realloc(buf, sz + 1);
+			if (!tmp)
+				free(buf);
+			buf = tmp;
+		}
+	}
+	close(fd);
+
+	if (!buf) {
+		errno = ENOMEM;
+		return -1;
+	}
+	buf[len] = '\0';
+
+	err = 0;
+	for (block = buf; block && *block; block = end) {
+		/* Each CPU is described by a block ending with a blank line */
+		end = strstr(block, "\n\n");
+		end = end ? end + 2 : buf + len;
+
+		cpu_id = cpuinfo_field(block, end, "processor");
+		if (cpu_id < 0)
+			continue;
+
+		socket_id = cpuinfo_field(block, end, "physical id");
+		apicid = cpuinfo_field(block, end, "apicid");
+		if (socket_id < 0 || apicid < 0) {
+			err = -1;
+			break;
+		}
+
+		if (cpu_id >= hsmp_data.num_cpus && hsmp_grow_cpus(cpu_id)) {
+			free(buf);
+			hsmp_cleanup_cpus();
+			errno = ENOMEM;
+			return -1;
+		}
+
+		hsmp_data.cpus[cpu_id].socket_id = socket_id;
+		hsmp_data.cpus[cpu_id].apicid = apicid;
+		hsmp_data.cpus[cpu_id].valid = 1;
+
+		if (apicid > hsmp_data.max_apicid)
+			hsmp_data.max_apicid = apicid;
+	}
+
+	free(buf);
+
+	if (err) {
+		pr_debug("Failed to parse \"/proc/cpuinfo\" for CPU socket id and apicid\n");
+		hsmp_cleanup_cpus();
+		errno = EINVAL;
+		return err;
+	}
+
+	hsmp_data.smt_shift = get_smt_shift();
+
+	return hsmp_setup_cores();
+}
+
+/*
+ * The CPU map and the IOHC IDs are set up on first use unless eager setup
+ * is requested with hsmp_init_ex().
+ */
+static pthread_mutex_t topology_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int hsmp_need_cpu_data(void)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&topology_lock);
+	if (!hsmp_data.cpus_ready) {
+		err = hsmp_get_cpu_data();
+		if (!err)
+			hsmp_data.cpus_ready = 1;
+	}
+	pthread_mutex_unlock(&topology_lock);
+
+	return err;
+}
+
+static int hsmp_need_nbio_ids(void)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&topology_lock);
+	if (!hsmp_data.nbio_ids_ready) {
+		err = hsmp_map_nbio_ids();
+		if (!err)
+			hsmp_data.nbio_ids_ready = 1;
+	}
+	pthread_mutex_unlock(&topology_lock);
+
+	return err;
+}
+
+static int cpu_apicid(int cpu)
+{
+	if (hsmp_need_cpu_data())
+		return -1;
+
+	if (cpu < 0 || cpu >= hsmp_data.num_cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!hsmp_data.cpus[cpu].valid) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return hsmp_data.cpus[cpu].apicid;
+}
+
+static int cpu_socket_id(int cpu)
+{
+	if (hsmp_need_cpu_data())
+		return -1;
+
+	if (cpu < 0 || cpu >= hsmp_data.num_cpus) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!hsmp_data.cpus[cpu].valid) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return hsmp_data.cpus[cpu].socket_id;
+}
+
+static int hsmp_init(void)
+{
+	int err;
+
+	err = sim_setup();
+	if (err)
+		return -1;
+
+	if (sim.enabled) {
+		hsmp_data.x86_family = 0x19;
+	} else {
+		err = get_system_info();
+		if (err)
+			return -1;
+	}
+
+	/* Offsets in PCIe config space for 0x1480 DevID (IOHC) */
+	smu.index_reg  = 0x60;
+	smu.data_reg   = 0x64;
+	hsmp.index_reg = 0xC4;
+	hsmp.data_reg  = 0xC8;
+
+	/* Offsets in SMN address space */
+	hsmp_access.mbox_msg_id  = 0x3B10534;
+	hsmp_access.mbox_status  = 0x3B10980;
+	hsmp_access.mbox_data    = 0x3B109E0;
+
+	hsmp_access.mbox_timeout = 500;
+
+	err = hsmp_setup_nbios();
+	if (err)
+		return -1;
+
+	err = hsmp_open_transport();
+	if (!err)
+		err = hsmp_probe();
+
+	if (err) {
+		hsmp_close_transport();
+		hsmp_cleanup_nbios();
+		return err;
+	}
+
+	hsmp_data.initialized = 1;
+	return 0;
+}
+
+/*
+ * Initialization is attempted once, by the first privileged caller, and
+ * every later call returns the same result. Threads calling in while it
+ * runs wait for it to complete.
+ */
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t init_flags_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool init_started;		/* init_flags are frozen */
+static int init_errno;
+
+static void hsmp_atfork_child(void);
+
+static void hsmp_init_once(void)
+{
+	pthread_mutex_lock(&init_flags_lock);
+	init_started = true;
+	pthread_mutex_unlock(&init_flags_lock);
+
+	if (hsmp_init())
+		init_errno = errno ? errno : ENODEV;
+	else
+		pthread_atfork(NULL, NULL, hsmp_atfork_child);
+}
+
+/* The simulator needs no privileges, requested as in sim_setup() */
+static bool sim_requested(void)
+{
+	unsigned int flags;
+
+	pthread_mutex_lock(&init_flags_lock);
+	flags = init_flags;
+	pthread_mutex_unlock(&init_flags_lock);
+
+	return secure_getenv("HSMP_SIM") || (flags & HSMP_INIT_SIM);
+}
+
+static int hsmp_enter(enum hsmp_msg_t msg_id)
+{
+	if (geteuid() != 0 && !sim_requested()) {
+		pr_debug("libhsmp requires root access!\n");
+		errno = EPERM;
+		return -1;
+	}
+
+	pthread_once(&init_once, hsmp_init_once);
+	if (init_errno) {
+		errno = init_errno;
+		return -1;
+	}
+
+	if (!msg_id_supported(msg_id)) {
+		errno = ENOMSG;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Asynchronous message submission
+ *
+ * Asynchronous requests are queued to a worker thread, created on first
+ * use, which sends each queued set of requests as a batch. Completion is
+ * signalled through an eventfd so callers can wait for results from an
+ * event loop.
+ */
+struct hsmp_async {
+	struct hsmp_async	*next;
+	struct hsmp_request	*reqs;
+	int			n;
+	uint64_t		timeout_ns;	/* Submitting thread's timeout */
+	int			err;
+	int			errnum;
+	bool			done;
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;		/* Signalled when work is queued */
+	pthread_cond_t		done;		/* Signalled when work completes */
+	pthread_t		thread;
+	struct hsmp_async	*head;
+	struct hsmp_async	*tail;
+	struct hsmp_async	*current;	/* Job the worker is sending */
+	int			event_fd;
+	bool			running;
+	bool			stop;
+} async_data = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.work		= PTHREAD_COND_INITIALIZER,
+	.done		= PTHREAD_COND_INITIALIZER,
+	.event_fd	= -1,
+};
+
+static void *hsmp_async_worker(void *arg)
+{
+	struct hsmp_async *job;
+	uint64_t one = 1;
+	int err;
+
+	pthread_mutex_lock(&async_data.lock);
+
+	while (!async_data.stop) {
+		job = async_data.head;
+		if (!job) {
+			pthread_cond_wait(&async_data.work, &async_data.lock);
+			continue;
+		}
+
+		async_data.head = job->next;
+		if (!async_data.head)
+			async_data.tail = NULL;
+		async_data.current = job;
+
+		pthread_mutex_unlock(&async_data.lock);
+
+		thread_timeout_ns = job->timeout_ns;
+		err = hsmp_send_batch(job->reqs, job->n);
+
+		pthread_mutex_lock(&async_data.lock);
+		job->err = err;
+		job->errnum = err ? errno : 0;
+		job->done = true;
+		async_data.current = NULL;
+		pthread_cond_broadcast(&async_data.done);
+
+		if (write(async_data.event_fd, &one, sizeof(one)) != sizeof(one))
+			pr_debug("Failed to signal async completion\n");
+	}
+
+	pthread_mutex_unlock(&async_data.lock);
+	return NULL;
+}
+
+/*
+ * Complete the jobs the worker will not send with -1 and errno set to
+ * ECANCELED. Called with async_data.lock held once the worker is gone.
+ */
+static void hsmp_async_cancel(void)
+{
+	struct hsmp_async *job, *next;
+	uint64_t one = 1;
+
+	if (async_data.current) {
+		async_data.current->next = async_data.head;
+		async_data.head = async_data.current;
+		async_data.current = NULL;
+	}
+
+	if (!async_data.head)
+		return;
+
+	for (job = async_data.head; job; job = next) {
+		next = job->next;
+		job->err = -1;
+		job->errnum = ECANCELED;
+		job->done = true;
+	}
+
+	async_data.head = NULL;
+	async_data.tail = NULL;
+	pthread_cond_broadcast(&async_data.done);
+
+	if (async_data.event_fd != -1 &&
+	    write(async_data.event_fd, &one, sizeof(one)) != sizeof(one))
+		pr_debug("Failed to signal async completion\n");
+}
+
+/* Called with async_data.lock held */
+static int hsmp_async_setup(void)
+{
+	int err;
+
+	if (async_data.running)
+		return 0;
+
+	async_data.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (async_data.event_fd == -1)
+		return -1;
+
+	async_data.stop = false;
+	err = pthread_create(&async_data.thread, NULL, hsmp_async_worker, NULL);
+	if (err) {
+		close(async_data.event_fd);
+		async_data.event_fd = -1;
+		errno = err;
+		return -1;
+	}
+
+	async_data.running = true;
+	return 0;
+}
+
+static void hsmp_async_cleanup(void)
+{
+	pthread_mutex_lock(&async_data.lock);
+	if (!async_data.running) {
+		pthread_mutex_unlock(&async_data.lock);
+		return;
+	}
+
+	async_data.stop = true;
+	pthread_cond_signal(&async_data.work);
+	pthread_mutex_unlock(&async_data.lock);
+
+	pthread_join(async_data.thread, NULL);
+
+	pthread_mutex_lock(&async_data.lock);
+	hsmp_async_cancel();
+	pthread_mutex_unlock(&async_data.lock);
+
+	close(async_data.event_fd);
+	async_data.event_fd = -1;
+	async_data.running = false;
+}
+
+/*
+ * The worker does not exist in a child forked after it was started. Jobs
+ * the child inherited are cancelled, and a new worker and eventfd, not
+ * shared with the parent, are created on next use.
+ */
+static void hsmp_async_atfork_child(void)
+{
+	if (!async_data.running)
+		return;
+
+	pthread_mutex_init(&async_data.lock, NULL);
+	pthread_cond_init(&async_data.work, NULL);
+	pthread_cond_init(&async_data.done, NULL);
+
+	close(async_data.event_fd);
+	async_data.event_fd = -1;
+	async_data.running = false;
+
+	hsmp_async_cancel();
+}
+
+/*
+ * Throttle watch
+ *
+ * A watch thread, created on first use, polls the PROC_HOT status and core
+ * clock limit of the watched sockets as one batch per round. The interval
+ * between rounds starts at WATCH_MIN_MS and doubles after every round
+ * without a change, up to WATCH_MAX_MS, but stays at WATCH_MIN_MS while a
+ * watched socket is throttling. Events of watches without a callback are
+ * queued, dropping the oldest when full, and signalled through an eventfd.
+ */
+#define WATCH_MIN_MS		20
+#define WATCH_MAX_MS		1000
+#define WATCH_QUEUE_SZ		256
+
+struct hsmp_watcher {
+	unsigned int	events;		/* HSMP_WATCH_* watched, 0 if none */
+	hsmp_watch_cb	cb;
+	void		*data;
+	bool		have_state;	/* proc_hot and cclk_limit are valid */
+	int		proc_hot;
+	u32		cclk_limit;
+	u32		max_cclk_limit;	/* Highest limit seen, not throttled */
+};
+
+static struct {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;		/* Signalled when watches change */
+	pthread_cond_t		cb_done;	/* Signalled after callbacks run */
+	pthread_t		thread;
+	struct hsmp_watcher	*watchers;	/* Indexed by socket */
+	struct hsmp_watch_event	queue[WATCH_QUEUE_SZ];
+	unsigned int		head;		/* Oldest queued event */
+	unsigned int		count;
+	int			event_fd;
+	unsigned int		cb_round;	/* Callback rounds completed */
+	bool			in_callbacks;	/* The worker is running callbacks */
+	bool			running;
+	bool			stop;
+	bool			changed;
+} watch_data = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.cb_done	= PTHREAD_COND_INITIALIZER,
+	.event_fd	= -1,
+};
+
+static bool watch_throttling(const struct hsmp_watcher *w)
+{
+	if (!w->have_state)
+		return false;
+
+	if ((w->events & HSMP_WATCH_PROC_HOT) && w->proc_hot)
+		return true;
+
+	return (w->events & HSMP_WATCH_CCLK_LIMIT) &&
+	       w->cclk_limit < w->max_cclk_limit;
+}
+
+/* Called with watch_data.lock held */
+static void watch_queue_event(const struct hsmp_watch_event *event)
+{
+	uint64_t one = 1;
+
+	if (watch_data.count == WATCH_QUEUE_SZ) {
+		watch_data.head = (watch_data.head + 1) % WATCH_QUEUE_SZ;
+		watch_data.count--;
+	}
+
+	watch_data.queue[(watch_data.head + watch_data.count++) % WATCH_QUEUE_SZ] = *event;
+
+	if (write(watch_data.event_fd, &one, sizeof(one)) != sizeof(one))
+		pr_debug("Failed to signal watch event\n");
+}
+
+/*
+ * Compare the results of a polling round with the last state of each
+ * watched socket. Events for callbacks are returned in cb_events, the
+ * rest are queued. Returns the number of callback events, called with
+ * watch_data.lock held.
+ */
+static int watch_update(struct hsmp_request *reqs, int num_reqs,
+			struct hsmp_watch_event *events, hsmp_watch_cb *cbs,
+			void **cb_data, bool *throttling)
+{
+	struct hsmp_watch_event event;
+	struct hsmp_watcher *w;
+	struct timespec ts;
+	int i, socket_id, n;
+	bool failed;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	n = 0;
+	*throttling = false;
+	for (socket_id = 0; socket_id < hsmp_data.num_sockets; socket_id++) {
+		w = &watch_data.watchers[socket_id];
+		if (!w->events)
+			continue;
+
+		memset(&event, 0, sizeof(event));
+		event.socket_id = socket_id;
+		event.proc_hot = w->proc_hot;
+		event.cclk_limit = w->cclk_limit;
+		event.timestamp_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+		/* Requests for watches added during the round are missing */
+		failed = true;
+		for (i = 0; i < num_reqs; i++) {
+			if (reqs[i].socket_id != socket_id)
+				continue;
+
+			if (reqs[i].err) {
+				failed = true;
+				break;
+			}
+
+			failed = false;
+			if (reqs[i].msg_id == HSMP_GET_PROC_HOT &&
+			    (w->events & HSMP_WATCH_PROC_HOT))
+				event.proc_hot = reqs[i].response[0];
+			else if (reqs[i].msg_id == HSMP_GET_CCLK_THROTTLE_LIMIT &&
+				 (w->events & HSMP_WATCH_CCLK_LIMIT))
+				event.cclk_limit = reqs[i].response[0];
+		}
+
+		if (failed)
+			continue;
+
+		/* The first round reports the initial state */
+		if (!w->have_state)
+			event.changed = w->events;
+		if (event.proc_hot != w->proc_hot)
+			event.changed |= HSMP_WATCH_PROC_HOT;
+		if (event.cclk_limit != w->cclk_limit)
+			event.changed |= HSMP_WATCH_CCLK_LIMIT;
+		event.changed &= w->events;
+
+		w->have_state = true;
+		w->proc_hot = event.proc_hot;
+		w->cclk_limit = event.cclk_limit;
+		if (event.cclk_limit > w->max_cclk_limit)
+			w->max_cclk_limit = event.cclk_limit;
+
+		if (watch_throttling(w))
+			*throttling = true;
+
+		if (!event.changed)
+			continue;
+
+		if (w->cb) {
+			events[n] = event;
+			cbs[n] = w->cb;
+			cb_data[n++] = w->data;
+		} else {
+			watch_queue_event(&event);
+		}
+	}
+
+	return n;
+}
+
+static void *hsmp_watch_worker(void *arg)
+{
+	struct hsmp_watch_event *events;
+	struct hsmp_request *reqs;
+	hsmp_watch_cb *cbs;
+	struct timespec deadline;
+	unsigned int interval_ms;
+	int socket_id, i, n, num_reqs;
+	bool throttling;
+	void **cb_data;
+
+	reqs = calloc(2 * hsmp_data.num_sockets, sizeof(*reqs));
+	events = calloc(hsmp_data.num_sockets, sizeof(*events));
+	cbs = calloc(hsmp_data.num_sockets, sizeof(*cbs));
+	cb_data = calloc(hsmp_data.num_sockets, sizeof(*cb_data));
+	if (!reqs || !events || !cbs || !cb_data)
+		goto out;
+
+	interval_ms = WATCH_MIN_MS;
+
+	pthread_mutex_lock(&watch_data.lock);
+
+	while (!watch_data.stop) {
+		watch_data.changed = false;
+
+		num_reqs = 0;
+		for (socket_id = 0; socket_id < hsmp_data.num_sockets; socket_id++) {
+			unsigned int watched = watch_data.watchers[socket_id].events;
+
+			if (watched & HSMP_WATCH_PROC_HOT) {
+				memset(&reqs[num_reqs], 0, sizeof(*reqs));
+				reqs[num_reqs].socket_id = socket_id;
+				reqs[num_reqs].msg_id = HSMP_GET_PROC_HOT;
+				reqs[num_reqs++].response_sz = 1;
+			}
+
+			if (watched & HSMP_WATCH_CCLK_LIMIT) {
+				memset(&reqs[num_reqs], 0, sizeof(*reqs));
+				reqs[num_reqs].socket_id = socket_id;
+				reqs[num_reqs].msg_id = HSMP_GET_CCLK_THROTTLE_LIMIT;
+				reqs[num_reqs++].response_sz = 1;
+			}
+		}
+
+		n = 0;
+		if (num_reqs) {
+			pthread_mutex_unlock(&watch_data.lock);
+			hsmp_send_batch(reqs, num_reqs);
+			pthread_mutex_lock(&watch_data.lock);
+
+			n = watch_update(reqs, num_reqs, events, cbs, cb_data,
+					 &throttling);
+
+			/* Callbacks may add or remove watches */
+			watch_data.in_callbacks = n > 0;
+			pthread_mutex_unlock(&watch_data.lock);
+			for (i = 0; i < n; i++)
+				cbs[i](&events[i], cb_data[i]);
+			pthread_mutex_lock(&watch_data.lock);
+
+			if (watch_data.in_callbacks) {
+				watch_data.in_callbacks = false;
+				watch_data.cb_round++;
+				pthread_cond_broadcast(&watch_data.cb_done);
+			}
+
+			if (n || throttling)
+				interval_ms = WATCH_MIN_MS;
+			else if (interval_ms < WATCH_MAX_MS)
+				interval_ms = interval_ms * 2 < WATCH_MAX_MS ?
+					      interval_ms * 2 : WATCH_MAX_MS;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec += interval_ms / 1000;
+		deadline.tv_nsec += (interval_ms % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		/* Sleep until the next round, or until there is something to watch */
+		while (!watch_data.stop && !watch_data.changed) {
+			if (!num_reqs)
+				pthread_cond_wait(&watch_data.wake, &watch_data.lock);
+			else if (pthread_cond_timedwait(&watch_data.wake, &watch_data.lock,
+							&deadline) == ETIMEDOUT)
+				break;
+		}
+
+		/* New watches report their initial state right away */
+		if (watch_data.changed)
+			interval_ms = WATCH_MIN_MS;
+	}
+
+	pthread_mutex_unlock(&watch_data.lock);
+
+out:
+	free(cb_data);
+	free(cbs);
+	free(events);
+	free(reqs);
+	return NULL;
+}
+
+/* Called with watch_data.lock held */
+static int hsmp_watch_setup(void)
+{
+	pthread_condattr_t attr;
+	int err;
+
+	if (watch_data.running)
+		return 0;
+
+	watch_data.watchers = calloc(hsmp_data.num_sockets,
+				     sizeof(*watch_data.watchers));
+	if (!watch_data.watchers)
+		return -1;
+
+	watch_data.event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (watch_data.event_fd == -1)
+		goto err;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&watch_data.wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	watch_data.stop = false;
+	err = pthread_create(&watch_data.thread, NULL, hsmp_watch_worker, NULL);
+	if (err) {
+		pthread_cond_destroy(&watch_data.wake);
+		close(watch_data.event_fd);
+		watch_data.event_fd = -1;
+		errno = err;
+		goto err;
+	}
+
+	watch_data.running = true;
+	return 0;
+
+err:
+	free(watch_data.watchers);
+	watch_data.watchers = NULL;
+	return -1;
+}
+
+static void hsmp_watch_cleanup(void)
+{
+	pthread_mutex_lock(&watch_data.lock);
+	if (!watch_data.running) {
+		pthread_mutex_unlock(&watch_data.lock);
+		return;
+	}
+
+	watch_data.stop = true;
+	pthread_cond_signal(&watch_data.wake);
+	pthread_mutex_unlock(&watch_data.lock);
+
+	pthread_join(watch_data.thread, NULL);
+
+	pthread_cond_destroy(&watch_data.wake);
+	close(watch_data.event_fd);
+	watch_data.event_fd = -1;
+	free(watch_data.watchers);
+	watch_data.watchers = NULL;
+	watch_data.count = 0;
+	watch_data.running = false;
+}
+
+/*
+ * The watch thread does not exist in a child forked after it was started,
+ * the child starts without watches.
+ */
+static void hsmp_watch_atfork_child(void)
+{
+	pthread_condattr_t attr;
+
+	if (!watch_data.running)
+		return;
+
+	pthread_mutex_init(&watch_data.lock, NULL);
+	pthread_cond_init(&watch_data.cb_done, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&watch_data.wake, &attr);
+	pthread_condattr_destroy(&attr);
+
+	close(watch_data.event_fd);
+	watch_data.event_fd = -1;
+	free(watch_data.watchers);
+	watch_data.watchers = NULL;
+	watch_data.count = 0;
+	watch_data.in_callbacks = false;
+	watch_data.running = false;
+}
+
+/* Runs in the child after fork(), restores the state the child can't share */
+static void hsmp_atfork_child(void)
+{
+	hsmp_lock_atfork_child();
+	hsmp_async_atfork_child();
+	hsmp_watch_atfork_child();
+}
+
+static void hsmp_fini(void)
+{
+	hsmp_watch_cleanup();
+	hsmp_async_cleanup();
+	hsmp_close_transport();
+	hsmp_cleanup_nbios();
+	hsmp_cleanup_cpus();
+}
+
+void __attribute__ ((destructor)) hsmp_fini(void);
+
+#define HSMP_INIT_FLAGS	(HSMP_INIT_EAGER_CPUS | HSMP_INIT_EAGER_NBIOS | \
+			 HSMP_INIT_PCI_SCAN | HSMP_INIT_SIM)
+
+int hsmp_init_ex(unsigned int flags)
+{
+	int err;
+
+	if (flags & ~HSMP_INIT_FLAGS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&init_flags_lock);
+	if (!init_started)
+		init_flags = flags;
+	pthread_mutex_unlock(&init_flags_lock);
+
+	err = hsmp_enter(HSMP_TEST);
+	if (err)
+		return -1;
+
+	if (flags & HSMP_INIT_EAGER_NBIOS) {
+		err = hsmp_need_nbio_ids();
+		if (err)
+			return -1;
+	}
+
+	if (flags & HSMP_INIT_EAGER_CPUS) {
+		err = hsmp_need_cpu_data();
+		if (err)
+			return -1;
+	}
+
+	return 0;
+}
+
+int hsmp_set_poll_policy(enum hsmp_msg_t msg_id,
+			 const struct hsmp_poll_policy *policy)
+{
+	int i;
+
+	if (!policy || msg_id > HSMP_MAX_MSG_ID) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* A zero initial sleep would never back off, only allow it for pure spinning */
+	if (policy->min_sleep_us > policy->max_sleep_us ||
+	    (!policy->min_sleep_us && policy->max_sleep_us)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&poll_policy_lock);
+	if (msg_id) {
+		poll_policy[msg_id] = *policy;
+	} else {
+		for (i = 0; i <= HSMP_MAX_MSG_ID; i++)
+			poll_policy[i] = *policy;
+	}
+	pthread_mutex_unlock(&poll_policy_lock);
+
+	return 0;
+}
+
+int hsmp_get_poll_policy(enum hsmp_msg_t msg_id,
+			 struct hsmp_poll_policy *policy)
+{
+	if (!policy || msg_id > HSMP_MAX_MSG_ID) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&poll_policy_lock);
+	*policy = poll_policy[msg_id];
+	pthread_mutex_unlock(&poll_policy_lock);
+
+	return 0;
+}
+
+int hsmp_mbox_counters(struct hsmp_mbox_counters *counters)
+{
+	if (!counters) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&counters_lock);
+	*counters = mbox_counters;
+	pthread_mutex_unlock(&counters_lock);
+
+	return 0;
+}
+
+#ifdef HSMP_STATS
+int hsmp_get_stats(enum hsmp_msg_t msg_id, struct hsmp_msg_stats *stats)
+{
+	struct hsmp_msg_stats *m;
+	int i, b;
+
+	if (!stats || msg_id > HSMP_MAX_MSG_ID) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&stats_lock);
+	if (msg_id) {
+		*stats = msg_stats[msg_id];
+		pthread_mutex_unlock(&stats_lock);
+		return 0;
+	}
+
+	/* Message ID 0 reports the totals of all message IDs */
+	memset(stats, 0, sizeof(*stats));
+	for (i = 1; i <= HSMP_MAX_MSG_ID; i++) {
+		m = &msg_stats[i];
+
+		stats->calls += m->calls;
+		stats->successes += m->successes;
+		stats->smu_errors += m->smu_errors;
+		stats->timeouts += m->timeouts;
+		stats->errors += m->errors;
+		stats->polls += m->polls;
+		stats->lock_wait_ns += m->lock_wait_ns;
+		stats->service_ns += m->service_ns;
+		if (m->max_service_ns > stats->max_service_ns)
+			stats->max_service_ns = m->max_service_ns;
+
+		for (b = 0; b < HSMP_STATS_BUCKETS; b++) {
+			stats->lock_wait_hist[b] += m->lock_wait_hist[b];
+			stats->service_hist[b] += m->service_hist[b];
+		}
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	return 0;
+}
+
+int hsmp_reset_stats(void)
+{
+	pthread_mutex_lock(&stats_lock);
+	memset(msg_stats, 0, sizeof(msg_stats));
+	pthread_mutex_unlock(&stats_lock);
+
+	return 0;
+}
+#else
+int hsmp_get_stats(enum hsmp_msg_t msg_id, struct hsmp_msg_stats *stats)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+int hsmp_reset_stats(void)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+#endif
+
+int hsmp_set_cache_ttl(u32 ttl_ms)
+{
+	pthread_mutex_lock(&cache_lock);
+	if (ttl_ms == HSMP_CACHE_TTL_FOREVER)
+		cache_ttl_ns = UINT64_MAX;
+	else
+		cache_ttl_ns = ttl_ms * NSEC_PER_MSEC;
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+int hsmp_set_timeout_us(u32 timeout_us)
+{
+	thread_timeout_ns = timeout_us * NSEC_PER_USEC;
+	return 0;
+}
+
+u32 hsmp_get_timeout_us(void)
+{
+	return thread_timeout_ns / NSEC_PER_USEC;
+}
+
+/*
+ * Send msg_id to a socket with the argument and response counts from its
+ * descriptor. args must hold num_args words and response response_sz
+ * words, either may be NULL if the count is 0.
+ */
+static int hsmp_send_desc(int socket_id, enum hsmp_msg_t msg_id,
+			  const u32 *args, u32 *response)
+{
+	const struct hsmp_msg_desc *desc = &msg_descs[msg_id];
+	struct hsmp_message msg = { 0 };
+	int err;
+
+	msg.msg_num = msg_id;
+	msg.num_args = desc->num_args;
+	msg.response_sz = desc->response_sz;
+	if (desc->num_args)
+		memcpy(msg.args, args, desc->num_args * sizeof(u32));
+
+	err = hsmp_send_message(socket_id, &msg);
+	if (err)
+		return err;
+
+	if (desc->response_sz)
+		memcpy(response, msg.response, desc->response_sz * sizeof(u32));
+	return 0;
+}
+
+/*
+ * Read a single word, socket scope message, from the socket cache if the
+ * descriptor's cache policy allows it.
+ */
+static int hsmp_get_socket_val(int socket_id, enum hsmp_msg_t msg_id, u32 *val)
+{
+	int err;
+
+	err = hsmp_enter(msg_id);
+	if (err)
+		return -1;
+
+	if (!val) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (socket_id_to_dev(socket_id) && msg_cache_get(socket_id, msg_id, val))
+		return 0;
+
+	err = hsmp_send_desc(socket_id, msg_id, NULL, val);
+	if (err)
+		return err;
+
+	msg_cache_put(socket_id, msg_id, *val);
+	return 0;
+}
+
+int hsmp_smu_fw_version(struct smu_fw_version *smu_fw)
+{
+	int err;
+
+	err = hsmp_enter(HSMP_GET_SMU_VER);
+	if (err)
+		return -1;
+
+	if (!smu_fw) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	smu_fw->major = hsmp_data.smu_firmware.ver.major;
+	smu_fw->minor = hsmp_data.smu_firmware.ver.minor;
+	smu_fw->debug = hsmp_data.smu_firmware.ver.debug;
+
+	return 0;
+}
+
+int hsmp_interface_version(int *version)
+{
+	int err;
+
+	err = hsmp_enter(HSMP_GET_PROTO_VER);
+	if (err)
+		return -1;
+
+	if (!version) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	*version = hsmp_data.hsmp_proto_ver;
+	return 0;
+}
+
+int hsmp_socket_power(int socket_id, u32 *power_mw)
+{
+	return hsmp_get_socket_val(socket_id, HSMP_GET_SOCKET_POWER, power_mw);
+}
+
+int hsmp_set_socket_power_limit(int socket_id, u32 power_limit)
+{
+	int err;
+
+	err = hsmp_enter(HSMP_SET_SOCKET_POWER_LIMIT);
+	if (err)
+		return -1;
+
+	err = hsmp_send_desc(socket_id, HSMP_SET_SOCKET_POWER_LIMIT, &power_limit, NULL);
+
+	/* The SMU clips the limit, the next read fetches the applied value */
+	if (socket_id_to_dev(socket_id))
+		cache_invalidate(msg_cache(socket_id, HSMP_GET_SOCKET_POWER_LIMIT));
+
+	return err;
+}
+
+int hsmp_socket_power_limit(int socket_id, u32 *power_limit)
+{
+	return hsmp_get_socket_val(socket_id, HSMP_GET_SOCKET_POWER_LIMIT, power_limit);
+}
+
+int hsmp_socket_max_power_limit(int socket_id, u32 *max_power)
+{
+	return hsmp_get_socket_val(socket_id, HSMP_GET_SOCKET_POWER_LIMIT_MAX, max_power);
+}
+
+int hsmp_set_cpu_boost_limit(int cpu, u32 boost_limit)
+{
+	int socket_id;
+	int apicid;
+	u32 arg;
+	int err;
+
+	err = hsmp_enter(HSMP_SET_BOOST_LIMIT);
+	if (err)
+		return err;
+
+	apicid = cpu_apicid(cpu);
+	if (apicid < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	socket_id = cpu_socket_id(cpu);
+	if (socket_id < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	arg = apicid << 16 | boost_limit;
+	err = hsmp_send_desc(socket_id, HSMP_SET_BOOST_LIMIT, &arg, NULL);
+
+	/* The limit applies to the SMT siblings of the core as well */
+	record_boost_limit(socket_id, apicid >> hsmp_data.smt_shift,
+			   boost_limit, !err);
+	return err;
+}
+
+static int _set_socket_boost_limit(int socket_id, u32 boost_limit)
+{
+	int err;
+
+	err = hsmp_send_desc(socket_id, HSMP_SET_BOOST_LIMIT_SOCKET, &boost_limit, NULL);
+	record_boost_limit(socket_id, -1, boost_limit, !err);
+
+	return err;
+}
+
+int hsmp_set_socket_boost_limit(int socket_id, u32 boost_limit)
+{
+	int err;
+
+	err = hsmp_enter(HSMP_SET_BOOST_LIMIT_SOCKET);
+	if (err)
+		return err;
+
+	return _set_socket_boost_limit(socket_id, boost_limit);
+}
+
+int hsmp_set_system_boost_limit(u32 boost_limit)
+{
+	int socket_id;
+	int err;
+
+	err = hsmp_enter(HSMP_SET_BOOST_LIMIT_SOCKET);
+	if (err)
+		return -1;
+
+	for (socket_id = 0; socket_id < hsmp_data.num_sockets; socket_id++) {
+		err = _set_socket_boost_limit(socket_id, boost_limit);
+		if (err)
+			break;
+	}
+
+	return err;
+}
+
+/*
+ * Bulk boost limit updates
+ *
+ * Entries for SMT siblings are collapsed into one update per core, the
+ * last entry for a core wins. Cores already at the requested limit, as
+ * last set through libhsmp, are skipped. If every core of a socket gets
+ * the same limit a single socket boost limit message is sent instead.
+ */
+struct core_update {
+	int	entry;		/* Index into the cpus/limits arrays, -1 if none */
+	bool	done;		/* Covered by a socket wide update */
+};
+
+/* The core, -1 for the whole socket, and limit set by each request */
+struct core_request {
+	int	core;
+	u32	limit;
+};
+
+/* Returns true if every core in the socket gets the same limit */
+static bool socket_wide_update(struct core_update *updates,
+			       const u32 *limits, int socket_id, u32 *limit)
+{
+	bool found = false;
+	int i;
+
+	for (i = 0; i < hsmp_data.num_cores; i++) {
+		if (hsmp_data.cores[i].socket_id != socket_id)
+			continue;
+
+		if (updates[i].entry == -1)
+			return false;
+
+		if (found && limits[updates[i].entry] != *limit)
+			return false;
+
+		*limit = limits[updates[i].entry];
+		found = true;
+	}
+
+	return found;
+}
+
+/* Returns true if the core, or every core in the socket, is already at limit */
+static bool boost_limit_unchanged(int socket_id, int core, u32 limit)
+{
+	struct core_dev *c;
+	bool unchanged = true;
+	int i, first, last;
+
+	first = (core == -1) ? 0 : core;
+	last = (core == -1) ? hsmp_data.num_cores - 1 : core;
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = first; i <= last && unchanged; i++) {
+		c = &hsmp_data.cores[i];
+		if (c->socket_id != socket_id)
+			continue;
+
+		unchanged = c->limit_set && c->boost_limit == limit;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return unchanged;
+}
+
+int hsmp_set_cpu_boost_limits(const int *cpus, const u32 *limits, int n)
+{
+	struct core_update *updates;
+	struct hsmp_request *reqs, *req;
+	struct core_request *req_core;
+	int i, core, socket_id, num_reqs;
+	struct cpu_dev *cpu;
+	int err, errnum;
+	u32 limit;
+
+	err = hsmp_enter(HSMP_SET_BOOST_LIMIT_SOCKET);
+	if (err)
+		return -1;
+
+	if (!cpus || !limits || n <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (cpu_apicid(cpus[i]) < 0)
+			return -1;
+	}
+
+	updates = malloc(hsmp_data.num_cores * sizeof(*updates));
+	reqs = calloc(hsmp_data.num_cores, sizeof(*reqs));
+	req_core = malloc(hsmp_data.num_cores * sizeof(*req_core));
+	if (!updates || !reqs || !req_core) {
+		err = -1;
+		errnum = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < hsmp_data.num_cores; i++) {
+		updates[i].entry = -1;
+		updates[i].done = false;
+	}
+
+	for (i = 0; i < n; i++) {
+		cpu = &hsmp_data.cpus[cpus[i]];
+		updates[cpu->apicid >> hsmp_data.smt_shift].entry = i;
+	}
+
+	num_reqs = 0;
+	for (socket_id = 0; socket_id < hsmp_data.num_sockets; socket_id++) {
+		if (!socket_wide_update(updates, limits, socket_id, &limit))
+			continue;
+
+		for (i = 0; i < hsmp_data.num_cores; i++) {
+			if (hsmp_data.cores[i].socket_id == socket_id)
+				updates[i].done = true;
+		}
+
+		if (boost_limit_unchanged(socket_id, -1, limit))
+			continue;
+
+		req = &reqs[num_reqs];
+		req->socket_id = socket_id;
+		req->msg_id = HSMP_SET_BOOST_LIMIT_SOCKET;
+		req->num_args = 1;
+		req->args[0] = limit;
+		req_core[num_reqs].core = -1;
+		req_core[num_reqs++].limit = limit;
+	}
+
+	for (core = 0; core < hsmp_data.num_cores; core++) {
+		if (updates[core].entry == -1 || updates[core].done)
+			continue;
+
+		cpu = &hsmp_data.cpus[cpus[updates[core].entry]];
+		limit = limits[updates[core].entry];
+		if (boost_limit_unchanged(cpu->socket_id, core, limit))
+			continue;
+
+		req = &reqs[num_reqs];
+		req->socket_id = cpu->socket_id;
+		req->msg_id = HSMP_SET_BOOST_LIMIT;
+		req->num_args = 1;
+		req->args[0] = cpu->apicid << 16 | limit;
+		req_core[num_reqs].core = core;
+		req_core[num_reqs++].limit = limit;
+	}
+
+	err = 0;
+	errnum = 0;
+	if (num_reqs)
+		err = hsmp_send_batch(reqs, num_reqs);
+
+	for (i = 0; i < num_reqs; i++)
+		record_boost_limit(reqs[i].socket_id, req_core[i].core,
+				   req_core[i].limit, !reqs[i].err);
+
+	/* Report the first failure as hsmp_set_cpu_boost_limit() would */
+	for (i = 0; err && i < num_reqs; i++) {
+		if (reqs[i].err) {
+			err = reqs[i].err;
+			errnum = reqs[i].errnum;
+			break;
+		}
+	}
+
+out:
+	free(req_core);
+	free(reqs);
+	free(updates);
+
+	if (err == -1)
+		errno = errnum;
+
+	return err;
+}
+
+int hsmp_set_cpuset_boost_limit(const cpu_set_t *set, u32 limit)
+{
+	int *cpus, i, n, count;
+	u32 *limits;
+	int err;
+
+	err = hsmp_enter(HSMP_SET_BOOST_LIMIT);
+	if (err)
+		return -1;
+
+	if (!set) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	count = CPU_COUNT(set);
+	if (!count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	cpus = malloc(count * sizeof(*cpus));
+	limits = malloc(count * sizeof(*limits));
+	if (!cpus || !limits) {
+		free(limits);
+		free(cpus);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	n = 0;
+	for (i = 0; i < CPU_SETSIZE && n < count; i++) {
+		if (!CPU_ISSET(i, set))
+			continue;
+
+		cpus[n] = i;
+		limits[n++] = limit;
+	}
+
+	err = hsmp_set_cpu_boost_limits(cpus, limits, n);
+
+	free(limits);
+	free(cpus);
+	return err;
+}
+
+int hsmp_cpu_boost_limit(int cpu, u32 *boost_limit)
+{
+	int socket_id;
+	int apicid;
+	u32 arg;
+	int err;
+
+	err = hsmp_enter(HSMP_GET_BOOST_LIMIT);
+	if (err)
+		return -1;
+
+	if (!boost_limit) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	apicid = cpu_apicid(cpu);
+	if (apicid < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	socket_id = cpu_socket_id(cpu);
+	if (socket_id < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (cache_get(&hsmp_data.cpus[cpu].boost_limit, boost_limit, false))
+		return 0;
+
+	arg = apicid;
+	err = hsmp_send_desc(socket_id, HSMP_GET_BOOST_LIMIT, &arg, boost_limit);
+	if (err)
+		return err;
+
+	cache_put(&hsmp_data.cpus[cpu].boost_limit, *boost_limit);
+	return 0;
+}
+
+int hsmp_cpu_boost_limits(const int *cpus, int n, u32 *boost_limits)
+{
+	struct hsmp_request *reqs, *req;
+	int *core_req, *cpu_req;
+	int i, core, num_reqs;
+	struct cpu_dev *cpu;
+	int err, errnum;
+
+	err = hsmp_enter(HSMP_GET_BOOST_LIMIT);
+	if (err)
+		return -1;
+
+	if (!cpus || n <= 0 || !boost_limits) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (cpu_apicid(cpus[i]) < 0)
+			return -1;
+	}
+
+	reqs = calloc(n, sizeof(*reqs));
+	cpu_req = malloc(n * sizeof(*cpu_req));
+	core_req = malloc(((hsmp_data.max_apicid >> hsmp_data.smt_shift) + 1) *
+			  sizeof(*core_req));
+	if (!reqs || !cpu_req || !core_req) {
+		err = -1;
+		errnum = ENOMEM;
+		goto out;
+	}
+
+	memset(core_req, -1, ((hsmp_data.max_apicid >> hsmp_data.smt_shift) + 1) *
+	       sizeof(*core_req));
+
+	/* Send one request per physical core not already cached */
+	num_reqs = 0;
+	for (i = 0; i < n; i++) {
+		cpu = &hsmp_data.cpus[cpus[i]];
+
+		cpu_req[i] = -1;
+		if (cache_get(&cpu->boost_limit, &boost_limits[i], false))
+			continue;
+
+		core = cpu->apicid >> hsmp_data.smt_shift;
+		if (core_req[core] == -1) {
+			req = &reqs[num_reqs];
+			req->socket_id = cpu->socket_id;
+			req->msg_id = HSMP_GET_BOOST_LIMIT;
+			req->num_args = 1;
+			req->args[0] = cpu->apicid;
+			req->response_sz = 1;
+			core_req[core] = num_reqs++;
+		}
+
+		cpu_req[i] = core_req[core];
+	}
+
+	err = 0;
+	errnum = 0;
+	if (num_reqs)
+		err = hsmp_send_batch(reqs, num_reqs);
+
+	for (i = 0; i < n; i++) {
+		if (cpu_req[i] == -1 || reqs[cpu_req[i]].err)
+			continue;
+
+		boost_limits[i] = reqs[cpu_req[i]].response[0];
+		cache_put(&hsmp_data.cpus[cpus[i]].boost_limit, boost_limits[i]);
+	}
+
+	/* Report the first failure as hsmp_cpu_boost_limit() would */
+	for (i = 0; err && i < num_reqs; i++) {
+		if (reqs[i].err) {
+			err = reqs[i].err;
+			errnum = reqs[i].errnum;
+			break;
+		}
+	}
+
+out:
+	free(core_req);
+	free(cpu_req);
+	free(reqs);
+
+	if (err == -1)
+		errno = errnum;
+
+	return err;
+}
+
+int hsmp_proc_hot_status(int socket_id, int *status)
+{
+	u32 proc_hot;
+	int err;
+
+	err = hsmp_get_socket_val(socket_id, HSMP_GET_PROC_HOT,
+				  status ? &proc_hot : NULL);
+	if (err)
+		return err;
+
+	*status = proc_hot;
+	return 0;
+}
+
+int hsmp_set_xgmi_width(enum hsmp_xgmi_width min_width,
+			enum hsmp_xgmi_width max_width)
+{
+	int socket_id;
+	u8 min, max;
+	u32 arg;
+	int err;
+
+	err = hsmp_enter(HSMP_SET_XGMI_LINK_WIDTH);
+	if (err)
+		return -1;
+
+	if (hsmp_data.x86_family >= 0x19)
+		min = HSMP_XGMI_WIDTH_X2;
+	else
+		min = HSMP_XGMI_WIDTH_X8;
+
+	if (min_width < min || min_width > HSMP_XGMI_WIDTH_X16 ||
+	    max_width < min_width || max_width > HSMP_XGMI_WIDTH_X16) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	min = min_width;
+	max = max_width;
+
+	arg = (min << 8) | max;
+
+	for (socket_id = 0; socket_id < hsmp_data.num_sockets; socket_id++) {
+		err = hsmp_send_desc(socket_id, HSMP_SET_XGMI_LINK_WIDTH, &arg, NULL);
+		if (err)
+			break;
+
+		cache_put(&hsmp_data.sockets[socket_id].cache.xgmi_width, arg);
+	}
+
+	return err;
+}
+
+int hsmp_set_xgmi_auto(void)
+{
+	enum hsmp_xgmi_width min;
+
+	if (hsmp_data.x86_family >= 0x19)
+		min = HSMP_XGMI_WIDTH_X2;
+	else
+		min = HSMP_XGMI_WIDTH_X8;
+
+	return hsmp_set_xgmi_width(min, HSMP_XGMI_WIDTH_X16);
+}
+
+int hsmp_set_data_fabric_pstate(int socket_id, enum hsmp_df_pstate pstate)
+{
+	u32 arg = pstate;
+	int err;
+
+	/*
+	 * HSMP_AUTO_DF_PSTATE has the higher hsmp_msg_t so we use
+	 * that here for support validation. Both HSMP_AUTO_DF_PSTATE
+	 * and HSMP_SET_DF_PSTATE are supported in HSMP interface
+	 * versions 1 and later.
+	 */
+	err = hsmp_enter(HSMP_AUTO_DF_PSTATE);
+	if (err)
+		return err;
+
+	if (pstate < HSMP_DF_PSTATE_0 || pstate > HSMP_DF_PSTATE_AUTO) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pstate == HSMP_DF_PSTATE_AUTO)
+		err = hsmp_send_desc(socket_id, HSMP_AUTO_DF_PSTATE, NULL, NULL);
+	else
+		err = hsmp_send_desc(socket_id, HSMP_SET_DF_PSTATE, &arg, NULL);
+	if (err)
+		return err;
+
+	cache_put(&hsmp_data.sockets[socket_id].cache.df_pstate, pstate);
+	return 0;
+}
+
+int hsmp_data_fabric_pstate(int socket_id, enum hsmp_df_pstate *pstate)
+{
+	u32 val;
+	int err;
+
+	err = hsmp_enter(HSMP_AUTO_DF_PSTATE);
+	if (err)
+		return err;
+
+	if (!pstate || !socket_id_to_dev(socket_id)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* There is no HSMP message to read the DF P-state back */
+	if (!cache_get(&hsmp_data.sockets[socket_id].cache.df_pstate, &val, true)) {
+		errno = ENODATA;
+		return -1;
+	}
+
+	*pstate = val;
+	return 0;
+}
+
+int hsmp_fabric_clocks(int socket_id, int *data_fabric_clock, int *mem_clock)
+{
+	u32 clocks[2];
+	int err;
+
+	err = hsmp_enter(HSMP_GET_FCLK_MCLK);
+	if (err)
+		return err;
+
+	if (!data_fabric_clock && !mem_clock) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	err = hsmp_send_desc(socket_id, HSMP_GET_FCLK_MCLK, NULL, clocks);
+	if (err)
+		return err;
+
+	if (data_fabric_clock)
+		*data_fabric_clock = clocks[0];
+
+	if (mem_clock)
+		*mem_clock = clocks[1];
+
+	return 0;
+}
+
+int hsmp_data_fabric_clock(int socket_id, int *data_fabric_clock)
+{
+	return hsmp_fabric_clocks(socket_id, data_fabric_clock, NULL);
+}
+
+int hsmp_memory_clock(int socket_id, int *mem_clock)
+{
+	return hsmp_fabric_clocks(socket_id, NULL, mem_clock);
+}
+
+int hsmp_core_clock_max_frequency(int socket_id, u32 *max_freq)
+{
+	return hsmp_get_socket_val(socket_id, HSMP_GET_CCLK_THROTTLE_LIMIT, max_freq);
+}
+
+int hsmp_c0_residency(int socket_id, u32 *residency)
+{
+	return hsmp_get_socket_val(socket_id, HSMP_GET_C0_PERCENT, residency);
+}
+
+/* Build the HSMP_SET_NBIO_DPM_LEVEL argument for NBIO idx */
+static int nbio_dpm_arg(int idx, enum hsmp_nbio_pstate pstate, u32 *arg)
+{
+	u8 dpm_min, dpm_max;
+
+	switch (pstate) {
+	case HSMP_NBIO_PSTATE_AUTO:
+		dpm_min = 0;
+		dpm_max = 2;
+		break;
+	case HSMP_NBIO_PSTATE_P0:
+		dpm_min = 2;
+		dpm_max = 2;
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+
+	*arg = (hsmp_data.nbios[idx].id << 16) | (dpm_max << 8) | dpm_min;
+	return 0;
+}
+
+int hsmp_set_nbio_pstate(u8 bus_num, enum hsmp_nbio_pstate pstate)
+{
+	u32 arg;
+	int idx;
+	int err;
+
+	err = hsmp_enter(HSMP_SET_NBIO_DPM_LEVEL);
+	if (err)
+		return -1;
+
+	if (hsmp_need_nbio_ids())
+		return -1;
+
+	idx = bus_to_nbio(bus_num);
+	if (idx == -1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (nbio_dpm_arg(idx, pstate, &arg))
+		return -1;
+
+	err = hsmp_send_desc(idx / NBIOS_PER_SOCKET, HSMP_SET_NBIO_DPM_LEVEL, &arg, NULL);
+	if (err)
+		return err;
+
+	cache_put(&hsmp_data.nbios[idx].pstate, pstate);
+	return 0;
+}
+
+/* The IOHCs, and so the devices libhsmp can map to them, are in segment 0 */
+static int bdf_to_nbio(const struct hsmp_pci_bdf *bdf)
+{
+	if (bdf->domain || bdf->dev > 0x1F || bdf->fn > 0x7)
+		return -1;
+
+	return bus_to_nbio(bdf->bus);
+}
+
+int hsmp_set_nbio_pstate_for_device(int domain, u8 bus, u8 dev, u8 fn,
+				    enum hsmp_nbio_pstate pstate)
+{
+	struct hsmp_pci_bdf bdf;
+
+	if (domain < 0 || domain > 0xFFFF) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	bdf.domain = domain;
+	bdf.bus = bus;
+	bdf.dev = dev;
+	bdf.fn = fn;
+
+	return hsmp_set_nbio_pstate_for_devices(&bdf, 1, pstate);
+}
+
+int hsmp_set_nbio_pstate_for_devices(const struct hsmp_pci_bdf *devs, int n,
+				     enum hsmp_nbio_pstate pstate)
+{
+	struct hsmp_request *reqs, *req;
+	int *req_nbio;
+	int i, idx, num_reqs;
+	int err, errnum;
+	bool *targeted;
+
+	err = hsmp_enter(HSMP_SET_NBIO_DPM_LEVEL);
+	if (err)
+		return -1;
+
+	if (!devs || n <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (hsmp_need_nbio_ids())
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		if (bdf_to_nbio(&devs[i]) == -1) {
+			pr_debug("No IOHC hosts device %04x:%02x:%02x.%x\n",
+				 devs[i].domain, devs[i].bus, devs[i].dev, devs[i].fn);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	targeted = calloc(hsmp_data.num_nbios, sizeof(*targeted));
+	reqs = calloc(hsmp_data.num_nbios, sizeof(*reqs));
+	req_nbio = malloc(hsmp_data.num_nbios * sizeof(*req_nbio));
+	if (!targeted || !reqs || !req_nbio) {
+		err = -1;
+		errnum = ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < n; i++)
+		targeted[bdf_to_nbio(&devs[i])] = true;
+
+	/* One message per NBIO, in NBIO table order so sockets are grouped */
+	num_reqs = 0;
+	for (idx = 0; idx < hsmp_data.num_nbios; idx++) {
+		if (!targeted[idx])
+			continue;
+
+		req_nbio[num_reqs] = idx;
+		req = &reqs[num_reqs++];
+		req->socket_id = idx / NBIOS_PER_SOCKET;
+		req->msg_id = HSMP_SET_NBIO_DPM_LEVEL;
+		req->num_args = 1;
+		if (nbio_dpm_arg(idx, pstate, &req->args[0])) {
+			err = -1;
+			errnum = EINVAL;
+			goto out;
+		}
+	}
+
+	err = hsmp_send_batch(reqs, num_reqs);
+	errnum = errno;
+
+	for (i = 0; i < num_reqs; i++) {
+		if (!reqs[i].err)
+			cache_put(&hsmp_data.nbios[req_nbio[i]].pstate, pstate);
+	}
+
+	/* Report the first failure as hsmp_set_nbio_pstate() would */
+	for (i = 0; err && i < num_reqs; i++) {
+		if (reqs[i].err) {
+			err = reqs[i].err;
+			errnum = reqs[i].errnum;
+			break;
+		}
+	}
+
+out:
+	free(req_nbio);
+	free(reqs);
+	free(targeted);
+
+	if (err == -1)
+		errno = errnum;
+
+	return err;
+}
+
+int hsmp_next_bus(int idx, u8 *bus_num)
+{
+	int err, rv;
+
+	/* Perform library initialization and HSMP test message */
+	err = hsmp_enter(0);
+	if (err)
+		return err;
+
+	if (!bus_num || idx < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (idx >= hsmp_data.num_nbios) {  /* No IOHC at this array index */
+		errno = ENODEV;
+		return -1;
+	}
+
+	*bus_num = hsmp_data.nbios[idx].bus_base;
+
+	/*
+	 * Test if the next iteration would succeed. Return idx if so,
+	 * return 0 if not.
+	 */
+	rv = idx + 1;
+	if (rv == hsmp_data.num_nbios)
+		rv = 0;
+
+	return rv;
+}
+
+int hsmp_ddr_bandwidths(int socket_id, u32 *max_bw,
+			u32 *utilized_bw, u32 *utilized_pct)
+{
+	u32 result;
+	int err;
+
+	err = hsmp_enter(HSMP_GET_DDR_BANDWIDTH);
+	if (err)
+		return -1;
+
+	if (!max_bw && !utilized_bw && !utilized_pct) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	err = hsmp_send_desc(socket_id, HSMP_GET_DDR_BANDWIDTH, NULL, &result);
+	if (err)
+		return err;
+
+	cache_put(&hsmp_data.sockets[socket_id].cache.ddr_max_bw, result >> 20);
+
+	if (max_bw)
+		*max_bw = result >> 20;
+
+	if (utilized_bw)
+		*utilized_bw = (result >> 8) & 0xFFF;
+
+	if (utilized_pct)
+		*utilized_pct = result & 0xFF;
+
+	return 0;
+}
+
+int hsmp_ddr_max_bandwidth(int socket_id, u32 *max_bw)
+{
+	int err;
+
+	err = hsmp_enter(HSMP_GET_DDR_BANDWIDTH);
+	if (err)
+		return -1;
+
+	if (max_bw && socket_id_to_dev(socket_id) &&
+	    cache_get(&hsmp_data.sockets[socket_id].cache.ddr_max_bw, max_bw, true))
+		return 0;
+
+	return hsmp_ddr_bandwidths(socket_id, max_bw, NULL, NULL);
+}
+
+int hsmp_ddr_utilized_bandwidth(int socket_id, u32 *utilized_bw)
+{
+	return hsmp_ddr_bandwidths(socket_id, NULL, utilized_bw, NULL);
+}
+
+int hsmp_ddr_utilized_percent(int socket_id, u32 *utilized_pct)
+{
+	return hsmp_ddr_bandwidths(socket_id, NULL, NULL, utilized_pct);
+}
+
+/* Messages read for each socket telemetry field */
+static const struct {
+	unsigned int	field;
+	enum hsmp_msg_t	msg_id;
+} telemetry_msgs[] = {
+	{ HSMP_TELEMETRY_POWER,		  HSMP_GET_SOCKET_POWER },
+	{ HSMP_TELEMETRY_POWER_LIMIT,	  HSMP_GET_SOCKET_POWER_LIMIT },
+	{ HSMP_TELEMETRY_MAX_POWER_LIMIT, HSMP_GET_SOCKET_POWER_LIMIT_MAX },
+	{ HSMP_TELEMETRY_FABRIC_CLOCKS,	  HSMP_GET_FCLK_MCLK },
+	{ HSMP_TELEMETRY_CCLK_LIMIT,	  HSMP_GET_CCLK_THROTTLE_LIMIT },
+	{ HSMP_TELEMETRY_C0_RESIDENCY,	  HSMP_GET_C0_PERCENT },
+	{ HSMP_TELEMETRY_PROC_HOT,	  HSMP_GET_PROC_HOT },
+	{ HSMP_TELEMETRY_DDR_BANDWIDTH,	  HSMP_GET_DDR_BANDWIDTH },
+};
+
+#define NUM_TELEMETRY_MSGS	(sizeof(telemetry_msgs) / sizeof(telemetry_msgs[0]))
+
+/* Fill a telemetry field from the cache, returns false if not cached */
+static bool cached_telemetry(int socket_id, struct hsmp_telemetry *telemetry,
+			     unsigned int field, enum hsmp_msg_t msg_id)
+{
+	switch (field) {
+	case HSMP_TELEMETRY_POWER_LIMIT:
+		return msg_cache_get(socket_id, msg_id, &telemetry->power_limit);
+	case HSMP_TELEMETRY_MAX_POWER_LIMIT:
+		return msg_cache_get(socket_id, msg_id, &telemetry->max_power_limit);
+	}
 
-nbio_setup_error:
-	hsmp_cleanup_nbios();
-	errno = ENODEV;
-	return -1;
+	return false;
 }
 
-static int read_id(char *line)
+static void decode_telemetry(struct hsmp_telemetry *telemetry,
+			     struct hsmp_request *req, unsigned int field)
 {
-	char *c = line;
+	struct socket_cache *cache = &hsmp_data.sockets[req->socket_id].cache;
 
-	while (*c++ != ':') {}
-	c++;
+	msg_cache_put(req->socket_id, req->msg_id, req->response[0]);
 
-	return strtol(c, NULL, 10);
+	switch (field) {
+	case HSMP_TELEMETRY_POWER:
+		telemetry->power = req->response[0];
+		break;
+	case HSMP_TELEMETRY_POWER_LIMIT:
+		telemetry->power_limit = req->response[0];
+		break;
+	case HSMP_TELEMETRY_MAX_POWER_LIMIT:
+		telemetry->max_power_limit = req->response[0];
+		break;
+	case HSMP_TELEMETRY_FABRIC_CLOCKS:
+		telemetry->data_fabric_clock = req->response[0];
+		telemetry->mem_clock = req->response[1];
+		break;
+	case HSMP_TELEMETRY_CCLK_LIMIT:
+		telemetry->cclk_limit = req->response[0];
+		break;
+	case HSMP_TELEMETRY_C0_RESIDENCY:
+		telemetry->c0_residency = req->response[0];
+		break;
+	case HSMP_TELEMETRY_PROC_HOT:
+		telemetry->proc_hot = req->response[0];
+		break;
+	case HSMP_TELEMETRY_DDR_BANDWIDTH:
+		telemetry->ddr_max_bw = req->response[0] >> 20;
+		telemetry->ddr_utilized_bw = (req->response[0] >> 8) & 0xFFF;
+		telemetry->ddr_utilized_pct = req->response[0] & 0xFF;
+		cache_put(&cache->ddr_max_bw, telemetry->ddr_max_bw);
+		break;
+	}
 }
 
-static int hsmp_get_cpu_data(void)
+int hsmp_socket_telemetry(int socket_id, struct hsmp_telemetry *telemetry,
+			  unsigned int fields_mask)
 {
-	FILE *fp;
-	char *line;
-	size_t len;
-	int read;
-	int err;
+	struct hsmp_request reqs[NUM_TELEMETRY_MSGS];
+	unsigned int fields[NUM_TELEMETRY_MSGS];
+	int i, n, err;
 
-	fp = fopen("/proc/cpuinfo", "r");
-	if (!fp) {
-		pr_debug("Failed to open \"/proc/cpuinfo\"\n");
+	err = hsmp_enter(HSMP_TEST);
+	if (err)
 		return -1;
-	}
 
-	line = NULL;
-	err = 0;
-	while ((read = getline(&line, &len, fp)) != -1) {
-		if (!strncmp(line, "processor", 9)) {
-			int cpu_id;
+	if (!telemetry || !fields_mask || (fields_mask & ~HSMP_TELEMETRY_ALL) ||
+	    !socket_id_to_dev(socket_id)) {
+		errno = EINVAL;
+		return -1;
+	}
 
-			cpu_id = read_id(line);
-			if (cpu_id >= MAX_CPUS)
-				break;
+	memset(telemetry, 0, sizeof(*telemetry));
+	memset(reqs, 0, sizeof(reqs));
 
-			/* goto 'physical id' */
-			while ((read = getline(&line, &len, fp)) != -1) {
-				if (!strncmp(line, "physical id", 11)) {
-					hsmp_data.cpus[cpu_id].socket_id = read_id(line);
-					break;
-				}
-			}
+	n = 0;
+	for (i = 0; i < NUM_TELEMETRY_MSGS; i++) {
+		if (!(fields_mask & telemetry_msgs[i].field) ||
+		    !msg_id_supported(telemetry_msgs[i].msg_id))
+			continue;
 
-			if (read == -1) {
-				err = -1;
-				break;
-			}
+		if (cached_telemetry(socket_id, telemetry, telemetry_msgs[i].field,
+				     telemetry_msgs[i].msg_id)) {
+			telemetry->valid |= telemetry_msgs[i].field;
+			continue;
+		}
 
-			/* goto 'apicid' */
-			while ((read = getline(&line, &len, fp)) != -1) {
-				if (!strncmp(line, "apicid", 6)) {
-					hsmp_data.cpus[cpu_id].apicid = read_id(line);
-					break;
-				}
-			}
+		reqs[n].socket_id = socket_id;
+		reqs[n].msg_id = telemetry_msgs[i].msg_id;
+		reqs[n].response_sz = msg_descs[telemetry_msgs[i].msg_id].response_sz;
+		fields[n] = telemetry_msgs[i].field;
+		n++;
+	}
 
-			if (read == -1) {
-				err = -1;
-				break;
-			}
+	if (!n)
+		return 0;
 
-			hsmp_data.cpus[cpu_id].valid = 1;
-		}
-	}
+	err = hsmp_send_batch(reqs, n);
 
-	free(line);
-	fclose(fp);
+	for (i = 0; i < n; i++) {
+		if (reqs[i].err)
+			continue;
 
-	if (err) {
-		pr_debug("Failed to parse \"/proc/cpuinfo\" for CPU socket id and apicid\n");
-		errno = EINVAL;
+		decode_telemetry(telemetry, &reqs[i], fields[i]);
+		telemetry->valid |= fields[i];
 	}
 
 	return err;
 }
 
-static int hsmp_init(void)
-{
-	int err;
-
-	err = get_system_info();
-	if (err)
-		return -1;
-
-	/* Offsets in PCIe config space for 0x1480 DevID (IOHC) */
-	smu.index_reg  = 0x60;
-	smu.data_reg   = 0x64;
-	hsmp.index_reg = 0xC4;
-	hsmp.data_reg  = 0xC8;
-
-	/* Offsets in SMN address space */
-	hsmp_access.mbox_msg_id  = 0x3B10534;
-	hsmp_access.mbox_status  = 0x3B10980;
-	hsmp_access.mbox_data    = 0x3B109E0;
-
-	hsmp_access.mbox_timeout = 500;
-
-	err = hsmp_setup_nbios();
-	if (err)
-		return -1;
-
-	err = hsmp_get_cpu_data();
-	if (!err)
-		err = hsmp_probe();
+/*
+ * Performance profiles
+ *
+ * Each setting of a profile translates to one request per socket it
+ * applies to, the whole profile is sent as a single batch. The settings
+ * the profile changes are snapshot first so a failed profile can be rolled
+ * back. Values the SMU does not report (DF P-state, xGMI width and NBIO
+ * P-state) are taken from the last value set through libhsmp, or the
+ * automatic default if none was set.
+ */
+#define SETTING_BIT(type)	(1u << (type))
+#define BOOST_SETTINGS		(SETTING_BIT(HSMP_SETTING_SOCKET_BOOST_LIMIT) | \
+				 SETTING_BIT(HSMP_SETTING_CPU_BOOST_LIMIT))
 
-	if (err) {
-		hsmp_cleanup_nbios();
-		return err;
-	}
+static u32 xgmi_auto_widths(void)
+{
+	if (hsmp_data.x86_family >= 0x19)
+		return HSMP_XGMI_WIDTHS(HSMP_XGMI_WIDTH_X2, HSMP_XGMI_WIDTH_X16);
 
-	hsmp_data.initialized = 1;
-	return 0;
+	return HSMP_XGMI_WIDTHS(HSMP_XGMI_WIDTH_X8, HSMP_XGMI_WIDTH_X16);
 }
 
-static int hsmp_enter(enum hsmp_msg_t msg_id)
+/* The socket a setting applies to, -1 for every socket */
+static int setting_socket(const struct hsmp_setting *s)
 {
-	int err = 0;
-
-	if (geteuid() != 0) {
-		pr_debug("libhsmp requires root access!\n");
-		errno = EPERM;
-		return -1;
-	}
-
-	if (hsmp_data.hsmp_disabled) {
-		errno = ENOTSUP;
+	switch (s->type) {
+	case HSMP_SETTING_CPU_BOOST_LIMIT:
+		return cpu_socket_id(s->target);
+	case HSMP_SETTING_XGMI_WIDTH:
 		return -1;
+	case HSMP_SETTING_NBIO_PSTATE:
+		return bus_to_nbio(s->target) / NBIOS_PER_SOCKET;
+	default:
+		return s->target;
 	}
+}
 
-	if (!hsmp_data.initialized) {
-		err = hsmp_init();
-		if (err)
-			return err;
+/* Validate a setting, returns 0 or -1 with errno set */
+static int check_setting(const struct hsmp_setting *s)
+{
+	enum hsmp_msg_t msg_id;
+	u32 min, max;
+
+	switch (s->type) {
+	case HSMP_SETTING_SOCKET_POWER_LIMIT:
+		msg_id = HSMP_SET_SOCKET_POWER_LIMIT;
+		if (!socket_id_to_dev(s->target))
+			goto inval;
+		break;
+	case HSMP_SETTING_SOCKET_BOOST_LIMIT:
+		msg_id = HSMP_SET_BOOST_LIMIT_SOCKET;
+		if (!socket_id_to_dev(s->target) || s->value > 0xFFFF)
+			goto inval;
+		break;
+	case HSMP_SETTING_CPU_BOOST_LIMIT:
+		msg_id = HSMP_SET_BOOST_LIMIT;
+		if (s->value > 0xFFFF)
+			goto inval;
+		if (cpu_apicid(s->target) < 0)
+			return -1;
+		break;
+	case HSMP_SETTING_DF_PSTATE:
+		msg_id = HSMP_AUTO_DF_PSTATE;
+		if (!socket_id_to_dev(s->target) || s->value > HSMP_DF_PSTATE_AUTO)
+			goto inval;
+		break;
+	case HSMP_SETTING_XGMI_WIDTH:
+		msg_id = HSMP_SET_XGMI_LINK_WIDTH;
+		min = s->value >> 8;
+		max = s->value & 0xFF;
+		if (min < (xgmi_auto_widths() >> 8) || max < min ||
+		    max > HSMP_XGMI_WIDTH_X16)
+			goto inval;
+		break;
+	case HSMP_SETTING_NBIO_PSTATE:
+		msg_id = HSMP_SET_NBIO_DPM_LEVEL;
+		if (s->target < 0 || s->target > 0xFF || s->value > HSMP_NBIO_PSTATE_P0)
+			goto inval;
+		if (msg_id_supported(msg_id) && hsmp_need_nbio_ids())
+			return -1;
+		if (bus_to_nbio(s->target) == -1)
+			goto inval;
+		break;
+	default:
+		goto inval;
 	}
 
 	if (!msg_id_supported(msg_id)) {
@@ -883,580 +4899,701 @@ static int hsmp_enter(enum hsmp_msg_t msg_id)
 	}
 
 	return 0;
-}
 
-static void hsmp_fini(void)
-{
-	hsmp_cleanup_nbios();
+inval:
+	errno = EINVAL;
+	return -1;
 }
 
-void __attribute__ ((destructor)) hsmp_fini(void);
-
-int hsmp_smu_fw_version(struct smu_fw_version *smu_fw)
+/*
+ * Fill in the requests for a validated setting, one per socket for the
+ * xGMI width. Returns the number of requests.
+ */
+static int setting_requests(const struct hsmp_setting *s, struct hsmp_request *reqs)
 {
-	int err;
+	struct hsmp_request *req = reqs;
+	int socket_id;
 
-	err = hsmp_enter(HSMP_GET_SMU_VER);
-	if (err)
-		return -1;
+	memset(req, 0, sizeof(*req));
+	req->socket_id = setting_socket(s);
 
-	if (!smu_fw) {
-		errno = EINVAL;
-		return -1;
+	switch (s->type) {
+	case HSMP_SETTING_SOCKET_POWER_LIMIT:
+		req->msg_id = HSMP_SET_SOCKET_POWER_LIMIT;
+		req->num_args = 1;
+		req->args[0] = s->value;
+		break;
+	case HSMP_SETTING_SOCKET_BOOST_LIMIT:
+		req->msg_id = HSMP_SET_BOOST_LIMIT_SOCKET;
+		req->num_args = 1;
+		req->args[0] = s->value;
+		break;
+	case HSMP_SETTING_CPU_BOOST_LIMIT:
+		req->msg_id = HSMP_SET_BOOST_LIMIT;
+		req->num_args = 1;
+		req->args[0] = hsmp_data.cpus[s->target].apicid << 16 | s->value;
+		break;
+	case HSMP_SETTING_DF_PSTATE:
+		if (s->value == HSMP_DF_PSTATE_AUTO) {
+			req->msg_id = HSMP_AUTO_DF_PSTATE;
+		} else {
+			req->msg_id = HSMP_SET_DF_PSTATE;
+			req->num_args = 1;
+			req->args[0] = s->value;
+		}
+		break;
+	case HSMP_SETTING_XGMI_WIDTH:
+		for (socket_id = 0; socket_id < hsmp_data.num_sockets; socket_id++) {
+			req = &reqs[socket_id];
+			memset(req, 0, sizeof(*req));
+			req->socket_id = socket_id;
+			req->msg_id = HSMP_SET_XGMI_LINK_WIDTH;
+			req->num_args = 1;
+			req->args[0] = s->value;
+		}
+		return hsmp_data.num_sockets;
+	case HSMP_SETTING_NBIO_PSTATE:
+		req->msg_id = HSMP_SET_NBIO_DPM_LEVEL;
+		req->num_args = 1;
+		nbio_dpm_arg(bus_to_nbio(s->target), s->value, &req->args[0]);
+		break;
 	}
 
-	smu_fw->major = hsmp_data.smu_firmware.ver.major;
-	smu_fw->minor = hsmp_data.smu_firmware.ver.minor;
-	smu_fw->debug = hsmp_data.smu_firmware.ver.debug;
-
-	return 0;
+	return 1;
 }
 
-int hsmp_interface_version(int *version)
+/* Update the library state for a setting request sent to the SMU */
+static void record_setting(const struct hsmp_setting *s, const struct hsmp_request *req)
 {
-	int err;
+	struct socket_cache *cache = &hsmp_data.sockets[req->socket_id].cache;
+	bool set = !req->err;
 
-	err = hsmp_enter(HSMP_GET_PROTO_VER);
-	if (err)
-		return -1;
+	switch (s->type) {
+	case HSMP_SETTING_SOCKET_POWER_LIMIT:
+		cache_invalidate(&cache->power_limit);
+		break;
+	case HSMP_SETTING_SOCKET_BOOST_LIMIT:
+		record_boost_limit(req->socket_id, -1, s->value, set);
+		break;
+	case HSMP_SETTING_CPU_BOOST_LIMIT:
+		record_boost_limit(req->socket_id,
+				   hsmp_data.cpus[s->target].apicid >> hsmp_data.smt_shift,
+				   s->value, set);
+		break;
+	case HSMP_SETTING_DF_PSTATE:
+		if (set)
+			cache_put(&cache->df_pstate, s->value);
+		break;
+	case HSMP_SETTING_XGMI_WIDTH:
+		if (set)
+			cache_put(&cache->xgmi_width, s->value);
+		break;
+	case HSMP_SETTING_NBIO_PSTATE:
+		if (set)
+			cache_put(&hsmp_data.nbios[bus_to_nbio(s->target)].pstate, s->value);
+		break;
+	}
+}
 
-	if (!version) {
-		errno = EINVAL;
+/*
+ * Send the n validated settings as one batch. Returns 0 on success or the
+ * result of the first failed request with errno set.
+ */
+static int send_settings(const struct hsmp_setting *settings, int n)
+{
+	struct hsmp_request *reqs;
+	int *req_setting;
+	int i, j, num_reqs, cnt;
+	int err, errnum;
+
+	reqs = calloc(n * hsmp_data.num_sockets, sizeof(*reqs));
+	req_setting = malloc(n * hsmp_data.num_sockets * sizeof(*req_setting));
+	if (!reqs || !req_setting) {
+		free(req_setting);
+		free(reqs);
+		errno = ENOMEM;
 		return -1;
 	}
 
-	*version = hsmp_data.hsmp_proto_ver;
-	return 0;
-}
+	num_reqs = 0;
+	for (i = 0; i < n; i++) {
+		cnt = setting_requests(&settings[i], &reqs[num_reqs]);
+		for (j = 0; j < cnt; j++)
+			req_setting[num_reqs++] = i;
+	}
 
-int hsmp_socket_power(int socket_id, u32 *power_mw)
-{
-	struct hsmp_message msg = { 0 };
-	int err;
+	err = hsmp_send_batch(reqs, num_reqs);
+	errnum = errno;
 
-	err = hsmp_enter(HSMP_GET_SOCKET_POWER);
-	if (err)
-		return -1;
+	for (i = 0; i < num_reqs; i++)
+		record_setting(&settings[req_setting[i]], &reqs[i]);
 
-	if (!power_mw) {
-		errno = EINVAL;
-		return -1;
+	for (i = 0; err && i < num_reqs; i++) {
+		if (reqs[i].err) {
+			err = reqs[i].err;
+			errnum = reqs[i].errnum;
+			break;
+		}
 	}
 
-	msg.msg_num = HSMP_GET_SOCKET_POWER;
-	msg.response_sz = 1;
+	free(req_setting);
+	free(reqs);
 
-	err = hsmp_send_message(socket_id, &msg);
-	if (err)
-		return err;
+	if (err == -1)
+		errno = errnum;
 
-	*power_mw = msg.response[0];
-	return 0;
+	return err;
 }
 
-int hsmp_set_socket_power_limit(int socket_id, u32 power_limit)
+static void add_setting(struct hsmp_setting *settings, int *n, int max,
+			enum hsmp_setting_t type, int target, u32 value)
 {
-	struct hsmp_message msg = { 0 };
-	int err;
-
-	err = hsmp_enter(HSMP_SET_SOCKET_POWER_LIMIT);
-	if (err)
-		return -1;
+	if (*n == max) {
+		pr_debug("Snapshot full, dropping setting type %d target %d\n",
+			 type, target);
+		return;
+	}
 
-	msg.msg_num = HSMP_SET_SOCKET_POWER_LIMIT;
-	msg.num_args = 1;
-	msg.args[0] = power_limit;
+	settings[*n].type = type;
+	settings[*n].target = target;
+	settings[*n].value = value;
+	(*n)++;
+}
 
-	return hsmp_send_message(socket_id, &msg);
+/*
+ * The most settings snapshot_settings() can return, only valid once the
+ * CPU data and NBIO IDs are set up.
+ */
+static int max_snapshot_settings(void)
+{
+	return hsmp_data.num_sockets * 3 + hsmp_data.num_cores + 1 +
+	       hsmp_data.num_nbios;
 }
 
-int hsmp_socket_power_limit(int socket_id, u32 *power_limit)
+/*
+ * Snapshot the current values of the setting types in the types mask into
+ * a newly allocated array, *settings, which the caller frees. Boost limits
+ * are read for every core and reported per socket where all its cores
+ * agree. Returns the number of settings or -1 with errno set.
+ */
+static int snapshot_settings(struct hsmp_setting **settings, unsigned int types)
 {
-	struct hsmp_message msg = { 0 };
+	struct hsmp_setting *out;
+	struct hsmp_request *reqs, *req;
+	int *req_cpu, *core_cpu = NULL;
+	int i, n, num_reqs, first_req, num_core_reqs;
+	int socket_id, core, cpu, max;
+	bool uniform;
+	u32 val;
 	int err;
 
-	err = hsmp_enter(HSMP_GET_SOCKET_POWER_LIMIT);
-	if (err)
+	if ((types & BOOST_SETTINGS) && hsmp_need_cpu_data())
 		return -1;
 
-	if (!power_limit) {
-		errno = EINVAL;
+	if ((types & SETTING_BIT(HSMP_SETTING_NBIO_PSTATE)) &&
+	    msg_id_supported(HSMP_SET_NBIO_DPM_LEVEL) && hsmp_need_nbio_ids())
 		return -1;
-	}
-
-	msg.msg_num = HSMP_GET_SOCKET_POWER_LIMIT;
-	msg.response_sz = 1;
-
-	err = hsmp_send_message(socket_id, &msg);
-	if (err)
-		return err;
-
-	*power_limit = msg.response[0];
-	return 0;
-}
-
-int hsmp_socket_max_power_limit(int socket_id, u32 *max_power)
-{
-	struct hsmp_message msg = { 0 };
-	int err;
 
-	err = hsmp_enter(HSMP_GET_SOCKET_POWER_LIMIT_MAX);
-	if (err)
+	/* Sized now that the number of cores is known */
+	max = max_snapshot_settings();
+	out = malloc(max * sizeof(*out));
+	if (!out)
 		return -1;
 
-	if (!max_power) {
-		errno = EINVAL;
+	reqs = calloc(hsmp_data.num_sockets + hsmp_data.num_cores, sizeof(*reqs));
+	req_cpu = malloc((hsmp_data.num_sockets + hsmp_data.num_cores) * sizeof(*req_cpu));
+	if (!reqs || !req_cpu) {
+		free(req_cpu);
+		free(reqs);
+		free(out);
 		return -1;
 	}
 
-	msg.msg_num = HSMP_GET_SOCKET_POWER_LIMIT_MAX;
-	msg.response_sz = 1;
+	/* Read the power limits and one CPU of every core in one batch */
+	num_reqs = 0;
+	if (types & SETTING_BIT(HSMP_SETTING_SOCKET_POWER_LIMIT)) {
+		for (socket_id = 0; socket_id < hsmp_data.num_sockets; socket_id++) {
+			req = &reqs[num_reqs++];
+			req->socket_id = socket_id;
+			req->msg_id = HSMP_GET_SOCKET_POWER_LIMIT;
+			req->response_sz = 1;
+		}
+	}
 
-	err = hsmp_send_message(socket_id, &msg);
-	if (err)
-		return err;
+	first_req = num_reqs;
+	if (types & BOOST_SETTINGS) {
+		core_cpu = malloc(hsmp_data.num_cores * sizeof(*core_cpu));
+		if (!core_cpu) {
+			free(req_cpu);
+			free(reqs);
+			free(out);
+			return -1;
+		}
 
-	*max_power = msg.response[0];
-	return 0;
-}
+		memset(core_cpu, -1, hsmp_data.num_cores * sizeof(*core_cpu));
+		for (cpu = 0; cpu < hsmp_data.num_cpus; cpu++) {
+			if (!hsmp_data.cpus[cpu].valid)
+				continue;
 
-int hsmp_set_cpu_boost_limit(int cpu, u32 boost_limit)
-{
-	struct hsmp_message msg = { 0 };
-	int socket_id;
-	int apicid;
-	int err;
+			core = hsmp_data.cpus[cpu].apicid >> hsmp_data.smt_shift;
+			if (core_cpu[core] == -1)
+				core_cpu[core] = cpu;
+		}
 
-	err = hsmp_enter(HSMP_SET_BOOST_LIMIT);
-	if (err)
-		return err;
+		for (core = 0; core < hsmp_data.num_cores; core++) {
+			if (core_cpu[core] == -1)
+				continue;
+
+			req_cpu[num_reqs] = core_cpu[core];
+			req = &reqs[num_reqs++];
+			req->socket_id = hsmp_data.cpus[core_cpu[core]].socket_id;
+			req->msg_id = HSMP_GET_BOOST_LIMIT;
+			req->num_args = 1;
+			req->args[0] = hsmp_data.cpus[core_cpu[core]].apicid;
+			req->response_sz = 1;
+		}
+	}
 
-	apicid = cpu_apicid(cpu);
-	if (apicid < 0) {
-		errno = EINVAL;
-		return -1;
+	err = 0;
+	if (num_reqs)
+		err = hsmp_send_batch(reqs, num_reqs);
+
+	for (i = 0; err && i < num_reqs; i++) {
+		if (reqs[i].err) {
+			err = reqs[i].err;
+			errno = reqs[i].errnum;
+			break;
+		}
 	}
 
-	socket_id = cpu_socket_id(cpu);
-	if (socket_id < 0) {
-		errno = EINVAL;
+	if (err) {
+		free(core_cpu);
+		free(req_cpu);
+		free(reqs);
+		free(out);
 		return -1;
 	}
 
-	msg.msg_num = HSMP_SET_BOOST_LIMIT;
-	msg.num_args = 1;
-	msg.args[0] = apicid << 16 | boost_limit;
+	n = 0;
+	for (i = 0; i < first_req; i++)
+		add_setting(out, &n, max, HSMP_SETTING_SOCKET_POWER_LIMIT,
+			    reqs[i].socket_id, reqs[i].response[0]);
+
+	for (socket_id = 0; (types & BOOST_SETTINGS) &&
+	     socket_id < hsmp_data.num_sockets; socket_id++) {
+		uniform = true;
+		num_core_reqs = 0;
+		val = 0;
+		for (i = first_req; i < num_reqs; i++) {
+			if (reqs[i].socket_id != socket_id)
+				continue;
+
+			if (num_core_reqs++ && reqs[i].response[0] != val)
+				uniform = false;
+			val = reqs[i].response[0];
+		}
 
-	return hsmp_send_message(socket_id, &msg);
-}
+		if (!num_core_reqs)
+			continue;
 
-static int _set_socket_boost_limit(int socket_id, u32 boost_limit)
-{
-	struct hsmp_message msg = { 0 };
+		if (uniform) {
+			add_setting(out, &n, max, HSMP_SETTING_SOCKET_BOOST_LIMIT,
+				    socket_id, val);
+			continue;
+		}
 
-	msg.msg_num = HSMP_SET_BOOST_LIMIT_SOCKET;
-	msg.num_args = 1;
-	msg.args[0] = boost_limit;
+		for (i = first_req; i < num_reqs; i++) {
+			if (reqs[i].socket_id == socket_id)
+				add_setting(out, &n, max, HSMP_SETTING_CPU_BOOST_LIMIT,
+					    req_cpu[i], reqs[i].response[0]);
+		}
+	}
 
-	return hsmp_send_message(socket_id, &msg);
-}
+	for (socket_id = 0; (types & SETTING_BIT(HSMP_SETTING_DF_PSTATE)) &&
+	     socket_id < hsmp_data.num_sockets; socket_id++) {
+		if (!cache_get(&hsmp_data.sockets[socket_id].cache.df_pstate, &val, true))
+			val = HSMP_DF_PSTATE_AUTO;
+		add_setting(out, &n, max, HSMP_SETTING_DF_PSTATE, socket_id, val);
+	}
 
-int hsmp_set_socket_boost_limit(int socket_id, u32 boost_limit)
-{
-	int err;
+	/* xGMI links only exist between sockets */
+	if ((types & SETTING_BIT(HSMP_SETTING_XGMI_WIDTH)) && hsmp_data.num_sockets > 1) {
+		if (!cache_get(&hsmp_data.sockets[0].cache.xgmi_width, &val, true))
+			val = xgmi_auto_widths();
+		add_setting(out, &n, max, HSMP_SETTING_XGMI_WIDTH, 0, val);
+	}
 
-	err = hsmp_enter(HSMP_SET_BOOST_LIMIT_SOCKET);
-	if (err)
-		return err;
+	for (i = 0; (types & SETTING_BIT(HSMP_SETTING_NBIO_PSTATE)) &&
+	     msg_id_supported(HSMP_SET_NBIO_DPM_LEVEL) && i < hsmp_data.num_nbios; i++) {
+		if (!cache_get(&hsmp_data.nbios[i].pstate, &val, true))
+			val = HSMP_NBIO_PSTATE_AUTO;
+		add_setting(out, &n, max, HSMP_SETTING_NBIO_PSTATE,
+			    hsmp_data.nbios[i].bus_base, val);
+	}
 
-	return _set_socket_boost_limit(socket_id, boost_limit);
+	free(core_cpu);
+	free(req_cpu);
+	free(reqs);
+
+	*settings = out;
+	return n;
 }
 
-int hsmp_set_system_boost_limit(u32 boost_limit)
+/* Returns true if the profile changes the setting s of a snapshot */
+static bool profile_changes(const struct hsmp_setting *profile, int n,
+			    const struct hsmp_setting *s)
 {
-	int socket_id;
-	int err;
+	unsigned int s_bit = SETTING_BIT(s->type);
+	unsigned int bit;
+	int i;
 
-	err = hsmp_enter(HSMP_SET_BOOST_LIMIT_SOCKET);
-	if (err)
-		return -1;
+	for (i = 0; i < n; i++) {
+		bit = SETTING_BIT(profile[i].type);
+		if (!(bit & s_bit) && !((bit & BOOST_SETTINGS) && (s_bit & BOOST_SETTINGS)))
+			continue;
 
-	for (socket_id = 0; socket_id < MAX_SOCKETS; socket_id++) {
-		if (!socket_id_to_dev(socket_id))
+		switch (s->type) {
+		case HSMP_SETTING_XGMI_WIDTH:
+			return true;
+		case HSMP_SETTING_NBIO_PSTATE:
+			if (bus_to_nbio(profile[i].target) == bus_to_nbio(s->target))
+				return true;
 			break;
-
-		err = _set_socket_boost_limit(socket_id, boost_limit);
-		if (err)
+		default:
+			if (setting_socket(&profile[i]) == setting_socket(s))
+				return true;
 			break;
+		}
 	}
 
-	return err;
+	return false;
 }
 
-int hsmp_cpu_boost_limit(int cpu, u32 *boost_limit)
+int hsmp_apply_profile(const struct hsmp_setting *settings, int n)
 {
-	struct hsmp_message msg = { 0 };
-	int socket_id;
-	int apicid;
-	int err;
+	struct hsmp_setting *undo;
+	unsigned int types;
+	int i, num_undo, cnt;
+	int err, errnum;
 
-	err = hsmp_enter(HSMP_GET_BOOST_LIMIT);
+	err = hsmp_enter(HSMP_TEST);
 	if (err)
 		return -1;
 
-	if (!boost_limit) {
+	if (!settings || n <= 0) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	apicid = cpu_apicid(cpu);
-	if (apicid < 0) {
-		errno = EINVAL;
-		return -1;
+	types = 0;
+	for (i = 0; i < n; i++) {
+		if (check_setting(&settings[i])) {
+			pr_debug("Invalid profile setting %d: type %d target %d value %u\n",
+				 i, settings[i].type, settings[i].target, settings[i].value);
+			return -1;
+		}
+
+		types |= SETTING_BIT(settings[i].type);
 	}
 
-	socket_id = cpu_socket_id(cpu);
-	if (socket_id < 0) {
-		errno = EINVAL;
+	cnt = snapshot_settings(&undo, types);
+	if (cnt < 0)
 		return -1;
+
+	/* Only roll back what the profile changes */
+	num_undo = 0;
+	for (i = 0; i < cnt; i++) {
+		if (profile_changes(settings, n, &undo[i]))
+			undo[num_undo++] = undo[i];
 	}
 
-	msg.msg_num = HSMP_GET_BOOST_LIMIT;
-	msg.num_args = 1;
-	msg.response_sz = 1;
-	msg.args[0] = apicid;
+	err = send_settings(settings, n);
+	errnum = errno;
+
+	if (err && num_undo) {
+		pr_debug("Profile failed, restoring %d settings\n", num_undo);
+		if (send_settings(undo, num_undo))
+			pr_debug("Profile rollback failed, errno %d\n", errno);
+	}
+
+	free(undo);
 
-	err = hsmp_send_message(socket_id, &msg);
 	if (err)
-		return err;
+		errno = errnum;
 
-	*boost_limit = msg.response[0];
 	return err;
 }
 
-int hsmp_proc_hot_status(int socket_id, int *status)
+int hsmp_snapshot_profile(struct hsmp_setting *settings, int max)
 {
-	struct hsmp_message msg = { 0 };
-	int err;
+	struct hsmp_setting *snapshot;
+	unsigned int types;
+	int n, err;
 
-	err = hsmp_enter(HSMP_GET_PROC_HOT);
+	err = hsmp_enter(HSMP_TEST);
 	if (err)
 		return -1;
 
-	if (!status) {
+	if (max < 0 || (max && !settings)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	msg.msg_num = HSMP_GET_PROC_HOT;
-	msg.response_sz = 1;
+	types = SETTING_BIT(HSMP_SETTING_SOCKET_POWER_LIMIT) | BOOST_SETTINGS |
+		SETTING_BIT(HSMP_SETTING_DF_PSTATE) |
+		SETTING_BIT(HSMP_SETTING_XGMI_WIDTH) |
+		SETTING_BIT(HSMP_SETTING_NBIO_PSTATE);
 
-	err = hsmp_send_message(socket_id, &msg);
-	if (err)
-		return err;
+	n = snapshot_settings(&snapshot, types);
+	if (n < 0)
+		return -1;
 
-	*status = msg.response[0];
-	return 0;
+	if (n > 0 && max)
+		memcpy(settings, snapshot, (n < max ? n : max) * sizeof(*snapshot));
+
+	free(snapshot);
+	return n;
 }
 
-int hsmp_set_xgmi_width(enum hsmp_xgmi_width min_width,
-			enum hsmp_xgmi_width max_width)
+int hsmp_submit_batch(struct hsmp_request *reqs, int n)
 {
-	struct hsmp_message msg = { 0 };
-	int socket_id;
-	u8 min, max;
 	int err;
 
-	err = hsmp_enter(HSMP_SET_XGMI_LINK_WIDTH);
+	err = hsmp_enter(HSMP_TEST);
 	if (err)
 		return -1;
 
-	if (hsmp_data.x86_family >= 0x19)
-		min = HSMP_XGMI_WIDTH_X2;
-	else
-		min = HSMP_XGMI_WIDTH_X8;
-
-	if (min_width < min || min_width > HSMP_XGMI_WIDTH_X16 ||
-	    max_width < min_width || max_width > HSMP_XGMI_WIDTH_X16) {
+	if (!reqs || n <= 0) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	min = min_width;
-	max = max_width;
-
-	msg.msg_num = HSMP_SET_XGMI_LINK_WIDTH;
-	msg.num_args = 1;
-	msg.args[0] = (min << 8) | max;
-
-	for (socket_id = 0; socket_id < MAX_SOCKETS; socket_id++) {
-		if (!socket_id_to_dev(socket_id))
-			break;
-
-		err = hsmp_send_message(socket_id, &msg);
-		if (err)
-			break;
-	}
-
-	return err;
-}
-
-int hsmp_set_xgmi_auto(void)
-{
-	enum hsmp_xgmi_width min;
-
-	if (hsmp_data.x86_family >= 0x19)
-		min = HSMP_XGMI_WIDTH_X2;
-	else
-		min = HSMP_XGMI_WIDTH_X8;
-
-	return hsmp_set_xgmi_width(min, HSMP_XGMI_WIDTH_X16);
+	return hsmp_send_batch(reqs, n);
 }
 
-int hsmp_set_data_fabric_pstate(int socket_id, enum hsmp_df_pstate pstate)
+struct hsmp_async *hsmp_send_async(struct hsmp_request *reqs, int n)
 {
-	struct hsmp_message msg = { 0 };
+	struct hsmp_async *job;
 	int err;
 
-	/*
-	 * HSMP_AUTO_DF_PSTATE has the higher hsmp_msg_t so we use
-	 * that here for support validation. Both HSMP_AUTO_DF_PSTATE
-	 * and HSMP_SET_DF_PSTATE are supported in HSMP interface
-	 * versions 1 and later.
-	 */
-	err = hsmp_enter(HSMP_AUTO_DF_PSTATE);
+	err = hsmp_enter(HSMP_TEST);
 	if (err)
-		return err;
+		return NULL;
 
-	if (pstate < HSMP_DF_PSTATE_0 || pstate > HSMP_DF_PSTATE_AUTO) {
+	if (!reqs || n <= 0) {
 		errno = EINVAL;
-		return -1;
-	}
-
-	if (pstate == HSMP_DF_PSTATE_AUTO) {
-		msg.msg_num = HSMP_AUTO_DF_PSTATE;
-	} else {
-		msg.msg_num = HSMP_SET_DF_PSTATE;
-		msg.num_args = 1;
-		msg.args[0] = pstate;
+		return NULL;
 	}
 
-	return hsmp_send_message(socket_id, &msg);
-}
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return NULL;
 
-int hsmp_fabric_clocks(int socket_id, int *data_fabric_clock, int *mem_clock)
-{
-	struct hsmp_message msg = { 0 };
-	int err;
+	job->reqs = reqs;
+	job->n = n;
+	job->timeout_ns = thread_timeout_ns;
 
-	err = hsmp_enter(HSMP_GET_FCLK_MCLK);
-	if (err)
-		return err;
+	pthread_mutex_lock(&async_data.lock);
 
-	if (!data_fabric_clock && !mem_clock) {
-		errno = EINVAL;
-		return -1;
+	err = hsmp_async_setup();
+	if (err) {
+		pthread_mutex_unlock(&async_data.lock);
+		free(job);
+		return NULL;
 	}
 
-	msg.msg_num = HSMP_GET_FCLK_MCLK;
-	msg.response_sz = 2;
-
-	err = hsmp_send_message(socket_id, &msg);
-	if (err)
-		return err;
-
-	if (data_fabric_clock)
-		*data_fabric_clock = msg.response[0];
+	if (async_data.tail)
+		async_data.tail->next = job;
+	else
+		async_data.head = job;
+	async_data.tail = job;
 
-	if (mem_clock)
-		*mem_clock = msg.response[1];
+	pthread_cond_signal(&async_data.work);
+	pthread_mutex_unlock(&async_data.lock);
 
-	return 0;
+	return job;
 }
 
-int hsmp_data_fabric_clock(int socket_id, int *data_fabric_clock)
+static int hsmp_async_complete(struct hsmp_async *job)
 {
-	return hsmp_fabric_clocks(socket_id, data_fabric_clock, NULL);
-}
+	int err = job->err;
 
-int hsmp_memory_clock(int socket_id, int *mem_clock)
-{
-	return hsmp_fabric_clocks(socket_id, NULL, mem_clock);
+	errno = job->errnum;
+	free(job);
+
+	return err;
 }
 
-int hsmp_core_clock_max_frequency(int socket_id, u32 *max_freq)
+int hsmp_poll(struct hsmp_async *job)
 {
-	struct hsmp_message msg = { 0 };
-	int err;
-
-	err = hsmp_enter(HSMP_GET_CCLK_THROTTLE_LIMIT);
-	if (err)
-		return err;
+	bool done;
 
-	if (!max_freq) {
+	if (!job) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	msg.msg_num = HSMP_GET_CCLK_THROTTLE_LIMIT;
-	msg.response_sz = 1;
+	pthread_mutex_lock(&async_data.lock);
+	done = job->done;
+	pthread_mutex_unlock(&async_data.lock);
 
-	err = hsmp_send_message(socket_id, &msg);
-	if (err)
-		return err;
+	if (!done) {
+		errno = EAGAIN;
+		return -1;
+	}
 
-	*max_freq = msg.response[0];
-	return 0;
+	return hsmp_async_complete(job);
 }
 
-int hsmp_c0_residency(int socket_id, u32 *residency)
+int hsmp_wait(struct hsmp_async *job)
 {
-	struct hsmp_message msg = { 0 };
-	int err;
-
-	err = hsmp_enter(HSMP_GET_C0_PERCENT);
-	if (err)
-		return -1;
-
-	if (!residency) {
+	if (!job) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	msg.msg_num = HSMP_GET_C0_PERCENT;
-	msg.response_sz = 1;
-
-	err = hsmp_send_message(socket_id, &msg);
-	if (err)
-		return err;
+	pthread_mutex_lock(&async_data.lock);
+	while (!job->done)
+		pthread_cond_wait(&async_data.done, &async_data.lock);
+	pthread_mutex_unlock(&async_data.lock);
 
-	*residency = msg.response[0];
-	return 0;
+	return hsmp_async_complete(job);
 }
 
-int hsmp_set_nbio_pstate(u8 bus_num, enum hsmp_nbio_pstate pstate)
+int hsmp_async_fd(void)
 {
-	struct hsmp_message msg = { 0 };
-	struct nbio_dev *nbio;
-	u8 dpm_min, dpm_max;
-	int idx, socket_id;
 	int err;
 
-	err = hsmp_enter(HSMP_SET_NBIO_DPM_LEVEL);
+	err = hsmp_enter(HSMP_TEST);
 	if (err)
 		return -1;
 
-	idx = bus_to_nbio(bus_num);
-	if (idx == -1) {
-		errno = EINVAL;
-		return -1;
-	}
+	pthread_mutex_lock(&async_data.lock);
+	err = hsmp_async_setup();
+	pthread_mutex_unlock(&async_data.lock);
 
-	switch (pstate) {
-	case HSMP_NBIO_PSTATE_AUTO:
-		dpm_min = 0;
-		dpm_max = 2;
-		break;
-	case HSMP_NBIO_PSTATE_P0:
-		dpm_min = 2;
-		dpm_max = 2;
-		break;
-	default:
-		errno = EINVAL;
+	if (err)
 		return -1;
-	}
 
-	nbio = &hsmp_data.nbios[idx];
-	socket_id = (idx >= (MAX_NBIOS / 2)) ? 1 : 0;
-
-	msg.msg_num = HSMP_SET_NBIO_DPM_LEVEL;
-	msg.num_args = 1;
-	msg.args[0] = (nbio->id << 16) | (dpm_max << 8) | dpm_min;
-
-	return hsmp_send_message(socket_id, &msg);
+	return async_data.event_fd;
 }
 
-int hsmp_next_bus(int idx, u8 *bus_num)
+int hsmp_watch(int socket_id, unsigned int events, hsmp_watch_cb cb, void *data)
 {
-	int err, rv;
+	struct hsmp_watcher *w;
+	int err;
 
-	/* Perform library initialization and HSMP test message */
-	err = hsmp_enter(0);
+	err = hsmp_enter(HSMP_TEST);
 	if (err)
-		return err;
+		return -1;
+
+	if (events & HSMP_WATCH_PROC_HOT) {
+		err = hsmp_enter(HSMP_GET_PROC_HOT);
+		if (err)
+			return -1;
+	}
+
+	if (events & HSMP_WATCH_CCLK_LIMIT) {
+		err = hsmp_enter(HSMP_GET_CCLK_THROTTLE_LIMIT);
+		if (err)
+			return -1;
+	}
 
-	if (!bus_num || idx < 0 || idx >= MAX_NBIOS) {
+	if (!events || (events & ~HSMP_WATCH_ALL) ||
+	    socket_id < 0 || socket_id >= hsmp_data.num_sockets) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	if (!hsmp_data.nbios[idx].dev) {  /* No IOHC at this array index */
-		errno = ENODEV;
+	pthread_mutex_lock(&watch_data.lock);
+
+	err = hsmp_watch_setup();
+	if (err) {
+		pthread_mutex_unlock(&watch_data.lock);
 		return -1;
 	}
 
-	*bus_num = hsmp_data.nbios[idx].bus_base;
+	w = &watch_data.watchers[socket_id];
+	memset(w, 0, sizeof(*w));
+	w->events = events;
+	w->cb = cb;
+	w->data = data;
 
-	/*
-	 * Test if the next iteration would succeed. Return idx if so,
-	 * return 0 if not.
-	 */
-	rv = idx + 1;
-	if (rv == MAX_NBIOS || !hsmp_data.nbios[rv].dev)
-		rv = 0;
+	watch_data.changed = true;
+	pthread_cond_signal(&watch_data.wake);
+	pthread_mutex_unlock(&watch_data.lock);
 
-	return rv;
+	return 0;
 }
 
-int hsmp_ddr_bandwidths(int socket_id, u32 *max_bw,
-			u32 *utilized_bw, u32 *utilized_pct)
+int hsmp_unwatch(int socket_id)
 {
-	struct hsmp_message msg = { 0 };
-	u32 result;
+	unsigned int round;
 	int err;
 
-	err = hsmp_enter(HSMP_GET_DDR_BANDWIDTH);
+	err = hsmp_enter(HSMP_TEST);
 	if (err)
 		return -1;
 
-	if (!max_bw && !utilized_bw && !utilized_pct) {
+	pthread_mutex_lock(&watch_data.lock);
+
+	if (!watch_data.running || socket_id < 0 ||
+	    socket_id >= hsmp_data.num_sockets ||
+	    !watch_data.watchers[socket_id].events) {
+		err = -1;
 		errno = EINVAL;
-		return -1;
-	}
+	} else {
+		watch_data.watchers[socket_id].events = 0;
 
-	msg.msg_num = HSMP_GET_DDR_BANDWIDTH;
-	msg.response_sz = 1;
+		/*
+		 * A callback of the watch may already be running, wait for the
+		 * round to complete, unless called from a callback.
+		 */
+		round = watch_data.cb_round;
+		while (watch_data.in_callbacks && watch_data.cb_round == round &&
+		       !pthread_equal(pthread_self(), watch_data.thread))
+			pthread_cond_wait(&watch_data.cb_done, &watch_data.lock);
+	}
 
-	err = hsmp_send_message(socket_id, &msg);
-	if (err)
-		return err;
+	pthread_mutex_unlock(&watch_data.lock);
+	return err;
+}
 
-	result = msg.response[0];
+int hsmp_watch_fd(void)
+{
+	int err;
 
-	if (max_bw)
-		*max_bw = result >> 20;
+	err = hsmp_enter(HSMP_TEST);
+	if (err)
+		return -1;
 
-	if (utilized_bw)
-		*utilized_bw = (result >> 8) & 0xFFFFF;
+	pthread_mutex_lock(&watch_data.lock);
+	err = hsmp_watch_setup();
+	pthread_mutex_unlock(&watch_data.lock);
 
-	if (utilized_pct)
-		*utilized_pct = result & 0xFF;
+	if (err)
+		return -1;
 
-	return 0;
+	return watch_data.event_fd;
 }
 
-int hsmp_ddr_max_bandwidth(int socket_id, u32 *max_bw)
+int hsmp_watch_read(struct hsmp_watch_event *events, int max)
 {
-	return hsmp_ddr_bandwidths(socket_id, max_bw, NULL, NULL);
-}
+	int n;
 
-int hsmp_ddr_utilized_bandwidth(int socket_id, u32 *utilized_bw)
-{
-	return hsmp_ddr_bandwidths(socket_id, NULL, utilized_bw, NULL);
-}
+	if (!events || max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
 
-int hsmp_ddr_utilized_percent(int socket_id, u32 *utilized_pct)
-{
-	return hsmp_ddr_bandwidths(socket_id, NULL, NULL, utilized_pct);
-}
+	pthread_mutex_lock(&watch_data.lock);
+
+	for (n = 0; n < max && watch_data.count; n++) {
+		events[n] = watch_data.queue[watch_data.head];
+		watch_data.head = (watch_data.head + 1) % WATCH_QUEUE_SZ;
+		watch_data.count--;
+	}
 
+	pthread_mutex_unlock(&watch_data.lock);
+	return n;
+}
@@ -11,6 +11,7 @@
 #ifndef _LIBHSMP_H_
 #define _LIBHSMP_H_ 1
 
+#include <sched.h>
 #include <pci/types.h>
 
 /* HSMP error codes as defined in the PPR */
@@ -20,6 +21,187 @@
 /* Wrapper to retrieve HSMP error or errno string */
 char *hsmp_strerror(int err, int ernno_val);
 
+/*
+ * Library initialization.
+ *
+ * libhsmp initializes itself on the first call to any interface. The CPU
+ * map used by the per-CPU boost limit interfaces and the IOHC IDs used by
+ * hsmp_set_nbio_pstate() are set up the first time they are needed.
+ *
+ * hsmp_init_ex() initializes the library explicitly, which allows
+ * initialization failures to be reported up front. The flags select eager
+ * setup of the CPU map (HSMP_INIT_EAGER_CPUS) and IOHC IDs
+ * (HSMP_INIT_EAGER_NBIOS). IOHC devices are normally looked up directly
+ * on each PCI root bus, HSMP_INIT_PCI_SCAN scans the entire PCI tree
+ * instead. HSMP_INIT_SIM replaces the hardware with a simulated SMU, as
+ * does setting HSMP_SIM in the environment, see the README. HSMP_INIT_PCI_SCAN
+ * and HSMP_INIT_SIM have no effect once libhsmp is initialized.
+ *
+ * Initialization runs once per process, on the first call made with root
+ * privileges, and its failure is returned by every later call. All
+ * interfaces may be called from multiple threads, messages to different
+ * sockets are sent in parallel.
+ */
+#define HSMP_INIT_EAGER_CPUS	0x1
+#define HSMP_INIT_EAGER_NBIOS	0x2
+#define HSMP_INIT_PCI_SCAN	0x4
+#define HSMP_INIT_SIM		0x8
+
+int hsmp_init_ex(unsigned int flags);
+
+/*
+ * Message types
+ *
+ * All implementations are required to support HSMP_TEST, HSMP_GET_SMU_VER,
+ * and HSMP_GET_PROTO_VER. All other messages are implementation dependent.
+ */
+enum hsmp_msg_t {
+	HSMP_TEST				=  1,
+	HSMP_GET_SMU_VER			=  2,
+	HSMP_GET_PROTO_VER			=  3,
+	HSMP_GET_SOCKET_POWER			=  4,
+	HSMP_SET_SOCKET_POWER_LIMIT		=  5,
+	HSMP_GET_SOCKET_POWER_LIMIT		=  6,
+	HSMP_GET_SOCKET_POWER_LIMIT_MAX		=  7,
+	HSMP_SET_BOOST_LIMIT			=  8,
+	HSMP_SET_BOOST_LIMIT_SOCKET		=  9,
+	HSMP_GET_BOOST_LIMIT			= 10,
+	HSMP_GET_PROC_HOT			= 11,
+	HSMP_SET_XGMI_LINK_WIDTH		= 12,
+	HSMP_SET_DF_PSTATE			= 13,
+	HSMP_AUTO_DF_PSTATE			= 14,
+	HSMP_GET_FCLK_MCLK			= 15,
+	HSMP_GET_CCLK_THROTTLE_LIMIT		= 16,
+	HSMP_GET_C0_PERCENT			= 17,
+	HSMP_SET_NBIO_DPM_LEVEL			= 18,
+	HSMP_GET_DDR_BANDWIDTH			= 20,
+};
+
+/*
+ * Note on mailbox polling.
+ *
+ * Once a message has been written to the HSMP mailbox, libhsmp polls the
+ * mailbox status register until the SMU responds or the mailbox timeout
+ * expires. Polling busy-waits for the first spin_us microseconds, then
+ * sleeps between status reads starting at min_sleep_us and doubling on
+ * each retry up to max_sleep_us.
+ *
+ * Short running messages (e.g. HSMP_GET_SOCKET_POWER) typically complete
+ * well within the spin window, longer running messages can use a shorter
+ * window to avoid burning CPU cycles. Setting both min_sleep_us and
+ * max_sleep_us to 0 polls without ever sleeping.
+ */
+struct hsmp_poll_policy {
+	u32 spin_us;		/* Busy-wait window before the first sleep */
+	u32 min_sleep_us;	/* Initial back-off sleep */
+	u32 max_sleep_us;	/* Maximum back-off sleep */
+};
+
+/*
+ * Set the polling policy used for the specified message ID. Specifying a
+ * msg_id of 0 sets the policy for all message IDs.
+ */
+int hsmp_set_poll_policy(enum hsmp_msg_t msg_id,
+			 const struct hsmp_poll_policy *policy);
+
+/* Get the polling policy used for the specified message ID. */
+int hsmp_get_poll_policy(enum hsmp_msg_t msg_id,
+			 struct hsmp_poll_policy *policy);
+
+/*
+ * Send timeouts.
+ *
+ * By default a message waits for the socket lock, which other threads and
+ * processes using HSMP may hold, for as long as it takes and is then
+ * allowed 500ms for the SMU to respond. hsmp_set_timeout_us() bounds the
+ * time each message, or batch of messages, sent by the calling thread may
+ * wait to be sent to timeout_us microseconds from its start, including the
+ * wait for the lock. A message that has been sent is still allowed the
+ * full 500ms for the SMU to respond so the mailbox is never handed to the
+ * next sender while busy. Requests submitted with hsmp_send_async() use
+ * the timeout of the submitting thread. A timeout of 0 restores the
+ * default. Messages sent through the amd_hsmp driver are subject to the
+ * driver's own timeout.
+ *
+ * A message that fails because a timeout expires reports one of
+ *	EBUSY		the timeout expired before the message was sent to
+ *			the SMU, it is safe to retry
+ *	ETIMEDOUT	the message was sent but the SMU did not respond
+ *			within 500ms, it may still take effect later
+ */
+int hsmp_set_timeout_us(u32 timeout_us);
+
+u32 hsmp_get_timeout_us(void);
+
+/*
+ * Mailbox counters.
+ *
+ * Running totals for all messages sent since the library was loaded.
+ * busy_ns is the time spent sending messages, including waiting for the
+ * socket lock, a batch adds its elapsed time once. max_latency_ns is the
+ * longest single message or batch.
+ */
+struct hsmp_mbox_counters {
+	unsigned long long	messages;
+	unsigned long long	errors;		/* Failed messages, incl. timeouts */
+	unsigned long long	timeouts;	/* Messages failed with ETIMEDOUT */
+	unsigned long long	busy_ns;
+	unsigned long long	max_latency_ns;
+};
+
+int hsmp_mbox_counters(struct hsmp_mbox_counters *counters);
+
+/*
+ * Per message ID statistics.
+ *
+ * Only kept when libhsmp is built with --enable-stats (HSMP_STATS),
+ * otherwise hsmp_get_stats() and hsmp_reset_stats() fail with ENOTSUP.
+ *
+ * lock_wait covers taking the socket lock, a batch waits once per socket
+ * for its first message. service covers writing the message to the
+ * mailbox until the SMU responds, or the ioctl when using /dev/hsmp.
+ * Histogram bucket 0 counts times below 1 us, bucket i counts times of
+ * [2^(i-1), 2^i) us and the last bucket also counts anything longer.
+ *
+ * A msg_id of 0 reports the totals of all message IDs.
+ */
+#define HSMP_STATS_BUCKETS	20
+
+struct hsmp_msg_stats {
+	unsigned long long	calls;
+	unsigned long long	successes;
+	unsigned long long	smu_errors;	/* HSMP error status from the SMU */
+	unsigned long long	timeouts;	/* ETIMEDOUT */
+	unsigned long long	errors;		/* Other failures, e.g. PCI access */
+	unsigned long long	polls;		/* Mailbox status reads */
+	unsigned long long	lock_wait_ns;
+	unsigned long long	service_ns;
+	unsigned long long	max_service_ns;
+	unsigned long long	lock_wait_hist[HSMP_STATS_BUCKETS];
+	unsigned long long	service_hist[HSMP_STATS_BUCKETS];
+};
+
+int hsmp_get_stats(enum hsmp_msg_t msg_id, struct hsmp_msg_stats *stats);
+int hsmp_reset_stats(void);
+
+/*
+ * Note on caching.
+ *
+ * Values that cannot change at runtime, the maximum socket power limit
+ * and the maximum DDR bandwidth, are read from the SMU once and cached.
+ *
+ * Values that can change, the current socket power limit and the core
+ * boost limits, can also be cached to save mailbox round trips in control
+ * loops. Caching of these is disabled by default, hsmp_set_cache_ttl()
+ * sets how long (in milliseconds) a value read from the SMU is reused.
+ * A TTL of HSMP_CACHE_TTL_FOREVER reuses values until they are set through
+ * libhsmp, a TTL of 0 disables caching. Note that limits set by other
+ * agents (e.g. a BMC) are not seen until the cached value expires.
+ */
+#define HSMP_CACHE_TTL_FOREVER	0xFFFFFFFF
+
+int hsmp_set_cache_ttl(u32 ttl_ms);
+
 struct smu_fw_version {
 	u8 debug;	/* Debug version number */
 	u8 minor;	/* Minor version number */
@@ -95,6 +277,31 @@ int hsmp_socket_max_power_limit(int socket_id, u32 *max_power);
 /* Set HSMP Boost Limit for the specified core. */
 int hsmp_set_cpu_boost_limit(int cpu, u32 boost_limit);
 
+/*
+ * Set HSMP Boost Limits for the n CPUs in the cpus array, cpus[i] is set
+ * to limits[i]. Entries for SMT siblings are collapsed into a single
+ * update of the core, the last entry for a core wins. Cores whose limit
+ * last set through libhsmp matches are skipped, note that this does not
+ * see limits set by other processes. If every core in a socket is given
+ * the same limit a single socket boost limit update is sent. If any CPU
+ * is invalid no limits are set and -1 is returned with errno set to EINVAL.
+ */
+int hsmp_set_cpu_boost_limits(const int *cpus, const u32 *limits, int n);
+
+#ifdef CPU_SETSIZE
+/*
+ * Set the HSMP Boost Limit of every CPU in a cpuset, such as one read from
+ * a cgroup's cpuset.cpus, to limit with the fewest messages. A socket
+ * whose cores are all in the set gets a single socket boost limit update,
+ * the other cores get one update each with SMT siblings collapsed, and
+ * cores already at the limit are skipped as for hsmp_set_cpu_boost_limits().
+ * An empty set, or a set holding a CPU not known to libhsmp, sets no
+ * limits and returns -1 with errno set to EINVAL. Only declared when
+ * cpu_set_t is available, i.e. _GNU_SOURCE is defined.
+ */
+int hsmp_set_cpuset_boost_limit(const cpu_set_t *set, u32 limit);
+#endif
+
 /* Set HSMP Boost Limit for all cores in the specified socket. */
 int hsmp_set_socket_boost_limit(int socket_id, u32 boost_limit);
 
@@ -104,6 +311,14 @@ int hsmp_set_system_boost_limit(u32 boost_limit);
 /* Get the HSMP Boost Limit for the specified core. */
 int hsmp_cpu_boost_limit(int cpu, u32 *boost_limit);
 
+/*
+ * Get the HSMP Boost Limits for the n CPUs in the cpus array, storing the
+ * limit for cpus[i] in boost_limits[i]. The limit is read once for each
+ * physical core, under a single lock per socket. If any CPU is invalid
+ * no limits are read and -1 is returned with errno set to EINVAL.
+ */
+int hsmp_cpu_boost_limits(const int *cpus, int n, u32 *boost_limits);
+
 /*
  * Get normalized status of the specified CPUs PROC_HOT status.
  * (1 = active, 0 = inactive)
@@ -154,6 +369,13 @@ enum hsmp_df_pstate {
 /* Set the data fabric P-state for the specified socket. */
 int hsmp_set_data_fabric_pstate(int socket_id, enum hsmp_df_pstate pstate);
 
+/*
+ * Get the data fabric P-state last set through libhsmp for the specified
+ * socket. The SMU does not report the DF P-state, if no P-state has been
+ * set by this process -1 is returned with errno set to ENODATA.
+ */
+int hsmp_data_fabric_pstate(int socket_id, enum hsmp_df_pstate *pstate);
+
 /*
  * Get the current data fabric clock (in MHz) and memory clock (in MHz)
  * for the specified socket.
@@ -197,6 +419,28 @@ enum hsmp_nbio_pstate {
  */
 int hsmp_set_nbio_pstate(u8 bus_num, enum hsmp_nbio_pstate pstate);
 
+/*
+ * Set the NBIO P-state for the root complex hosting the PCI-e device at
+ * domain:bus:dev.fn. hsmp_set_nbio_pstate_for_devices() does the same for
+ * the n devices in devs, sending a single message for each root complex
+ * hosting one or more of them. If any device cannot be mapped to a root
+ * complex no P-state is set and -1 is returned with errno set to EINVAL.
+ *
+ * Only available on systems with hsmp interface version >= 2.
+ */
+struct hsmp_pci_bdf {
+	u16	domain;
+	u8	bus;
+	u8	dev;
+	u8	fn;
+};
+
+int hsmp_set_nbio_pstate_for_device(int domain, u8 bus, u8 dev, u8 fn,
+				    enum hsmp_nbio_pstate pstate);
+
+int hsmp_set_nbio_pstate_for_devices(const struct hsmp_pci_bdf *devs, int n,
+				     enum hsmp_nbio_pstate pstate);
+
 /*
  * Helper function to iterate over enumerated PCIe controller complexes in
  * the system. Begin a new search by setting idx = 0. If the return value
@@ -250,4 +494,205 @@ int hsmp_ddr_utilized_bandwidth(int socket_id, u32 *utilized_bw);
  */
 int hsmp_ddr_utilized_percent(int socket_id, u32 *utilized_pct);
 
+/*
+ * Socket telemetry snapshot.
+ *
+ * Reads the requested telemetry fields for a socket while holding the
+ * socket lock once, so the values are sampled at close to the same moment.
+ * fields_mask is a combination of HSMP_TELEMETRY_* flags, the valid member
+ * of the returned struct indicates which fields were read. Fields whose
+ * message is not supported by the HSMP interface version are not read.
+ *
+ * Returns 0 if every requested and supported field was read. If reading
+ * any field fails -1 is returned with errno set to EIO, the fields that
+ * were read successfully are still reported in valid.
+ */
+#define HSMP_TELEMETRY_POWER		0x0001	/* power */
+#define HSMP_TELEMETRY_POWER_LIMIT	0x0002	/* power_limit */
+#define HSMP_TELEMETRY_MAX_POWER_LIMIT	0x0004	/* max_power_limit */
+#define HSMP_TELEMETRY_FABRIC_CLOCKS	0x0008	/* data_fabric_clock, mem_clock */
+#define HSMP_TELEMETRY_CCLK_LIMIT	0x0010	/* cclk_limit */
+#define HSMP_TELEMETRY_C0_RESIDENCY	0x0020	/* c0_residency */
+#define HSMP_TELEMETRY_PROC_HOT		0x0040	/* proc_hot */
+#define HSMP_TELEMETRY_DDR_BANDWIDTH	0x0080	/* ddr_max_bw, ddr_utilized_* */
+#define HSMP_TELEMETRY_ALL		0x00FF
+
+struct hsmp_telemetry {
+	unsigned int	valid;			/* HSMP_TELEMETRY_* fields read */
+	u32		power;			/* Socket power in mW */
+	u32		power_limit;		/* Socket power limit in mW */
+	u32		max_power_limit;	/* Max socket power limit in mW */
+	int		data_fabric_clock;	/* Data fabric clock in MHz */
+	int		mem_clock;		/* Memory clock in MHz */
+	u32		cclk_limit;		/* Core clock limit in MHz */
+	u32		c0_residency;		/* C0 residency percentage */
+	int		proc_hot;		/* PROC_HOT status, 1 = active */
+	u32		ddr_max_bw;		/* Max DDR bandwidth in GB/s */
+	u32		ddr_utilized_bw;	/* Utilized DDR bandwidth in GB/s */
+	u32		ddr_utilized_pct;	/* Utilized DDR bandwidth percent */
+};
+
+int hsmp_socket_telemetry(int socket_id, struct hsmp_telemetry *telemetry,
+			  unsigned int fields_mask);
+
+/*
+ * Batched message submission.
+ *
+ * Describes a single HSMP message to be sent to the specified socket as
+ * part of a batch. The caller fills in socket_id, msg_id, the message
+ * arguments and the number of expected response words, as documented in
+ * the PPR for each message ID. On completion err is set to 0 for success,
+ * -1 with errnum holding the errno value, or a HSMP defined error.
+ */
+struct hsmp_request {
+	int		socket_id;	/* Target socket */
+	enum hsmp_msg_t	msg_id;		/* Message ID */
+	u16		num_args;	/* Number of arguments in message */
+	u16		response_sz;	/* Number of expected response words */
+	u32		args[8];	/* Argument(s) */
+	u32		response[8];	/* Response word(s) */
+	int		err;		/* Result of the request */
+	int		errnum;		/* errno value if err is -1 */
+};
+
+/*
+ * Submit a batch of n requests. Each socket's lock is taken once for the
+ * whole batch. Requests to the same socket are sent in array order while
+ * requests to different sockets are serviced concurrently. The num_args
+ * and response_sz of each request must match those the message is defined
+ * with, a request that doesn't fails with errnum set to EINVAL.
+ *
+ * Returns 0 if every request succeeded. If any request fails -1 is returned
+ * with errno set to EIO and the err and errnum fields of each request
+ * indicate its individual result.
+ */
+int hsmp_submit_batch(struct hsmp_request *reqs, int n);
+
+/*
+ * Asynchronous message submission.
+ *
+ * hsmp_send_async() queues a batch of n requests to a library worker
+ * thread and returns immediately with a handle for the submission, or
+ * NULL with errno set on failure. The requests array must remain valid
+ * until the submission has been collected with hsmp_poll() or
+ * hsmp_wait(), which return the same results as hsmp_submit_batch()
+ * and release the handle.
+ *
+ * hsmp_poll() does not block, if the submission is still in progress it
+ * returns -1 with errno set to EAGAIN and the handle remains valid.
+ *
+ * hsmp_async_fd() returns an eventfd that becomes readable whenever an
+ * asynchronous submission completes, suitable for use with poll/epoll.
+ * The caller should read the eventfd to clear it and then call hsmp_poll()
+ * on its outstanding handles. The descriptor is owned by the library and
+ * must not be closed by the caller.
+ *
+ * Submissions still outstanding in a child forked by the submitting
+ * process, or when the library is unloaded, complete with -1 and errno
+ * set to ECANCELED. A forked child gets a new eventfd from hsmp_async_fd().
+ */
+struct hsmp_async;
+
+struct hsmp_async *hsmp_send_async(struct hsmp_request *reqs, int n);
+
+int hsmp_poll(struct hsmp_async *handle);
+
+int hsmp_wait(struct hsmp_async *handle);
+
+int hsmp_async_fd(void);
+
+/*
+ * Throttle watch.
+ *
+ * hsmp_watch() registers interest in changes of the PROC_HOT status and/or
+ * core clock limit, as read by hsmp_proc_hot_status() and
+ * hsmp_core_clock_max_frequency(), of a socket, replacing any previous
+ * watch of the socket. A library thread polls all watched sockets in one
+ * batch, every 20ms while a watched socket is throttling (PROC_HOT is
+ * active or the core clock limit is below the highest limit seen) or just
+ * changed, backing off to once a second while nothing changes.
+ *
+ * Each change is reported as a struct hsmp_watch_event timestamped with
+ * CLOCK_MONOTONIC, the first poll of a watch reports the initial state.
+ * Events are passed to cb, called from the library thread, or if cb is
+ * NULL queued for hsmp_watch_read(), which returns the number of events
+ * copied to events, 0 if none are queued. Up to 256 events are queued,
+ * the oldest are dropped when the queue is full.
+ *
+ * hsmp_watch_fd() returns an eventfd that becomes readable when events
+ * are queued, to be read and cleared by the caller before calling
+ * hsmp_watch_read(). The descriptor is owned by the library.
+ *
+ * hsmp_unwatch() stops watching a socket, returning -1 with errno set to
+ * EINVAL if it was not watched. Once it returns the watch's callback is
+ * no longer running and will not be called again, so its data may be
+ * freed. Called from a callback, it returns without waiting for the
+ * callbacks of the current round.
+ *
+ * Watches are not inherited by a forked child.
+ */
+#define HSMP_WATCH_PROC_HOT	0x1
+#define HSMP_WATCH_CCLK_LIMIT	0x2
+#define HSMP_WATCH_ALL		0x3
+
+struct hsmp_watch_event {
+	int			socket_id;
+	unsigned int		changed;	/* HSMP_WATCH_* values that changed */
+	int			proc_hot;	/* PROC_HOT status, 1 = active */
+	u32			cclk_limit;	/* Core clock limit in MHz */
+	unsigned long long	timestamp_ns;	/* CLOCK_MONOTONIC */
+};
+
+typedef void (*hsmp_watch_cb)(const struct hsmp_watch_event *event, void *data);
+
+int hsmp_watch(int socket_id, unsigned int events, hsmp_watch_cb cb, void *data);
+
+int hsmp_unwatch(int socket_id);
+
+int hsmp_watch_fd(void);
+
+int hsmp_watch_read(struct hsmp_watch_event *events, int max);
+
+/*
+ * Performance profiles.
+ *
+ * A profile is an array of settings, each setting a value for the target
+ * described below. hsmp_apply_profile() sends all n settings as a single
+ * batch, settings for the same socket are applied in array order. Every
+ * setting is validated first, if any is invalid nothing is sent and -1 is
+ * returned with errno set to EINVAL, or ENOMSG if the HSMP interface does
+ * not support it. If any message fails, the settings the profile changes
+ * are restored to their values from before the call and the first failure
+ * is returned as the matching single setting interface would.
+ *
+ * hsmp_snapshot_profile() stores up to max settings describing the current
+ * socket power limits, boost limits, DF P-states, xGMI width and NBIO
+ * P-states, which hsmp_apply_profile() can restore later. It returns the
+ * number of settings in the snapshot, which may be larger than max, or -1
+ * with errno set. Boost limits are reported per socket where every core
+ * has the same limit. The SMU does not report the DF P-state, xGMI width
+ * or NBIO P-state, the snapshot holds the value last set through libhsmp
+ * by this process, or automatic selection if none was set.
+ */
+enum hsmp_setting_t {
+	HSMP_SETTING_SOCKET_POWER_LIMIT,	/* Socket, mW */
+	HSMP_SETTING_SOCKET_BOOST_LIMIT,	/* Socket, MHz */
+	HSMP_SETTING_CPU_BOOST_LIMIT,		/* CPU, MHz */
+	HSMP_SETTING_DF_PSTATE,			/* Socket, enum hsmp_df_pstate */
+	HSMP_SETTING_XGMI_WIDTH,		/* Unused, HSMP_XGMI_WIDTHS() */
+	HSMP_SETTING_NBIO_PSTATE,		/* PCI-e bus, enum hsmp_nbio_pstate */
+};
+
+#define HSMP_XGMI_WIDTHS(min, max)	((min) << 8 | (max))
+
+struct hsmp_setting {
+	enum hsmp_setting_t	type;
+	int			target;
+	u32			value;
+};
+
+int hsmp_apply_profile(const struct hsmp_setting *settings, int n);
+
+int hsmp_snapshot_profile(struct hsmp_setting *settings, int max);
+
 #endif